@@ -0,0 +1,183 @@
+/*
+ * Throughput and latency benchmark for the frame format of write_can()/read_can().
+ *
+ * Every frame runs through pack_can_frame() and unpack_can_frame(), the same functions that are used on the bus, so
+ * the encrypted runs include the IV generation, the AAD timestamp, the replay check and the AES-GCM tag verification.
+ * The runs are repeated for the legacy and the compact frame layout with and without encryption, for several batch sizes
+ * and offered frame rates. The bytes column is the mean data field length on the bus, which decides the bus load.
+ *
+ * Usage: crypto_bench [frames_per_run]
+ */
+#include "can.h"
+#include "crypto.h"
+#include <linux/can.h>
+#include <openssl/crypto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_FRAMES_PER_RUN 2000
+#define MAX_BATCH 32
+
+static const int batch_sizes[] = {1, 8, MAX_BATCH};
+// Offered load in frames per second, 0 runs as fast as possible
+static const long frame_rates[] = {1000, 10000, 100000, 0};
+
+static unsigned long allocations = 0;
+
+static void *counting_malloc(size_t num, const char *file, int line) {
+  (void)file;
+  (void)line;
+  allocations++;
+  return malloc(num);
+}
+
+static void *counting_realloc(void *addr, size_t num, const char *file, int line) {
+  (void)file;
+  (void)line;
+  allocations++;
+  return realloc(addr, num);
+}
+
+static void counting_free(void *addr, const char *file, int line) {
+  (void)file;
+  (void)line;
+  free(addr);
+}
+
+static long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void sleep_until_ns(long deadline_ns) {
+  struct timespec ts = {.tv_sec = deadline_ns / 1000000000L, .tv_nsec = deadline_ns % 1000000000L};
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+static long percentile(long *sorted, int n, double p) {
+  int i = (int)(p * (n - 1));
+  return sorted[i];
+}
+
+/**
+ * Runs frames through pack_can_frame() and unpack_can_frame() in batches and prints one result line
+ * @return 0 if every frame was decoded to its original payload
+ */
+static int run(int frames, int batch_size, long frame_rate, long *latencies) {
+  can_message_t in[MAX_BATCH];
+  can_message_t out[MAX_BATCH];
+  struct canfd_frame frames_on_bus[MAX_BATCH];
+  int errors = 0;
+  int done = 0;
+  long bus_bytes = 0;
+
+  unsigned long allocations_before = allocations;
+  long batch_interval_ns = frame_rate > 0 ? 1000000000L * batch_size / frame_rate : 0;
+  long start = now_ns();
+  long next_batch = start;
+
+  while (done < frames) {
+    int n = frames - done < batch_size ? frames - done : batch_size;
+    if (batch_interval_ns > 0) {
+      sleep_until_ns(next_batch);
+      next_batch += batch_interval_ns;
+    }
+
+    long batch_start = now_ns();
+    for (int i = 0; i < n; i++) {
+      memset(&in[i], 0, sizeof(can_message_t));
+      in[i].id = ENGINE_RPM_MSG;
+      in[i].length = 8;
+      in[i].buffer[0] = (done + i) >> 8;
+      in[i].buffer[1] = (done + i) & 0xFF;
+      if (pack_can_frame(&in[i], &frames_on_bus[i]) != 0) {
+        errors++;
+      }
+      bus_bytes += frames_on_bus[i].len;
+    }
+    for (int i = 0; i < n; i++) {
+      if (unpack_can_frame(&frames_on_bus[i], &out[i]) != 0 || memcmp(in[i].buffer, out[i].buffer, 16) != 0) {
+        errors++;
+      }
+      // A frame is done when the receiver has its plaintext, so frames late in a batch also wait for the ones before
+      latencies[done + i] = now_ns() - batch_start;
+    }
+    done += n;
+  }
+  long elapsed = now_ns() - start;
+  unsigned long frame_allocations = allocations - allocations_before;
+
+  qsort(latencies, frames, sizeof(long), compare_long);
+  printf("%-8s %-8s %5d %10ld %12.0f %6.1f %9.2f %9.2f %9.2f %12.2f %6d\n", can_frame_format == CAN_FRAME_FORMAT_COMPACT ? "compact" : "legacy",
+         using_encryption ? "aes-gcm" : "plain", batch_size, frame_rate, frames / (elapsed / 1e9), (double)bus_bytes / frames,
+         percentile(latencies, frames, 0.50) / 1e3, percentile(latencies, frames, 0.99) / 1e3, percentile(latencies, frames, 0.999) / 1e3,
+         (double)frame_allocations / frames, errors);
+  return errors == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+  int frames = DEFAULT_FRAMES_PER_RUN;
+  int result = 0;
+
+  if (argc > 1) {
+    frames = atoi(argv[1]);
+    if (frames <= 0) {
+      fprintf(stderr, "Usage: %s [frames_per_run]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  // Must happen before OpenSSL allocates anything, afterwards every OpenSSL allocation is counted
+  if (!CRYPTO_set_mem_functions(counting_malloc, counting_realloc, counting_free)) {
+    fprintf(stderr, "Failed to install the OpenSSL allocation counters\n");
+  }
+
+  long *latencies = malloc(sizeof(long) * frames);
+  if (latencies == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  crypto_nonce_init(1);
+  static unsigned char key[32];
+  for (int i = 0; i < 32; i++) {
+    key[i] = i + 1;
+  }
+
+  printf("%-8s %-8s %5s %10s %12s %6s %9s %9s %9s %12s %6s\n", "layout", "format", "batch", "rate[f/s]", "frames/s", "bytes", "p50[us]",
+         "p99[us]", "p999[us]", "allocs/frame", "errors");
+  for (int layout = CAN_FRAME_FORMAT_LEGACY; layout <= CAN_FRAME_FORMAT_COMPACT; layout++) {
+    can_frame_format = layout;
+    for (int encrypted = 0; encrypted <= 1; encrypted++) {
+      using_encryption = encrypted;
+      encryption_key = encrypted ? key : NULL;
+      if (encrypted) {
+        // The IV length depends on the layout, so every layout gets its own session
+        crypto_session = crypto_session_new(encryption_key, can_frame_iv_len());
+      }
+      for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+        for (size_t r = 0; r < sizeof(frame_rates) / sizeof(frame_rates[0]); r++) {
+          if (run(frames, batch_sizes[b], frame_rates[r], latencies) != 0) {
+            result = -1;
+          }
+        }
+      }
+      if (encrypted) {
+        crypto_session_free(crypto_session);
+        crypto_session = NULL;
+      }
+    }
+  }
+
+  free(latencies);
+  return result;
+}
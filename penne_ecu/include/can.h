@@ -5,8 +5,27 @@
 #include <unistd.h>
 
 #define MAX_MSGS 32
+// Spacing in microseconds between consecutive frames, the batched transmission only applies it if CAN_TX_USE_TXTIME is enabled
 #define CAN_MSG_SPACING 10
-#define HIGHEST_POSSIBLE_CAN_ID 0xFFF
+// Set to 1 to give every frame of a batch an SO_TXTIME launch time, the spacing is then done by an etf qdisc
+// (e.g. "tc qdisc add dev vcan0 root etf clockid CLOCK_TAI delta 100000"), without such a qdisc the launch time is ignored
+#ifndef CAN_TX_USE_TXTIME
+#define CAN_TX_USE_TXTIME 0
+#endif
+// Messages that are due within this many microseconds are sent together with the earliest due message
+#define CAN_TX_SLACK 300
+// Maximum number of frames that are read from a socket per wakeup, so a flooded bus can not starve the cyclic transmissions
+#define CAN_RX_BUDGET 64
+
+// Compact authenticated frame format: <ciphertext, padded to a CAN FD length> <8 byte freshness value> <8 byte truncated tag>
+// The freshness value is the sender ID (1 byte) followed by a 56 bit message counter, the 96 bit IV is derived from it
+#define COMPACT_FRESHNESS_LEN 8
+#define COMPACT_TAG_LEN 8
+#define COMPACT_AUTH_LEN (COMPACT_FRESHNESS_LEN + COMPACT_TAG_LEN)
+#define COMPACT_IV_LEN 12
+#define COMPACT_COUNTER_MASK 0x00FFFFFFFFFFFFFFULL
+// Maximum age of the first frame of a sender that has no replay window yet, the counter is a time in microseconds
+#define COMPACT_FIRST_FRAME_MAX_AGE 1000000
 
 // Powertrain
 // 100Hz
@@ -49,6 +68,15 @@
 #define L_DOOR_POSITION_MSG 0x2bc
 #define R_DOOR_POSITION_MSG 0x2a7
 
+struct canfd_frame;
+
+/**
+ * Layout of the frames on the bus, all ECUs on a bus have to use the same format
+ * LEGACY: always 64 bytes, <16 byte ciphertext> <16 byte tag> <8 byte timestamp AAD> <16 byte random IV> if encrypted
+ * COMPACT: sized to the payload, see COMPACT_FRESHNESS_LEN
+ */
+typedef enum { CAN_FRAME_FORMAT_LEGACY, CAN_FRAME_FORMAT_COMPACT } can_frame_format_t;
+
 /**
  * Struct that holds a CAN message
  */
@@ -56,8 +84,21 @@ typedef struct can_message_t {
     size_t id;
     unsigned char length;
     unsigned char buffer[64];
+    long timestamp; // Time in microseconds (same clock as monotonic_micros()) at which the kernel received the frame
 } can_message_t;
 
+/**
+ * Counters of the receive pipeline, every received frame is either dropped by exactly one stage or dispatched
+ */
+typedef struct can_rx_stats_t {
+    unsigned long received;
+    unsigned long dropped_malformed;  // Header peek: wrong size, error/remote/extended frame
+    unsigned long dropped_irrelevant; // The ID is not consumed by this ECU
+    unsigned long dropped_replay;     // Freshness check failed
+    unsigned long dropped_auth;       // Authentication or decryption failed
+    unsigned long dispatched;         // Handed to the message handler
+} can_rx_stats_t;
+
 /**
  * Struct for the definition of repeated CAN messages that are sent from the ECU
  */
@@ -68,17 +109,17 @@ typedef struct msg_def_t {
     unsigned int freq;
 } msg_def_t;
 
+extern int vcan0_tx_socket;
+extern int vcan1_tx_socket;
+
 extern bool b_100_hz;
 extern bool b_20_hz;
 extern bool b_10_hz;
 extern bool b_2_hz;
 
-extern long can_msg_timings_receive[];
-extern long can_msg_timings_send[];
-extern unsigned int can_reverence_timings[];
-
-extern bool gateway_read_whitelist[];
-extern bool gateway_write_whitelist[];
+extern can_frame_format_t can_frame_format;
+// Every bus is read by one thread, so the counters are kept per thread
+extern _Thread_local can_rx_stats_t can_rx_stats;
 
 /**
  * Initializes the vCAN Bus integrated in the Linux kernel by creating a socket and binding to it.
@@ -88,6 +129,18 @@ extern bool gateway_write_whitelist[];
  */
 int init_can(char *interface_name);
 
+/**
+ * Installs a CAN_RAW_FILTER on a socket, so the kernel only delivers frames with one of the given IDs.
+ * Frames with other IDs never wake up the ECU and are never copied or decrypted.
+ * @param rx_socket CAN socket created by init_can(...)
+ * @param ids CAN IDs that should be received, an empty list blocks all frames
+ * @param count number of IDs, at most MAX_MSGS
+ * @return 0 if the filter was installed
+ * @return -1 if there are too many IDs
+ * @return -2 if setsockopt(...) failed
+ */
+int set_can_receive_filter(int rx_socket, const unsigned int *ids, size_t count);
+
 /**
  * Defines a CAN message with id that is sent repeatedly with a specific period
  * @param id The ID of the CAN message
@@ -97,14 +150,78 @@ int init_can(char *interface_name);
  */
 void define_rep_msg(unsigned int id, unsigned int dlc, bool enb, unsigned int period);
 
+/**
+ * Rounds a payload length up to the next length that a CAN FD frame can have (0-8, 12, 16, 20, 24, 32, 48, 64)
+ * @param len payload length in bytes
+ * @return the smallest valid CAN FD length that can hold len bytes, at most 64
+ */
+unsigned char can_fd_len_round_up(unsigned int len);
+
+/**
+ * @return the IV length that the crypto session needs for the selected can_frame_format
+ */
+int can_frame_iv_len();
+
+/**
+ * Extracts the message out of a received canfd_frame, the payload is decrypted and authenticated if encryption is enabled
+ * @param frame frame as it was received from the bus
+ * @param msg message that is filled with the ID, length and (decrypted) payload
+ * @return 0 if the message is valid
+ * @return -1 if the message is a replay
+ * @return -2 if the decryption or authentication failed
+ */
+int unpack_can_frame(struct canfd_frame *frame, can_message_t *msg);
+
+/**
+ * Reads all raw frames that are queued on a socket (up to max_frames) with a single recvmmsg(...) call, the kernel
+ * writes them directly into frames. Only the header of the frames is checked, they are neither decoded nor decrypted
+ * @param frames array that is filled with the frames that passed the header check
+ * @param timestamps if not NULL, filled with the kernel receive timestamp of each frame in microseconds
+ * @param max_frames size of frames, at most CAN_RX_BUDGET frames are read
+ * @param rx_socket can socket for the reception
+ * @return the number of frames stored in frames
+ * @return -1 if no frame could be read, e.g. because a non-blocking socket is empty
+ */
+int read_can_frames(struct canfd_frame *frames, long *timestamps, int max_frames, int rx_socket);
+
+/**
+ * Reads all frames that are queued on a socket (up to max_msgs) with a single recvmmsg(...) call.
+ * Every message carries the kernel receive timestamp of its frame. The frames pass the stages header peek, ID relevance,
+ * freshness and authentication in this order, frames that a stage rejects are left out and counted in can_rx_stats.
+ * @param msgs array that is filled with the valid messages
+ * @param max_msgs size of msgs, at most CAN_RX_BUDGET frames are read
+ * @param rx_socket can socket for the reception
+ * @return the number of valid messages stored in msgs
+ * @return -1 if no frame could be read, e.g. because a non-blocking socket is empty
+ */
+int read_can_batch(can_message_t *msgs, int max_msgs, int rx_socket);
+
 /**
  * Reads a message from the vCan bus and stores it in the pointer to a can_message_t
  * @param msg pointer to a can_message_t
  * @param tx_socket can socket for the transmission
- * @return
+ * @return 1 if a valid message was stored in msg
+ * @return 0 if a frame was read but rejected (failed decryption or replay)
+ * @return -1 if no frame could be read, e.g. because a non-blocking socket is empty
  */
 ssize_t read_can(can_message_t *msg, int tx_socket);
 
+/**
+ * Prints the counters of the receive pipeline of the calling thread
+ * @param bus_name name of the bus that the thread reads, used as label
+ */
+void print_can_rx_stats(const char *bus_name);
+
+/**
+ * Builds the canfd_frame that is sent on the bus for a message, the payload is encrypted if encryption is enabled
+ * @param msg message that should be sent
+ * @param frame frame that is filled with the (encrypted) payload
+ * @return 0 if the frame was built
+ * @return -1 if the payload is too long
+ * @return -2 if the encryption failed
+ */
+int pack_can_frame(can_message_t *msg, struct canfd_frame *frame);
+
 /**
  * Writes the content of a can_message_t variable to the vCan bus
  * @param msg can_message_t variable
@@ -114,43 +231,53 @@ ssize_t read_can(can_message_t *msg, int tx_socket);
 int write_can(can_message_t msg, int tx_socket);
 
 /**
- * Callback function for the 100Hz timer
- * Sends all the CAN messages that were defined with a 10ms interval
- */
-void can_write_100_hz_msgs();
-
-/**
- * Callback function for the 20Hz timer
- * Sends all the CAN messages that were defined with a 50ms interval
+ * Sends raw frames exactly as they are with a single sendmmsg(...) call, e.g. frames that were received with
+ * read_can_frames(...) on another bus
+ * @param frames pointers to the frames that should be sent, the frames are not copied
+ * @param count number of frames, at most CAN_RX_BUDGET
+ * @param tx_socket can socket for the transmission
+ * @return the number of frames that were sent
  */
-void can_write_20_hz_msgs();
+int write_can_frames(struct canfd_frame *const *frames, int count, int tx_socket);
 
 /**
- * Callback function for the 10Hz timer
- * Sends all the CAN messages that were defined with a 100ms interval
+ * Writes up to MAX_MSGS messages to the vCan bus with a single sendmmsg(...) call
+ * @param msgs array of messages that should be sent
+ * @param count number of messages in msgs
+ * @param tx_socket can socket for the transmission
+ * @return the number of messages that were sent
  */
-void can_write_10_hz_msgs();
+int write_can_batch(can_message_t *msgs, int count, int tx_socket);
 
 /**
- * Callback function for the 2Hz timer
- * Sends all the CAN messages that were defined with a 500ms interval
+ * Fills a CAN message with the current ecu_data values of the signals that the signal database (can_db.h) defines for it
+ * @param msg definition of the cyclic message
+ * @param out message that is filled with the ID, length and payload
+ * @return 0 if the message was encoded
+ * @return -1 if the ID of the message is unknown
  */
-void can_write_2_hz_msgs();
+int encode_can_message(msg_def_t msg, can_message_t *out);
 
 int send_can_message(msg_def_t msg);
 
+/**
+ * Sends all cyclic CAN messages whose deadline has been reached and schedules their next deadline
+ * @return the number of messages that were sent
+ */
 int send_pending_can_messages();
 
 /**
- * High level function that reads the vCan bus and calls the message handler for the correct ECU
+ * Calculates when the next cyclic CAN message has to be sent
+ * @return absolute time in microseconds (same clock as micros()) of the next due message
+ * @return 0 if the ECU does not send any cyclic messages
  */
-void read_can_bus_and_handle_input();
+long next_can_message_due();
 
 /**
- *
- * Loop for gateway ecu running in extra thread to stop the blocking of can messages, reads vcan1 and writes to vcan0
+ * High level function that drains the vCan bus (up to CAN_RX_BUDGET frames per call) and calls the message handler for the correct ECU
+ * @return the number of messages that were handled
  */
-void *gateway_read_obd_port_loop();
+int read_can_bus_and_handle_input();
 
 /**
  * Incoming CAN message handler for the powertrain ECU
@@ -181,22 +308,10 @@ void body_handle_can_msg(can_message_t msg);
 void observer_handle_can_msg(can_message_t msg);
 
 /**
- * Incoming CAN message handler for the gateway ECU
- * Distributes the message to the right ECU and filters it if it does not match certain security criteria
- * @param msg  incoming CAN message
- */
-void gateway_handle_can_msg(can_message_t msg, int receiving_socket);
-
-/**
- * @brief Set the up observer reference timings, to check if the received CAN messages have an unusual timing
+ * @brief Set up the timing detector of the observer, it learns the interval of every ID online and reports frames with
+ * an unusual timing
  *
  */
 void setup_observer_reference_timings();
 
-/**
- * @brief Set the up a whitlist of CAN IDs that are allowed to be sent and received by the OBD-II port
- *
- */
-void setup_gateway_whitelist();
-
 #endif // PENNE_CAN_H
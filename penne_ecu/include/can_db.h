@@ -0,0 +1,130 @@
+#ifndef PENNE_CAN_DB_H
+#define PENNE_CAN_DB_H
+#include "ecu.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Bit of an ECU type in the consumers mask of a message
+#define ECU_BIT(ecu_type) (1u << (ecu_type))
+
+/**
+ * C type of the ecu_data field that a signal is decoded into
+ */
+typedef enum { CAN_FIELD_INT, CAN_FIELD_UINT, CAN_FIELD_UCHAR, CAN_FIELD_CHAR, CAN_FIELD_BOOL } can_field_type_t;
+
+// Type of an ecu_data field, so tables of fields only have to name the field. The enums of ecu_data are unsigned int
+#define CAN_FIELD_TYPE(field)                                                                                                                        \
+  _Generic(((ecu_data_t *)0)->field,                                                                                                                 \
+      int: CAN_FIELD_INT,                                                                                                                            \
+      unsigned int: CAN_FIELD_UINT,                                                                                                                  \
+      unsigned char: CAN_FIELD_UCHAR,                                                                                                                \
+      char: CAN_FIELD_CHAR,                                                                                                                          \
+      bool: CAN_FIELD_BOOL)
+
+/**
+ * One signal of a CAN message, i.e. the bytes of the payload that hold one ecu_data field
+ */
+typedef struct can_signal_t {
+  size_t field;          // offsetof(ecu_data_t, <field>)
+  can_field_type_t type; // Type of the field
+  uint8_t offset;        // First byte of the signal in the payload
+  uint8_t width;         // Number of bytes (1-4)
+  bool big_endian;       // Byte order of multi byte signals, all signals of this simulator are big endian
+  uint32_t mask;         // Applied to the raw value when the signal is decoded
+  int min;               // Smallest valid value, checked by the observer
+  int max;               // Largest valid value, checked by the observer
+  const char *allowed;   // If not NULL, the valid values are the characters of this string and min/max are ignored
+  observer_id_t observer_id;
+} can_signal_t;
+
+/**
+ * Definition of a CAN message in the signal database
+ */
+typedef struct can_db_msg_t {
+  unsigned int id;
+  uint8_t dlc;
+  uint16_t period;    // Period in milliseconds with which the sender transmits the message
+  ecu_type_t sender;  // ECU that sends the message cyclically
+  uint32_t consumers; // ECU_BIT(...) of every ECU that decodes the message
+  uint8_t n_signals;
+  const can_signal_t *signals;
+  void (*on_decoded)(ecu_data_t *data); // Optional hook that is called after the signals were written to ecu_data
+} can_db_msg_t;
+
+/**
+ * All messages of the simulated vehicle
+ */
+extern const can_db_msg_t can_db_messages[];
+extern const size_t can_db_message_count;
+
+/**
+ * Interns the IDs of all messages (see can_id_map.h), must be called once before any other can_db function and before
+ * any other module interns IDs
+ */
+void can_db_init();
+
+/**
+ * Looks up the definition of a CAN ID
+ * @param id CAN ID
+ * @return the message definition or NULL if the ID is not part of the database
+ */
+const can_db_msg_t *can_db_lookup(size_t id);
+
+/**
+ * @return true if the ECU decodes messages with the ID
+ */
+bool can_db_consumes(size_t id, ecu_type_t consumer);
+
+/**
+ * Collects the IDs of all messages that an ECU decodes
+ * @param consumer ECU type
+ * @param ids buffer for the IDs
+ * @param max_ids size of the buffer
+ * @return the number of IDs that were written to ids
+ */
+size_t can_db_consumed_ids(ecu_type_t consumer, unsigned int *ids, size_t max_ids);
+
+/**
+ * Writes the signals of a message from ecu_data into the payload, the length of out is set to the DLC
+ * @param def message definition
+ * @param data ecu_data that holds the values of the signals
+ * @param out message whose ID, length and buffer are set
+ */
+void can_db_encode(const can_db_msg_t *def, const ecu_data_t *data, can_message_t *out);
+
+/**
+ * Decodes the signals of a received message into ecu_data, if the ECU is a consumer of the message. Fields whose value
+ * changed are marked dirty, see ecu_data_mark_dirty(...)
+ * @param msg received message
+ * @param consumer ECU type that handles the message
+ * @param data ecu_data that is updated
+ * @return 0 if the message was decoded
+ * @return -1 if the ID is not part of the database
+ * @return -2 if the ECU does not consume the message
+ */
+int can_db_decode(const can_message_t *msg, ecu_type_t consumer, ecu_data_t *data);
+
+/**
+ * Reads a field of ecu_data
+ * @param data ecu_data that holds the field
+ * @param field offsetof(ecu_data_t, <field>)
+ * @param type type of the field, see CAN_FIELD_TYPE(...)
+ * @return the value of the field
+ */
+int can_db_field_value(const ecu_data_t *data, size_t field, can_field_type_t type);
+
+/**
+ * Reads the ecu_data field of a signal
+ * @param data ecu_data that holds the field
+ * @param signal signal definition
+ * @return the value of the field
+ */
+int can_db_signal_value(const ecu_data_t *data, const can_signal_t *signal);
+
+/**
+ * Checks a value against the range (or the allowed characters) of a signal
+ * @return true if the value is valid
+ */
+bool can_db_signal_valid(const can_signal_t *signal, int value);
+
+#endif // PENNE_CAN_DB_H
@@ -0,0 +1,47 @@
+#ifndef PENNE_CAN_ID_MAP_H
+#define PENNE_CAN_ID_MAP_H
+#include <linux/can.h>
+#include <stddef.h>
+
+// Maximum number of distinct IDs that can be interned, the per-ID state of all modules is sized by it
+#define CAN_ID_MAX_INTERNED 256
+// Slots of the hash table, twice the number of IDs keeps the probe sequences short. Must be a power of two
+#define CAN_ID_MAP_SLOTS (2 * CAN_ID_MAX_INTERNED)
+
+/**
+ * Maps the IDs that the configuration knows (signal database, gateway rules) to dense indices 0..count-1, so per-ID state
+ * can be kept in small arrays instead of tables indexed by the raw ID. Works for 11 and 29 bit IDs alike.
+ * IDs are only interned during the setup, before any other thread runs. Afterwards the map is only read, so the lookups
+ * of the receiving threads need no locking
+ */
+
+/**
+ * Removes all IDs, called by can_db_init()
+ */
+void can_id_map_reset();
+
+/**
+ * Returns the dense index of an ID and assigns the next free index to an ID that was not interned before
+ * @param id CAN ID, the RTR and error flags are ignored, an extended ID (CAN_EFF_FLAG) never matches a standard ID
+ * @return the index of the ID or -1 if CAN_ID_MAX_INTERNED IDs are already interned
+ */
+int can_id_intern(canid_t id);
+
+/**
+ * Looks up the dense index of an ID without interning it, O(1) on the receive path
+ * @param id CAN ID, the RTR and error flags are ignored, an extended ID (CAN_EFF_FLAG) never matches a standard ID
+ * @return the index of the ID or -1 if the ID was never interned
+ */
+int can_id_lookup(canid_t id);
+
+/**
+ * @return the ID with the dense index
+ */
+canid_t can_id_at(int index);
+
+/**
+ * @return the number of interned IDs
+ */
+size_t can_id_count();
+
+#endif // PENNE_CAN_ID_MAP_H
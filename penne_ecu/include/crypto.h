@@ -1,11 +1,97 @@
+#ifndef PENNE_CRYPTO_H
+#define PENNE_CRYPTO_H
+#include <openssl/evp.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+// Length of the IV that is transmitted with every encrypted CAN frame
+#define CRYPTO_IV_LEN 16
+// Length of the authentication tag that is transmitted with every encrypted CAN frame
+#define CRYPTO_TAG_LEN 16
+// Number of random bytes that are fetched with one getrandom() call for the random part of the IVs
+#define CRYPTO_RANDOM_POOL_SIZE 4096
+
 extern unsigned char *encryption_key;
 extern bool using_encryption;
 
+/**
+ * AES-256-GCM cipher contexts for one key. The key schedule and GHASH tables are computed once when the session is
+ * created, afterwards only the IV is set for each frame.
+ * A session must only be used by one thread at a time.
+ */
+typedef struct crypto_session_t {
+  EVP_CIPHER_CTX *encrypt_ctx;
+  EVP_CIPHER_CTX *decrypt_ctx;
+} crypto_session_t;
+
+/**
+ * The session of the calling thread, created in main.c for the main thread and by every other thread that reads or writes
+ * encrypted frames (e.g. the gateway thread for the OBD-II port)
+ */
+extern _Thread_local crypto_session_t *crypto_session;
+
 void handleErrors(void);
 
-int gcm_encrypt(unsigned char *plaintext, int plaintext_len, unsigned char *aad, int aad_len, unsigned char *key, unsigned char *iv, int iv_len,
-                unsigned char *ciphertext, unsigned char *tag);
+/**
+ * Initializes the nonce generator of this ECU, must be called before the first IV is created.
+ * The message counter starts at the current time in microseconds, so the counters of a restarted ECU are still larger
+ * than the ones it used before the restart.
+ * @param sender_id ID of the sending ECU that is part of every IV, two ECUs with the same key must use different IDs
+ */
+void crypto_nonce_init(uint8_t sender_id);
+
+/**
+ * @return the sender ID that was passed to crypto_nonce_init(...)
+ */
+uint8_t crypto_nonce_sender_id();
+
+/**
+ * Returns the next value of the message counter of this ECU. Every call returns a different value, also when it is
+ * called from several threads, so an IV that contains the counter and the sender ID is never used twice.
+ * The counter follows the realtime clock in microseconds, so a receiver can bound the age of a frame by its counter.
+ * @return the message counter for the next frame
+ */
+uint64_t crypto_next_counter();
+
+/**
+ * Creates a unique IV: <8 byte message counter (big endian)> <1 byte sender ID> <random bytes up to iv_len>
+ * The random bytes come from a per thread pool that is refilled in bulk with getrandom(), the uniqueness of the IV
+ * only depends on the counter.
+ * @param iv buffer for the IV
+ * @param iv_len length of the IV, at least 9 bytes
+ * @return the message counter that is contained in the IV
+ */
+uint64_t crypto_next_iv(unsigned char *iv, int iv_len);
+
+/**
+ * Creates the encryption and decryption contexts for a key
+ * @param key 256 bit key
+ * @param iv_len length of the IVs that are used with this session
+ * @return the new session, the program is aborted if OpenSSL fails
+ */
+crypto_session_t *crypto_session_new(unsigned char *key, int iv_len);
+
+/**
+ * Frees the cipher contexts of a session and the session itself
+ * @param session session created with crypto_session_new(...)
+ */
+void crypto_session_free(crypto_session_t *session);
+
+/**
+ * Encrypts a plaintext with the session key and the given IV
+ * @param tag buffer for the authentication tag
+ * @param tag_len length of the tag, values below CRYPTO_TAG_LEN give a truncated tag
+ * @return the length of the ciphertext
+ */
+int gcm_encrypt(crypto_session_t *session, unsigned char *plaintext, int plaintext_len, unsigned char *aad, int aad_len, unsigned char *iv,
+                unsigned char *ciphertext, unsigned char *tag, int tag_len);
+
+/**
+ * Decrypts a ciphertext with the session key and the given IV and verifies the (possibly truncated) tag
+ * @return the length of the plaintext
+ * @return -1 if the tag does not match
+ */
+int gcm_decrypt(crypto_session_t *session, unsigned char *ciphertext, int ciphertext_len, unsigned char *aad, int aad_len, unsigned char *tag,
+                int tag_len, unsigned char *iv, unsigned char *plaintext);
 
-int gcm_decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned char *aad, int aad_len, unsigned char *tag, unsigned char *key, unsigned char *iv,
-                int iv_len, unsigned char *plaintext);
+#endif // PENNE_CRYPTO_H
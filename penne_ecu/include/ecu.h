@@ -2,6 +2,15 @@
 #define PENNE_ECU_H
 #include "can.h"
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Interval in milliseconds after which the entire ecu_data is sent to the GUI, even if nothing changed
+#define GUI_FULL_UPDATE_INTERVAL 100
+// Interval in milliseconds in which the powertrain ECU simulates the RPM, speed and automatic shifting
+#define SIMULATION_INTERVAL 20
+// Interval in milliseconds in which the counters of the CAN receive pipeline are logged
+#define CAN_RX_STATS_INTERVAL 10000
 
 /**
  * The 4 different ECU types that are supported by this simulator
@@ -96,15 +105,45 @@ typedef struct ecu_data_t {
   unsigned char r_window_position;
   observer_id_t observer_id;     // Which value is problematic
   observer_code_t observer_code; // Problem Code of the problematic value
-  int gateway_id;                // Which can id was handled by the gateway
-  unsigned char gateway_code;    // Code that the gateway assigns after handling a CAN message, 0 => OK, 1 => READ_BLOCKED, 2 => WRITE_BLOCKED
+  uint32_t gateway_id;           // Which can id (canid_t, with the EFF flag) was handled by the gateway
+  unsigned char gateway_code;    // Code that the gateway assigns after handling a CAN message, see gateway_code_t
+  // Frames that the gateway dropped because of a rate limit, from vcan0 to vcan1 and back. The counters of the gateway are
+  // unsigned long, these are their low 32 bits (the width of a GUI field), so they wrap after 2^32 frames
+  uint32_t gateway_read_dropped;
+  uint32_t gateway_write_dropped;
 
 } ecu_data_t;
 
 extern ecu_type_t ecu_number;
-extern ecu_data_t ecu_data, ecu_data_old;
+extern ecu_data_t ecu_data;
+
+// One dirty bit per byte of ecu_data_t, a field is marked with the bit of its first byte, i.e. offsetof(ecu_data_t, field)
+#define ECU_DATA_DIRTY_WORDS ((sizeof(ecu_data_t) + 63) / 64)
+extern uint64_t ecu_data_dirty[ECU_DATA_DIRTY_WORDS];
 
-extern pthread_mutex_t gateway_lock;
+/**
+ * Assigns a value to a field of ecu_data and marks the field dirty if the value changed. Every write to ecu_data goes
+ * through this macro (or can_db_decode(...)), so write_ecu_data_to_serial() only has to look at the dirty fields
+ */
+#define ECU_DATA_SET(field, value)                                                                                                                   \
+  do {                                                                                                                                               \
+    __typeof__(ecu_data.field) new_value_ = (value);                                                                                                 \
+    if (ecu_data.field != new_value_) {                                                                                                              \
+      ecu_data.field = new_value_;                                                                                                                   \
+      ecu_data_mark_dirty(offsetof(ecu_data_t, field));                                                                                              \
+    }                                                                                                                                                \
+  } while (0)
+
+/**
+ * Marks a field of ecu_data as changed, it is sent to the GUI with the next update
+ * @param field offsetof(ecu_data_t, <field>)
+ */
+void ecu_data_mark_dirty(size_t field);
+
+/**
+ * Marks every field of ecu_data as changed, so the next update sends the entire ecu_data
+ */
+void ecu_data_mark_all_dirty();
 
 /**
  * Callback function for the timer, which calls the correct function depending on the elapsed interval
@@ -115,16 +154,32 @@ extern pthread_mutex_t gateway_lock;
 void timer_handler(int sig, siginfo_t *si, void *uc);
 
 /**
- * Defines the repeated CAN messages that are sent from the ECU and calls the timer setup routine
+ * Defines the repeated CAN messages that are sent from the ECU and registers the CAN socket, the serial port and the
+ * wakeup timer with the reactor
+ * @return 0 if the setup succeeded
+ * @return -1 if the reactor could not be created
+ * @return -2 if the CAN socket could not be switched to non-blocking mode
+ * @return -3 if the CAN socket or the serial port could not be registered with the reactor
+ * @return -4 if the wakeup timer could not be created
+ * @return -5 if the CAN receive filter could not be installed
+ * @return -6 if the forwarding threads of the gateway could not be started
+ * @return -7 if the policy file of the gateway could not be loaded
+ * @return -8 if the GUI reporter thread could not be started
  */
-void ecu_setup();
+int ecu_setup();
 
 /**
  * Checks when the last message has been sent to the GUI.
- * If the last message is past for a certain threshold a global flag is set to send the entire ecu_data with the next message
+ * If the last message is past for a certain threshold every field is marked dirty, so the entire ecu_data is sent with the next message
  */
 void check_message_timers();
 
+/**
+ * Calculates when the main loop has to wake up, either for the next cyclic CAN message or for the periodic GUI update
+ * @return absolute time in microseconds (same clock as micros())
+ */
+long next_wakeup_time();
+
 /**
  * Sends updates to the GUI for changed values of the ecu_data
  */
@@ -153,8 +208,8 @@ void write_observer_ecu_data();
 void write_gateway_ecu_data();
 
 /**
- * Sends changed ecu_data values to the GUI.
- * When a the global flag send_all_ecu_data_to_gui is set, the entire ecu_data struct is sent
+ * Queues the dirty ecu_data fields that the GUI shows for this ECU type at the GUI reporter and clears the dirty bits.
+ * Nothing is queued (and nothing is compared) if no field is dirty
  */
 void write_ecu_data_to_serial();
 
@@ -171,7 +226,7 @@ void set_ecu_id_to_value(int id, int value);
 void update_ecu_data_serial();
 
 /**
- * Main loop of the ECU
+ * Main loop of the ECU, waits for the next event of the reactor and updates the GUI afterwards
  * @return 0 on successful execution
  * @return nonzero on error
  */
@@ -0,0 +1,57 @@
+#ifndef PENNE_FRESHNESS_H
+#define PENNE_FRESHNESS_H
+#include <stdbool.h>
+#include <stdint.h>
+
+// The counter of a sender follows its clock (see crypto_next_counter()), so the window is a time: a frame may arrive
+// out of order up to 100 ms in counter time behind the highest accepted one
+#define FRESHNESS_WINDOW_US 100000
+// Number of the highest accepted counters of a sender that are remembered, a late frame is only fresh if it is newer
+// than the oldest of them
+#define FRESHNESS_HISTORY 32
+// The sender ID is one byte of the IV / freshness value
+#define FRESHNESS_MAX_SENDERS 256
+
+/**
+ * Replay state of one sender: the highest accepted message counter and the FRESHNESS_HISTORY highest accepted counters
+ * (unordered), lowest is the index of the smallest of them. Every counter that was accepted and is not in the history is
+ * lower than all of them
+ */
+typedef struct freshness_window_t {
+  uint64_t highest;
+  uint64_t history[FRESHNESS_HISTORY];
+  uint8_t n_history;
+  uint8_t lowest;
+  bool valid;
+} freshness_window_t;
+
+/**
+ * Checks if a message counter of a sender was not received before. The check does not change the state, so a frame is
+ * only committed with freshness_accept(...) after it was authenticated.
+ * The state is per thread and every bus is read by one thread, so no locking is needed
+ * @param sender sender ID out of the IV / freshness value
+ * @param counter message counter of the sender
+ * @return 0 if the counter is fresh
+ * @return -1 if the counter was already accepted, is FRESHNESS_WINDOW_US or more behind the highest accepted one or is
+ * older than the remembered counters
+ */
+int freshness_check(uint8_t sender, uint64_t counter);
+
+/**
+ * Marks a message counter as received, must only be called for authenticated frames that passed freshness_check(...)
+ * @param sender sender ID out of the IV / freshness value
+ * @param counter message counter of the sender
+ */
+void freshness_accept(uint8_t sender, uint64_t counter);
+
+/**
+ * @return true if a frame of the sender was already accepted by the calling thread
+ */
+bool freshness_known(uint8_t sender);
+
+/**
+ * @return the number of frames of the calling thread that freshness_check(...) rejected
+ */
+unsigned long freshness_rejected_count();
+
+#endif // PENNE_FRESHNESS_H
@@ -0,0 +1,70 @@
+#ifndef PENNE_GATEWAY_H
+#define PENNE_GATEWAY_H
+#include "can.h"
+#include <linux/can.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of forwarding events per direction that can wait for the main thread, must be a power of two
+#define GATEWAY_RING_SIZE 1024
+
+/**
+ * Code that the gateway assigns after handling a CAN message, it is shown in the GUI
+ */
+typedef enum { GATEWAY_OK, GATEWAY_READ_BLOCKED, GATEWAY_WRITE_BLOCKED, GATEWAY_READ_RATE_LIMITED, GATEWAY_WRITE_RATE_LIMITED } gateway_code_t;
+
+/**
+ * Result of forwarding (or blocking) one CAN message
+ */
+typedef struct gateway_event_t {
+  canid_t id; // With the EFF flag, the policy also handles 29 bit IDs
+  uint8_t code; // gateway_code_t
+} gateway_event_t;
+
+/**
+ * Single producer single consumer ring, the forwarding thread of one direction pushes and the main thread pops
+ */
+typedef struct gateway_ring_t {
+  gateway_event_t events[GATEWAY_RING_SIZE];
+  _Atomic size_t head; // Only written by the producer
+  _Atomic size_t tail; // Only written by the consumer
+  _Atomic unsigned long dropped;
+} gateway_ring_t;
+
+/**
+ * File descriptor (eventfd) that becomes readable when a forwarding thread published new events
+ */
+extern int gateway_event_fd;
+
+/**
+ * Path of the policy file of the gateway, NULL to use the built-in whitelist
+ */
+extern const char *gateway_policy_path;
+
+/**
+ * Compiles the policy file at gateway_policy_path or, if no file was given, the built-in whitelist of the IDs that the
+ * OBD-II port may read. can_db_init() must have been called before
+ * @return 0 if the policy was loaded
+ * @return -1 if the policy file could not be read or parsed
+ */
+int gateway_load_policy();
+
+/**
+ * Starts one forwarding thread per direction (vcan0 -> vcan1 and vcan1 -> vcan0), each pinned to its own core if the
+ * machine has more than one. init_can(...) must have been called for both interfaces and the policy must have been loaded
+ * @return 0 if both threads were started
+ * @return -1 if the eventfd could not be created
+ * @return -2 if a thread could not be created
+ */
+int gateway_start();
+
+/**
+ * Takes all events that the forwarding threads published and stores the most relevant one and the number of frames that
+ * were dropped by the rate limits in ecu_data for the GUI.
+ * Must only be called by the main thread
+ * @return the number of events that were taken
+ */
+int gateway_drain_events();
+
+#endif // PENNE_GATEWAY_H
@@ -0,0 +1,134 @@
+#ifndef PENNE_GATEWAY_POLICY_H
+#define PENNE_GATEWAY_POLICY_H
+#include "can.h"
+#include <linux/can.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum number of rules in a policy file
+#define GATEWAY_MAX_RULES 512
+// Maximum number of payload byte predicates of one rule
+#define GATEWAY_MAX_PAYLOAD_CHECKS 4
+// IDs per direction that only a range rule covers and that get their own token bucket, further IDs share the bucket of
+// their rule. Must be a power of two
+#define GATEWAY_MAX_RANGE_IDS 256
+
+// Default token bucket of every allowed ID whose rule sets no rate, twice the rate of the fastest cyclic message (10 ms)
+#define GATEWAY_DEFAULT_ID_RATE 200
+#define GATEWAY_DEFAULT_ID_BURST 20
+// Default token bucket of all frames of one direction, the cyclic traffic of the vehicle is about 1300 frames/s
+#define GATEWAY_DEFAULT_TOTAL_RATE 3000
+#define GATEWAY_DEFAULT_TOTAL_BURST 300
+
+/**
+ * Direction of a frame through the gateway, READ is vcan0 -> vcan1 (the OBD-II port reads), WRITE is vcan1 -> vcan0
+ */
+typedef enum { GATEWAY_DIRECTION_READ, GATEWAY_DIRECTION_WRITE } gateway_direction_id_t;
+
+/**
+ * Result of the policy check of one frame
+ */
+typedef enum { GATEWAY_POLICY_ALLOW, GATEWAY_POLICY_DENY, GATEWAY_POLICY_RATE_LIMITED, GATEWAY_POLICY_CONDITION_FAILED } gateway_verdict_t;
+
+/**
+ * (payload[byte] & mask) must be within min and max
+ */
+typedef struct gateway_payload_check_t {
+  uint8_t byte;
+  uint8_t mask;
+  uint8_t min;
+  uint8_t max;
+} gateway_payload_check_t;
+
+/**
+ * Compiled rule, all IDs that a rule covers point to the same rule in the lookup table
+ */
+typedef struct gateway_rule_t {
+  bool allow;
+  uint8_t n_payload_checks;
+  gateway_payload_check_t payload_checks[GATEWAY_MAX_PAYLOAD_CHECKS];
+  int max_speed;  // The frame only passes while speed_kph <= max_speed, -1 if there is no speed condition
+  int time_from;  // Minute of the day (local time) from which the frame passes, -1 if there is no time condition
+  int time_to;    // Minute of the day until which the frame passes, the window may wrap around midnight
+  double rate;    // Frames per second that one ID may pass, 0 if there is no rate limit
+  double burst;   // Size of the token bucket of one ID
+} gateway_rule_t;
+
+/**
+ * Rate limits of one direction that apply in addition to the rules
+ */
+typedef struct gateway_limits_t {
+  double id_rate;     // Frames per second of every ID whose rule sets no rate, 0 for no limit
+  double id_burst;
+  double total_rate;  // Frames per second of all IDs together, 0 for no limit
+  double total_burst;
+} gateway_limits_t;
+
+/**
+ * Vehicle state that the conditions of the rules depend on, published by the gateway thread that reads vcan0
+ */
+typedef struct gateway_state_t {
+  _Atomic int speed_kph;
+} gateway_state_t;
+
+extern gateway_state_t gateway_state;
+
+/**
+ * Compiles the rules of a policy file into the lookup tables, rules further down in the file override earlier rules
+ * for the IDs they cover. IDs without a rule are denied. The IDs of single-ID rules are interned (see can_id_map.h), so
+ * the policy must be loaded during the setup, before the forwarding threads start.
+ *
+ * One rule per line, empty lines and lines starting with # are ignored:
+ * <read|write|both> <id>[-<last id>] <allow|deny> [rate=<frames per second>[/<burst>]] [byte<n>=<mask>:<min>-<max>]
+ *                                                 [max_speed=<kph>] [time=<HH:MM>-<HH:MM>]
+ * The rate limits of a direction are set with (rate 0 disables a limit, the defaults are GATEWAY_DEFAULT_*):
+ * limit <read|write|both> [id=<frames per second>[/<burst>]] [total=<frames per second>[/<burst>]]
+ * @param path path of the policy file
+ * @return 0 if the policy was loaded
+ * @return -1 if the file could not be opened or read
+ * @return -2 if a line could not be parsed, the line number is printed
+ */
+int gateway_policy_load_file(const char *path);
+
+/**
+ * Compiles the rules of a policy from a string, see gateway_policy_load_file(...) for the format
+ * @return 0 if the policy was loaded
+ * @return -2 if a line could not be parsed, the line number is printed
+ */
+int gateway_policy_load_string(const char *rules);
+
+/**
+ * Compiles the built-in whitelists into the lookup tables, used if the gateway was started without a policy file
+ * @param read_ids IDs that may pass from vcan0 to vcan1
+ * @param n_read number of read_ids
+ * @param write_ids IDs that may pass from vcan1 to vcan0
+ * @param n_write number of write_ids
+ */
+void gateway_policy_load_whitelist(const canid_t *read_ids, size_t n_read, const canid_t *write_ids, size_t n_write);
+
+/**
+ * @param direction direction of the frames
+ * @return true if the rule for the ID checks the payload, so the caller has to decrypt the frame before the check
+ */
+bool gateway_policy_needs_payload(gateway_direction_id_t direction, canid_t id);
+
+/**
+ * Checks a frame against the compiled rule of its ID and the rate limits of the direction. The rule of an interned ID
+ * (database IDs and IDs of single-ID rules) costs one hash lookup independent of the number of rules, any other ID a
+ * binary search over the ID ranges of the rules. Every ID has its own token bucket, the first GATEWAY_MAX_RANGE_IDS IDs
+ * of range rules get one when their first frame passes. Must only be called by the forwarding thread of the direction,
+ * it updates the token buckets of that direction
+ * @param direction direction of the frame
+ * @param id CAN ID of the frame
+ * @param payload (decrypted) payload, only used if gateway_policy_needs_payload(...) is true for the ID
+ * @param payload_len length of payload
+ * @param now_us current time in microseconds (same clock as micros())
+ * @param minute_of_day current local time in minutes since midnight
+ * @return the verdict for the frame
+ */
+gateway_verdict_t gateway_policy_check(gateway_direction_id_t direction, canid_t id, const unsigned char *payload, int payload_len, long now_us,
+                                       int minute_of_day);
+
+#endif // PENNE_GATEWAY_POLICY_H
@@ -0,0 +1,110 @@
+#ifndef PENNE_GUI_PROTOCOL_H
+#define PENNE_GUI_PROTOCOL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Messages between the ECUs and the GUI. The binary protocol sends every message as one frame:
+ *
+ *   sync (0xA5) | version | type | payload length | payload | CRC-16 (little-endian)
+ *
+ * The CRC is CRC-16/CCITT-FALSE over version, type, length and payload. ECU data and commands carry a list of fields,
+ * each a field ID byte followed by the value as uint32 little-endian. Observer events carry the number of dropped events
+ * as uint32 followed by the events (timestamp_ms as uint64, can_id as uint32, signal and code as uint8, value as uint32).
+ * The text protocol ("EXU", "EXD", "EVT" lines with hex values) is kept as a fallback, a text message never starts with
+ * the sync byte, so the receivers can tell both apart
+ */
+#define GUI_FRAME_SYNC 0xA5
+#define GUI_FRAME_VERSION 1
+#define GUI_FRAME_HEADER_LEN 4
+#define GUI_FRAME_CRC_LEN 2
+#define GUI_FRAME_MAX_PAYLOAD 255
+#define GUI_FRAME_MAX_LEN (GUI_FRAME_HEADER_LEN + GUI_FRAME_MAX_PAYLOAD + GUI_FRAME_CRC_LEN)
+// Field ID and uint32 value
+#define GUI_FIELD_LEN 5
+// Timestamp, CAN ID, signal, code and value
+#define GUI_EVENT_LEN 18
+// The text protocol needs more room than a binary frame for the same fields
+#define GUI_MESSAGE_MAX_LEN 512
+
+typedef enum { GUI_PROTOCOL_BINARY, GUI_PROTOCOL_TEXT } gui_protocol_t;
+
+// The serial port (a socat pty) or the shared-memory segment of shm_export.h
+typedef enum { GUI_TRANSPORT_SERIAL, GUI_TRANSPORT_SHM } gui_transport_t;
+
+typedef enum { GUI_FRAME_ECU_DATA = 1, GUI_FRAME_COMMAND = 2, GUI_FRAME_OBSERVER_EVENTS = 3 } gui_frame_type_t;
+
+// Protocol of the messages that this ECU writes, the commands of the GUI are accepted in both protocols
+extern gui_protocol_t gui_protocol;
+// Where gui_message_send(...) delivers the messages, the shared memory always gets binary messages
+extern gui_transport_t gui_transport;
+
+/**
+ * A message that is built up field by field and sent with a single write()
+ */
+typedef struct gui_message_t {
+  gui_frame_type_t type;
+  size_t len;       // Bytes in data, including the header
+  uint8_t n_items;  // Fields or events that were added
+  uint8_t data[GUI_MESSAGE_MAX_LEN];
+} gui_message_t;
+
+/**
+ * Starts an ECU data or command message in the protocol of gui_protocol
+ */
+void gui_message_begin(gui_message_t *msg, gui_frame_type_t type);
+
+/**
+ * Starts an observer event message in the protocol of gui_protocol
+ * @param dropped total number of events that the observer had to drop
+ */
+void gui_message_begin_events(gui_message_t *msg, uint32_t dropped);
+
+/**
+ * Appends one field to an ECU data or command message
+ * @return 0 if the field was added
+ * @return -1 if the message is full
+ */
+int gui_message_add_field(gui_message_t *msg, uint8_t field, uint32_t value);
+
+/**
+ * Appends one event to an observer event message
+ * @return 0 if the event was added
+ * @return -1 if the message is full
+ */
+int gui_message_add_event(gui_message_t *msg, uint64_t timestamp_ms, uint32_t can_id, uint8_t signal, uint8_t code, uint32_t value);
+
+/**
+ * Completes the message (CRC or newline) and writes it with one write(), or publishes it in the shared memory
+ * @param fd serial port of the GUI, unused with GUI_TRANSPORT_SHM
+ * @return 0 if the message was written
+ * @return -1 if write(...) or shm_export_publish(...) failed
+ */
+int gui_message_send(gui_message_t *msg, int fd);
+
+/**
+ * CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF) of the bytes
+ */
+uint16_t gui_crc16(const uint8_t *data, size_t len);
+
+/**
+ * Checks the bytes of a binary frame that were received so far, so a frame can be assembled over several reads
+ * @param data received bytes, starting with the sync byte
+ * @param len number of received bytes
+ * @param frame_len set to the length of the frame if it is complete
+ * @return 1 if the frame is complete and valid
+ * @return 0 if more bytes are needed
+ * @return -1 if the version is unknown or the CRC does not match, the frame has to be dropped
+ */
+int gui_frame_check(const uint8_t *data, size_t len, size_t *frame_len);
+
+/**
+ * Calls the handler for every field of a valid ECU data or command frame
+ * @param frame frame that gui_frame_check(...) accepted
+ * @param handler called with the field ID and the value
+ * @return the number of fields
+ */
+int gui_frame_for_each_field(const uint8_t *frame, void (*handler)(int field, int value));
+
+#endif // PENNE_GUI_PROTOCOL_H
@@ -0,0 +1,34 @@
+#ifndef PENNE_GUI_REPORTER_H
+#define PENNE_GUI_REPORTER_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Default rate of the GUI updates, the GUI renders at most 60 frames per second anyway
+#define GUI_REPORT_RATE_HZ 60
+// Highest rate that can be configured, the reporter sleeps at least one millisecond between two updates
+#define GUI_REPORT_MAX_RATE_HZ 1000
+// Field IDs that can be queued, the queue holds the latest value of every field, so it can never grow beyond this
+#define GUI_REPORTER_MAX_FIELDS 32
+
+// Updates per second that the reporter thread sends to the GUI, set before gui_reporter_start()
+extern int gui_report_rate_hz;
+
+/**
+ * Starts the thread that sends the queued fields and the observer events to the GUI gui_report_rate_hz times per second.
+ * All writes to the serial port (or the shared memory) happen on this thread, so a blocking write can never delay
+ * the CAN handling of the main loop
+ * @return 0 if the thread was started
+ * @return -1 if pthread_create(...) failed
+ */
+int gui_reporter_start();
+
+/**
+ * Queues fields for the next update, a field that is already queued gets the new value (the updates are coalesced).
+ * Only holds a mutex for the copy, it never waits for I/O
+ * @param ids field IDs of the GUI protocol, IDs >= GUI_REPORTER_MAX_FIELDS are ignored
+ * @param values new values of the fields
+ * @param n_fields number of fields
+ */
+void gui_reporter_post(const uint8_t *ids, const uint32_t *values, size_t n_fields);
+
+#endif // PENNE_GUI_REPORTER_H
@@ -1,17 +1,24 @@
 #ifndef PENNE_HELPERS_H
 #define PENNE_HELPERS_H
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 
 #define SERIAL_PORT "/dev/pts/"
 #define COMMAND_BUF_MAX 512
+// hex_decode(...) loads 8 bytes at once, so it may read up to 7 bytes past the end of the buffer
+#define COMMAND_BUF_PADDING 8
+// Fields that one "EXD ..." command can update
+#define COMMAND_MAX_FIELDS 32
 
 /**
- * buffer with a write-pointer to read messages from the GUI over multiple iterations
+ * buffer with a write-pointer to read messages from the GUI over multiple iterations.
+ * The commands and frames are parsed where they were read to, only an incomplete one is moved to the front
  */
 typedef struct sci_console_t {
   int write_pointer;
-  char buffer[COMMAND_BUF_MAX];
+  char buffer[COMMAND_BUF_MAX + COMMAND_BUF_PADDING];
 } sci_console_t;
 
 extern timer_t timer_100_hz;
@@ -32,6 +39,12 @@ long millis();
  */
 long micros();
 
+/**
+ * Time on CLOCK_MONOTONIC, which does not jump when the wall clock is set, for deadlines and intervals
+ * @return time since an unspecified start in microseconds
+ */
+long monotonic_micros();
+
 /**
  * Helper function to set up the timers for the CAN messages
  * @param timer_id reference to the timer that is used (100Hz, 20Hz, 10Hz or 2Hz)
@@ -42,6 +55,22 @@ long micros();
  */
 int make_timer(timer_t *timer_id, int expire_ms, int interval_ms);
 
+/**
+ * Helper function to create a non-blocking timerfd that can be waited on together with the CAN sockets and the serial port
+ * @return the file descriptor of the timer
+ * @return -1 if timerfd_create(...) failed
+ */
+int make_timerfd();
+
+/**
+ * Helper function to arm a timerfd so that it expires once at an absolute point in time
+ * @param timer_fd timer created with make_timerfd()
+ * @param deadline_us absolute expiry time in microseconds on the same clock as monotonic_micros(), a deadline in the past expires immediately
+ * @return 0 if the timer was armed
+ * @return -1 if timerfd_settime(...) failed
+ */
+int set_timerfd_deadline(int timer_fd, long deadline_us);
+
 /**
  * Helper function to setup the serial communication with the GUI over socat
  * @param port the tty port that should be used
@@ -53,22 +82,47 @@ int make_timer(timer_t *timer_id, int expire_ms, int interval_ms);
 int init_serial_port(char *port);
 
 /**
- * Helper function to read the serial port e.g. the interface with the GUI
+ * Helper function to read the serial port e.g. the interface with the GUI.
+ * Reads until the port is empty and handles every complete command and frame
  * @return The number of bytes read
+ * @return 0 or -1 if nothing could be read, like read(...)
  */
 ssize_t read_chassis_ecu_data();
 
 /**
  * Helper function to handle a command from the GUI after it was read-in completely.
- * If the command starts with "EXD", ecu_input_update(...) is called with the rest of the read command
- * @param cmd read in message from the GUI
+ * If the command starts with "EXD" (in any case), ecu_input_update(...) is called with the rest of the read command
+ * @param cmd read in message from the GUI, terminated with 0, backspaces are applied in place
+ * @param len length of the message without the terminating 0
+ */
+void command_job(char *cmd, size_t len);
+
+/**
+ * Helper function to handle a binary frame from the GUI after it was read-in completely and its CRC was checked.
+ * Every field of a command frame is applied with set_ecu_id_to_value(...)
+ * @param frame received frame, starting with the sync byte
+ */
+void frame_job(const uint8_t *frame);
+
+/**
+ * Decodes 1 to 8 hex digits (upper or lower case) at once with SWAR arithmetic on a 64 bit word.
+ * Always loads 8 bytes, so at least 8 bytes from digits on must be readable (see COMMAND_BUF_PADDING)
+ * @param digits first digit, the most significant one
+ * @param n_digits number of digits
+ * @param value the decoded value
+ * @return 0 if the value was decoded
+ * @return -1 if n_digits is not 1 to 8 or one of the digits is not a hex digit
  */
-void command_job(char *cmd);
+int hex_decode(const char *digits, size_t n_digits, uint32_t *value);
 
 /**
- * Helper function to parse a "EXD ..." command from the GUI and extract the ID and the value of the ecu_data to update
- * @param cmd payload of a "EXD ..." message from the GUI
+ * Helper function to parse a "EXD ..." command from the GUI and extract the IDs and the values of the ecu_data to update.
+ * All fields are parsed first, a malformed command updates nothing
+ * @param cmd payload of a "EXD ..." message from the GUI, fields of a 2 digit ID and 1 to 8 digits of the value separated by spaces
+ * @param len length of the payload
+ * @return the number of updated fields
+ * @return -1 if the command was malformed or had more than COMMAND_MAX_FIELDS fields
  */
-void ecu_input_update(char *cmd);
+int ecu_input_update(const char *cmd, size_t len);
 
 #endif // PENNE_HELPERS_H
@@ -0,0 +1,45 @@
+#ifndef PENNE_OBSERVER_EVENTS_H
+#define PENNE_OBSERVER_EVENTS_H
+#include "ecu.h"
+#include <stdint.h>
+
+// Number of detections that can wait for the next flush, must be a power of two
+#define OBSERVER_EVENT_RING_SIZE 256
+// Number of events in one serial message
+#define OBSERVER_EVENTS_PER_MESSAGE 8
+// Maximum number of serial messages of one flush, the rest waits for the next flush
+#define OBSERVER_EVENT_MESSAGES_PER_FLUSH 4
+
+/**
+ * One detection of the observer
+ */
+typedef struct observer_event_t {
+  long timestamp_us;  // Receive time of the frame that caused the detection
+  uint16_t can_id;
+  uint8_t signal;     // observer_id_t of the signal, NONE for timing and ID detections
+  uint8_t code;       // observer_code_t
+  uint32_t value;     // Offending value: the signal value, the interval in microseconds or the invariant index
+} observer_event_t;
+
+/**
+ * Queues a detection for the GUI, the event is dropped (and counted) if the ring is full.
+ * The ring is lock-free with a single producer, only the main thread of the observer may push
+ */
+void observer_event_push(long timestamp_us, uint16_t can_id, observer_id_t signal, observer_code_t code, uint32_t value);
+
+/**
+ * Writes the queued events to the GUI, called by the GUI reporter thread (see gui_reporter.h) at its rate, so the
+ * events of several frames share one message. Only one thread may flush. Each serial message
+ * is a GUI_FRAME_OBSERVER_EVENTS frame (see gui_protocol.h) or, with the text protocol, has the form
+ * "EVT <dropped> <timestamp_ms>:<can_id>:<signal>:<code>:<value> ...", all numbers in hex, where dropped is the total
+ * number of events that did not fit into the ring
+ * @return the number of events that were written
+ */
+int observer_events_flush();
+
+/**
+ * @return the total number of events that were dropped because the ring was full
+ */
+unsigned long observer_events_dropped();
+
+#endif // PENNE_OBSERVER_EVENTS_H
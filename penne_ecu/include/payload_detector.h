@@ -0,0 +1,77 @@
+#ifndef PENNE_PAYLOAD_DETECTOR_H
+#define PENNE_PAYLOAD_DETECTOR_H
+#include "can_db.h"
+#include "ecu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Every signal of the database has its own observer_id_t, the state of the detector is indexed by it
+#define PAYLOAD_SIGNAL_COUNT (R_WINDOW_POSITION + 1)
+// Maximum number of signals that an invariant depends on
+#define PAYLOAD_MAX_DEPENDENCIES 4
+// Maximum number of violations that one frame can report, a frame has at most a few signals
+#define PAYLOAD_MAX_VIOLATIONS 8
+// Maximum number of values that a signal can jump to in one simulation step
+#define PAYLOAD_MAX_JUMP_TARGETS 2
+
+typedef enum { PAYLOAD_RANGE, PAYLOAD_RATE_OF_CHANGE, PAYLOAD_INVARIANT } payload_violation_kind_t;
+
+typedef struct payload_violation_t {
+  observer_id_t id;
+  payload_violation_kind_t kind;
+  int value; // Value of the signal (range, rate of change) or the index of the invariant
+} payload_violation_t;
+
+/**
+ * Largest change of a signal per simulation step (SIMULATION_INTERVAL), 0 if the direction is not limited.
+ * The change is measured against the last value that passed the check, so forged frames can not move the reference
+ */
+typedef struct payload_rate_rule_t {
+  int max_rise;
+  int max_fall;
+  uint8_t n_jump_targets;
+  int jump_targets[PAYLOAD_MAX_JUMP_TARGETS]; // Values that the simulation sets directly, they are accepted after any change
+} payload_rate_rule_t;
+
+/**
+ * Condition between several signals that always holds in a healthy vehicle
+ */
+typedef struct payload_invariant_t {
+  const char *name;
+  observer_id_t reported_id; // observer_id that is shown in the GUI if the invariant is violated
+  uint8_t n_dependencies;
+  observer_id_t dependencies[PAYLOAD_MAX_DEPENDENCIES]; // The invariant is only evaluated if one of these signals changed
+  bool (*holds)(const ecu_data_t *data);
+  long grace_us; // A violation is only reported if it lasts this long, the vehicle may need some time to reach the state
+} payload_invariant_t;
+
+/**
+ * Resets the learned signal values and builds the signal -> invariant index, must be called before the first frame
+ */
+void payload_detector_init();
+
+/**
+ * Checks the signals of a frame that was just decoded into ecu_data. Only the signals whose value changed are checked
+ * against their range and rate of change, and only the invariants that depend on them are evaluated, so the cost per
+ * frame is bounded by the number of signals of the message and not by the number of rules. Invariants that are violated
+ * but still within their grace period are evaluated on every frame until they hold or are reported
+ * @param def database definition of the frame
+ * @param data ecu_data that the frame was decoded into
+ * @param timestamp receive time of the frame in microseconds
+ * @param violations buffer for the violations of this frame
+ * @param max_violations size of the buffer, further violations are counted but not returned
+ * @return the number of violations that were found in the frame
+ */
+int payload_detector_check_frame(const can_db_msg_t *def, const ecu_data_t *data, long timestamp, payload_violation_t *violations, int max_violations);
+
+/**
+ * @return the observer_id of a signal whose current value violates its range or an invariant, NONE if all are valid
+ */
+observer_id_t payload_detector_active_violation();
+
+/**
+ * @return a short name of a violation kind for logging
+ */
+const char *payload_violation_kind_name(payload_violation_kind_t kind);
+
+#endif // PENNE_PAYLOAD_DETECTOR_H
@@ -0,0 +1,47 @@
+#ifndef PENNE_REACTOR_H
+#define PENNE_REACTOR_H
+#include <stdint.h>
+
+#define MAX_REACTOR_SLOTS 8
+
+/**
+ * Callback that is invoked by the reactor when a registered file descriptor becomes ready
+ * @param fd the file descriptor that became ready
+ * @param events the epoll events that were reported for fd (EPOLLIN, EPOLLHUP, ...)
+ */
+typedef void (*reactor_handler_t)(int fd, uint32_t events);
+
+/**
+ * Creates the epoll instance that the main loop of the ECU waits on
+ * @return 0 if the initialization succeeded
+ * @return -1 if the epoll instance could not be created
+ */
+int reactor_init();
+
+/**
+ * Registers a file descriptor with the reactor, the handler is called whenever fd is readable
+ * @param fd file descriptor of a socket, pty or timerfd
+ * @param handler callback that is invoked with fd when it becomes ready
+ * @return 0 if the registration succeeded
+ * @return -1 if all reactor slots are in use
+ * @return -2 if epoll_ctl(...) failed
+ */
+int reactor_add(int fd, reactor_handler_t handler);
+
+/**
+ * Removes a file descriptor from the reactor, e.g. when the other end of a pty was closed
+ * @param fd file descriptor that was registered with reactor_add(...)
+ * @return 0 if fd was removed
+ * @return -1 if fd was not registered
+ */
+int reactor_remove(int fd);
+
+/**
+ * Waits until at least one registered file descriptor is ready and calls the handlers of all ready descriptors
+ * @param timeout_ms maximum time to wait in milliseconds, -1 waits until an event arrives
+ * @return the number of handled events, 0 on timeout or if the wait was interrupted by a signal
+ * @return -1 if epoll_wait(...) failed
+ */
+int reactor_wait(int timeout_ms);
+
+#endif // PENNE_REACTOR_H
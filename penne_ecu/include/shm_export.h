@@ -0,0 +1,77 @@
+#ifndef PENNE_SHM_EXPORT_H
+#define PENNE_SHM_EXPORT_H
+#include "gui_protocol.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Optional transport to the GUI without socat: the ECU publishes its state in the POSIX shared-memory segment
+ * "/penne_<ecu type>" and the GUI reads a snapshot once per rendered frame. The state is guarded by a seqlock, the ECU
+ * makes the sequence odd while it writes, so a reader that sees the same even sequence before and after its copy has a
+ * consistent snapshot. The GUI writes the commands for the chassis ECU into the same segment under a second seqlock.
+ * The layout is mirrored by pygame_gui/ecu.py, so every change needs a new SHM_EXPORT_VERSION
+ */
+#define SHM_EXPORT_MAGIC 0x454E4E50 // "PENN"
+#define SHM_EXPORT_VERSION 1
+// Field IDs of the GUI protocol that fit into the segment, for the ECU data and the commands
+#define SHM_EXPORT_MAX_FIELDS 32
+// Latest observer events that are kept, must be a power of two
+#define SHM_EXPORT_MAX_EVENTS 64
+
+typedef struct shm_event_t {
+  uint64_t timestamp_ms;
+  uint32_t can_id;
+  uint8_t signal;
+  uint8_t code;
+  uint16_t reserved;
+  uint32_t value;
+  uint32_t reserved2;
+} shm_event_t;
+
+typedef struct shm_export_t {
+  _Atomic uint32_t magic;        // Set last, after the segment was initialized
+  uint32_t version;
+  uint32_t ecu_type;
+  _Atomic uint32_t sequence;     // Seqlock of everything up to the commands, odd while the ECU writes
+  uint64_t update_count;         // Number of published messages
+  uint64_t timestamp_ms;         // Time of the last published message
+  uint32_t field_mask;           // Bit n is set once field n was published
+  uint32_t fields[SHM_EXPORT_MAX_FIELDS];
+  uint32_t events_dropped;       // Events that the observer dropped before they were published
+  uint32_t event_head;           // Number of published events, the latest are in events[head % SHM_EXPORT_MAX_EVENTS]
+  uint32_t reserved;
+  shm_event_t events[SHM_EXPORT_MAX_EVENTS];
+  _Atomic uint32_t command_sequence; // Seqlock of the commands, odd while the GUI writes
+  uint32_t command_mask;         // Bit n is set if commands[n] holds a value
+  uint32_t commands[SHM_EXPORT_MAX_FIELDS];
+} shm_export_t;
+
+_Static_assert(offsetof(shm_export_t, events) == 176, "pygame_gui/ecu.py expects the events at offset 176");
+_Static_assert(offsetof(shm_export_t, command_sequence) == 1712, "pygame_gui/ecu.py expects the commands at offset 1712");
+
+/**
+ * Creates (or re-initializes) the segment of this ECU and maps it
+ * @param ecu_name name of the ECU type, the segment is called "/penne_<ecu_name>"
+ * @return 0 if the segment is mapped
+ * @return -1 if shm_open(...) or ftruncate(...) failed
+ * @return -2 if mmap(...) failed
+ */
+int shm_export_open(const char *ecu_name);
+
+/**
+ * Publishes an ECU data or observer event message (built in the binary protocol) in the segment
+ * @return 0 if the message was published
+ * @return -1 if the segment is not mapped
+ */
+int shm_export_publish(const gui_message_t *msg);
+
+/**
+ * Applies the commands that the GUI wrote into the segment since the last call, without waiting for the GUI
+ * @param handler called with the field ID and the value of every command
+ * @return the number of applied commands
+ * @return 0 if there were no new commands or the GUI was writing them, they are applied by the next call
+ */
+int shm_export_poll_commands(void (*handler)(int field, int value));
+
+#endif // PENNE_SHM_EXPORT_H
@@ -0,0 +1,60 @@
+#ifndef PENNE_TIMING_DETECTOR_H
+#define PENNE_TIMING_DETECTOR_H
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * LEARN only learns the intervals and never reports, ENFORCE reports every ID that has at least two intervals, AUTO
+ * learns each ID for learn_samples intervals and enforces afterwards
+ */
+typedef enum { TIMING_MODE_LEARN, TIMING_MODE_ENFORCE, TIMING_MODE_AUTO } timing_mode_t;
+
+/**
+ * Result of the timing check of one frame
+ */
+typedef enum { TIMING_OK, TIMING_LEARNING, TIMING_DEVIATION, TIMING_BURST, TIMING_UNTRACKED } timing_result_t;
+
+typedef struct timing_config_t {
+  timing_mode_t mode;
+  uint32_t learn_samples; // Intervals of an ID that are learned (Welford) before the ID is enforced in AUTO mode
+  float sigma;            // An interval that deviates by more than sigma standard deviations from the mean is reported
+  float min_stddev_us;    // Lower bound of the standard deviation, the simulated bus has almost no jitter
+  float alpha;            // Weight of a new interval in the mean/variance (EWMA) once an ID is enforced
+  float burst_ratio;      // An interval shorter than burst_ratio * mean belongs to a burst
+  uint8_t burst_frames;   // Number of consecutive burst intervals that are reported as TIMING_BURST
+  uint8_t relearn_intervals; // Consecutive deviating intervals that agree with each other and replace the learned timing,
+                             // so a lasting change of the period is adopted. 0 never re-learns
+} timing_config_t;
+
+#define TIMING_DEFAULT_CONFIG {TIMING_MODE_AUTO, 100, 4.0f, 1000.0f, 0.01f, 0.5f, 3, 50}
+
+/**
+ * Resets all learned timings
+ * @param config configuration of the detector, copied
+ */
+void timing_detector_init(const timing_config_t *config);
+
+/**
+ * Adds a received frame to the timing state of its ID and checks its interval, O(1) time and no allocation.
+ * Anomalous intervals are not learned, so a flood cannot shift the mean. Only relearn_intervals consecutive deviations
+ * that agree with each other (a new period, not a burst) replace the learned timing. The state is not locked, so it
+ * must only be used by the thread that reads the bus
+ * @param id CAN ID of the frame, only IDs that were interned (see can_id_map.h) are tracked
+ * @param timestamp_us receive time of the frame in microseconds
+ * @param interval_us set to the time since the previous frame of the ID, 0 for the first frame
+ * @return TIMING_OK if the interval is within the learned timing
+ * @return TIMING_LEARNING if the interval was learned and not checked, or completed the re-learning of a new period
+ * @return TIMING_DEVIATION if the interval deviates by more than sigma standard deviations
+ * @return TIMING_BURST if burst_frames consecutive intervals were shorter than burst_ratio * mean
+ * @return TIMING_UNTRACKED if the ID was not interned
+ */
+timing_result_t timing_detector_update(canid_t id, long timestamp_us, long *interval_us);
+
+/**
+ * @return the learned mean interval of an ID in microseconds, 0 if the ID is not tracked
+ */
+float timing_detector_mean_interval(canid_t id);
+
+#endif // PENNE_TIMING_DETECTOR_H
@@ -1,15 +1,23 @@
 #include "can.h"
+#include "can_db.h"
 #include "crypto.h"
 #include "ecu.h"
+#include "freshness.h"
 #include "helpers.h"
+#include "observer_events.h"
+#include "payload_detector.h"
+#include "timing_detector.h"
 #include <fcntl.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <net/if.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -21,11 +29,20 @@ int vcan1_tx_socket;
 static can_message_t out_msg;
 msg_def_t msg_array[32] = {0};
 unsigned long last_can_msg = 0;
-long can_msg_timings_receive[HIGHEST_POSSIBLE_CAN_ID + 1] = {0};
-long can_msg_timings_send[HIGHEST_POSSIBLE_CAN_ID + 1] = {0};
-unsigned int can_reverence_timings[HIGHEST_POSSIBLE_CAN_ID + 1] = {0};
-bool gateway_read_whitelist[HIGHEST_POSSIBLE_CAN_ID + 1] = {0};
-bool gateway_write_whitelist[HIGHEST_POSSIBLE_CAN_ID + 1] = {0};
+
+can_frame_format_t can_frame_format = CAN_FRAME_FORMAT_LEGACY;
+_Thread_local can_rx_stats_t can_rx_stats = {0};
+
+/**
+ * Entry of the transmit schedule, a binary min-heap over the absolute time at which each message is due next
+ */
+typedef struct tx_schedule_entry_t {
+    long due;
+    int msg_index;
+} tx_schedule_entry_t;
+
+static tx_schedule_entry_t tx_schedule[MAX_MSGS];
+static int tx_schedule_size = 0;
 
 bool b_100_hz = false;
 bool b_20_hz = false;
@@ -78,6 +95,21 @@ int init_can(char *interface_name) {
         return -2;
     }
 
+    // Every received frame carries the time at which the kernel received it, so the timing checks do not depend on when
+    // userspace gets around to read the frame
+    int timestamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &timestamping, sizeof(timestamping))) {
+        perror("Error enabling CAN receive timestamps");
+    }
+
+#if CAN_TX_USE_TXTIME
+    // Let the kernel space the frames of a batch by their launch time, this needs an etf qdisc on the interface
+    struct sock_txtime txtime = {.clockid = CLOCK_TAI, .flags = 0};
+    if (setsockopt(s, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime))) {
+        perror("Error enabling SO_TXTIME, CAN frames will be sent without spacing");
+    }
+#endif
+
     if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
         perror("Bind");
         return -4;
@@ -93,6 +125,54 @@ int init_can(char *interface_name) {
     return 0;
 }
 
+int set_can_receive_filter(int rx_socket, const unsigned int *ids, size_t count) {
+    struct can_filter filters[MAX_MSGS];
+
+    if (count > MAX_MSGS) {
+        printf("Too many CAN IDs for the receive filter\n");
+        return -1;
+    }
+    // Only standard data frames with exactly these IDs pass, extended and remote frames are dropped as well
+    for (size_t i = 0; i < count; i++) {
+        filters[i].can_id = ids[i];
+        filters[i].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+    }
+    if (setsockopt(rx_socket, SOL_CAN_RAW, CAN_RAW_FILTER, filters, sizeof(struct can_filter) * count)) {
+        perror("Error setting CAN receive filter");
+        return -2;
+    }
+    return 0;
+}
+
+static void tx_schedule_sift_up(int i) {
+    tx_schedule_entry_t entry = tx_schedule[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (tx_schedule[parent].due <= entry.due) {
+            break;
+        }
+        tx_schedule[i] = tx_schedule[parent];
+        i = parent;
+    }
+    tx_schedule[i] = entry;
+}
+
+static void tx_schedule_sift_down(int i) {
+    tx_schedule_entry_t entry = tx_schedule[i];
+    while (2 * i + 1 < tx_schedule_size) {
+        int child = 2 * i + 1;
+        if (child + 1 < tx_schedule_size && tx_schedule[child + 1].due < tx_schedule[child].due) {
+            child++;
+        }
+        if (entry.due <= tx_schedule[child].due) {
+            break;
+        }
+        tx_schedule[i] = tx_schedule[child];
+        i = child;
+    }
+    tx_schedule[i] = entry;
+}
+
 void define_rep_msg(unsigned int id, unsigned int dlc, bool enb, unsigned int period) {
     for (int i = 0; i < MAX_MSGS; i++) {
         if (msg_array[i].id == 0) {
@@ -100,6 +180,12 @@ void define_rep_msg(unsigned int id, unsigned int dlc, bool enb, unsigned int pe
             msg_array[i].dlc = dlc;
             msg_array[i].enb = enb;
             msg_array[i].freq = period;
+
+            // All messages start in the same slot, afterwards each one keeps the phase of its own period
+            tx_schedule[tx_schedule_size].due = monotonic_micros();
+            tx_schedule[tx_schedule_size].msg_index = i;
+            tx_schedule_size++;
+            tx_schedule_sift_up(tx_schedule_size - 1);
             break;
         }
     }
@@ -111,21 +197,135 @@ void printbytes(unsigned char *bytes, size_t len) {
     }
 }
 
-ssize_t read_can(can_message_t *msg, int tx_socket) {
-    ssize_t n_bytes;
-    struct canfd_frame frame;
+unsigned char can_fd_len_round_up(unsigned int len) {
+    static const unsigned char fd_lengths[] = {12, 16, 20, 24, 32, 48, 64};
 
-    if (msg == NULL) {
+    if (len <= CAN_MAX_DLEN) {
+        return len;
+    }
+    for (size_t i = 0; i < sizeof(fd_lengths); i++) {
+        if (len <= fd_lengths[i]) {
+            return fd_lengths[i];
+        }
+    }
+    return CANFD_MAX_DLEN;
+}
+
+int can_frame_iv_len() { return can_frame_format == CAN_FRAME_FORMAT_COMPACT ? COMPACT_IV_LEN : CRYPTO_IV_LEN; }
+
+static void store_be64(unsigned char *dst, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        dst[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static uint64_t load_be64(const unsigned char *src) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | src[i];
+    }
+    return value;
+}
+
+/**
+ * Builds the IV and the additional authenticated data of a compact frame.
+ * The 96 bit IV is 4 zero bytes followed by the freshness value (sender ID and counter), the AAD is the CAN ID.
+ */
+static void compact_iv_and_aad(size_t id, const unsigned char *freshness, unsigned char *iv, unsigned char *aad) {
+    memset(iv, 0, COMPACT_IV_LEN - COMPACT_FRESHNESS_LEN);
+    memcpy(iv + COMPACT_IV_LEN - COMPACT_FRESHNESS_LEN, freshness, COMPACT_FRESHNESS_LEN);
+    aad[0] = id >> 24 & 0xFF;
+    aad[1] = id >> 16 & 0xFF;
+    aad[2] = id >> 8 & 0xFF;
+    aad[3] = id & 0xFF;
+}
+
+static int pack_compact_frame(can_message_t *msg, struct canfd_frame *frame) {
+    if (!using_encryption || encryption_key == NULL) {
+        // Without encryption the frame is just as long as the payload
+        frame->len = can_fd_len_round_up(msg->length);
+        memset(frame->data, 0, frame->len);
+        memcpy(frame->data, msg->buffer, msg->length);
+        return 0;
+    }
+    if (msg->length > CANFD_MAX_DLEN - COMPACT_AUTH_LEN) {
+        printf("CAN Write, payload too long for the compact format\n");
         return -1;
     }
 
-    n_bytes = read(tx_socket, &frame, sizeof(struct canfd_frame));
-    if (n_bytes < 0) {
+    // The payload is padded with zeros up to the next valid CAN FD length, the receiver gets the padded length
+    frame->len = can_fd_len_round_up(msg->length + COMPACT_AUTH_LEN);
+    int payload_len = frame->len - COMPACT_AUTH_LEN;
+    unsigned char plaintext[CANFD_MAX_DLEN] = {0};
+    memcpy(plaintext, msg->buffer, msg->length);
+
+    // The freshness value holds our sender ID in the top byte and the message counter of the nonce generator in the
+    // lower 56 bits
+    uint64_t counter = crypto_next_counter() & COMPACT_COUNTER_MASK;
+    unsigned char *freshness = frame->data + payload_len;
+    store_be64(freshness, ((uint64_t) crypto_nonce_sender_id() << 56) | counter);
+
+    unsigned char iv[COMPACT_IV_LEN];
+    unsigned char aad[4];
+    unsigned char tag[CRYPTO_TAG_LEN];
+    compact_iv_and_aad(msg->id, freshness, iv, aad);
+    if (gcm_encrypt(crypto_session, plaintext, payload_len, aad, sizeof(aad), iv, frame->data, tag, COMPACT_TAG_LEN) != payload_len) {
+        printf("Encryption failed\n");
+        return -2;
+    }
+    memcpy(frame->data + payload_len + COMPACT_FRESHNESS_LEN, tag, COMPACT_TAG_LEN);
+    return 0;
+}
+
+static int unpack_compact_frame(struct canfd_frame *frame, can_message_t *msg) {
+    msg->id = frame->can_id;
+    memset(msg->buffer, 0, sizeof(msg->buffer));
+    if (!using_encryption) {
+        msg->length = frame->len;
+        memcpy(msg->buffer, frame->data, frame->len);
         return 0;
     }
+    if (frame->len < COMPACT_AUTH_LEN || frame->len > CANFD_MAX_DLEN) {
+        return -2;
+    }
+
+    int payload_len = frame->len - COMPACT_AUTH_LEN;
+    unsigned char *freshness = frame->data + payload_len;
+    uint64_t freshness_value = load_be64(freshness);
+    unsigned char sender = freshness_value >> 56;
+    uint64_t counter = freshness_value & COMPACT_COUNTER_MASK;
+
+    // Every sender increments its counter with each frame, so a counter we have already seen is a replay
+    if (freshness_check(sender, counter) != 0) {
+        return -1;
+    }
+    if (!freshness_known(sender) && (long) counter < micros() - COMPACT_FIRST_FRAME_MAX_AGE) {
+        // There is no window for this sender yet, so a frame recorded earlier would be fresh. Like the timestamp of the
+        // legacy format, the counter bounds the age of the first frame, afterwards the window alone decides
+        return -1;
+    }
+
+    unsigned char iv[COMPACT_IV_LEN];
+    unsigned char aad[4];
+    compact_iv_and_aad(frame->can_id, freshness, iv, aad);
+    if (gcm_decrypt(crypto_session, frame->data, payload_len, aad, sizeof(aad), freshness + COMPACT_FRESHNESS_LEN, COMPACT_TAG_LEN, iv,
+                    msg->buffer) < 0) {
+        return -2;
+    }
+    // Only an authentic frame may advance the window, otherwise a forged counter could block the sender
+    freshness_accept(sender, counter);
+    msg->length = payload_len;
+    return 0;
+}
+
+int unpack_can_frame(struct canfd_frame *frame, can_message_t *msg) {
+    if (can_frame_format == CAN_FRAME_FORMAT_COMPACT) {
+        return unpack_compact_frame(frame, msg);
+    }
 
-    msg->id = frame.can_id;
-    msg->length = frame.len;
+    msg->id = frame->can_id;
+    msg->length = frame->len;
 
     // If encryption is used we have to decrypt the frame data and check the tag
     if (using_encryption) {
@@ -148,64 +348,220 @@ ssize_t read_can(can_message_t *msg, int tx_socket) {
         // The payload of the CANFD message looks like this:
         // <8 byte Ciphertext> <16 byte Tag> <4 byte additional authenticated data> <18 byte IV>
         // First we copy these fields into our variables
-        memcpy(ciphertext, frame.data, ciphertext_len);
-        memcpy(tag, frame.data + ciphertext_len, tag_len);
-        memcpy(aad, frame.data + ciphertext_len + tag_len, aad_len);
-        memcpy(iv, frame.data + ciphertext_len + tag_len + aad_len, iv_len);
-
-        // Reconstruct the timestamp of the received message out of the 8 bytes of aad
-        long timestamp = (long) aad[0] + ((long) aad[1] << 8) + ((long) aad[2] << 16) + ((long) aad[3] << 24) +
-                         ((long) aad[4] << 32) + ((long) aad[5] << 40) +
-                         ((long) aad[6] << 48) + ((long) aad[7] << 56);
-
-        // Get current timestamp
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-
-        // Check if the message was generated more than 1 second ago
-        if (tv.tv_sec - timestamp > 1) {
-            // We detected a replay attack
-            printf("Replay Attack detected! Ignoring message!\n");
-            return 0;
+        memcpy(ciphertext, frame->data, ciphertext_len);
+        memcpy(tag, frame->data + ciphertext_len, tag_len);
+        memcpy(aad, frame->data + ciphertext_len + tag_len, aad_len);
+        memcpy(iv, frame->data + ciphertext_len + tag_len + aad_len, iv_len);
+
+        // The IV starts with the message counter and the sender ID of the nonce generator, the IV is part of the
+        // authentication so a forged counter can not pass the decryption
+        uint64_t counter = load_be64(iv);
+        uint8_t sender = iv[8];
+        if (freshness_check(sender, counter) != 0) {
+            return -1;
+        }
+        if (!freshness_known(sender)) {
+            // There is no window for this sender yet, so a frame recorded earlier would be fresh. The timestamp in the
+            // AAD bounds the age of the first frame, afterwards the counter alone decides
+            long timestamp = (long) aad[0] + ((long) aad[1] << 8) + ((long) aad[2] << 16) + ((long) aad[3] << 24) +
+                             ((long) aad[4] << 32) + ((long) aad[5] << 40) +
+                             ((long) aad[6] << 48) + ((long) aad[7] << 56);
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            if (tv.tv_sec - timestamp > 1) {
+                return -1;
+            }
         }
 
         // Then we decrypt the Ciphertext with our commonly shared key
-        int decryptedtext_len = gcm_decrypt(ciphertext, ciphertext_len, (unsigned char *) aad, aad_len, tag,
-                                            encryption_key, iv, iv_len, decryptedtext);
+        int decryptedtext_len = gcm_decrypt(crypto_session, ciphertext, ciphertext_len, (unsigned char *) aad, aad_len,
+                                            tag, CRYPTO_TAG_LEN, iv, decryptedtext);
         if (decryptedtext_len > 0) {
             memcpy(msg->buffer, decryptedtext, 16);
         } else {
-            // if the message and the tag do not match, the decryption fails and we return -1
-            printf("Decryption failed, ignoring message\n");
-            return 0;
+            // if the message and the tag do not match, the decryption fails and we return -2
+            return -2;
         }
-        printf("Received message %x%x%x%x%x%x%x%x at %lu\n", tag[0], tag[1], tag[2], tag[3], tag[4], tag[5], tag[6],
-               tag[7], micros());
+        freshness_accept(sender, counter);
     } else {
-        memcpy(msg->buffer, frame.data, 16);
+        memcpy(msg->buffer, frame->data, 16);
     }
-    return n_bytes;
+    return 0;
 }
 
-int write_can(can_message_t msg, int tx_socket) {
-    struct canfd_frame frame;
-    frame.can_id = msg.id;
-    frame.len = 64;
+/**
+ * First stage of the receive pipeline, only looks at the header of the frame
+ */
+static bool rx_header_is_valid(const struct canfd_frame *frame, unsigned int received_len) {
+    // All ECUs send standard data frames, error, remote and extended frames are never consumed
+    if (received_len != CANFD_MTU && received_len != CAN_MTU) {
+        return false;
+    }
+    if (frame->can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG | CAN_EFF_FLAG)) {
+        return false;
+    }
+    return frame->len <= CANFD_MAX_DLEN;
+}
+
+/**
+ * Second stage of the receive pipeline, drops IDs that the handler of this ECU would ignore.
+ * This is the fallback for frames that passed the kernel filter (set_can_receive_filter(...)), the observer and the
+ * gateway consume every ID
+ */
+static bool rx_id_is_relevant(canid_t id) {
+    switch (ecu_number) {
+        case POWERTRAIN:
+        case CHASSIS:
+        case BODY:
+            return can_db_consumes(id, ecu_number);
+        default:
+            return true;
+    }
+}
+
+int read_can_frames(struct canfd_frame *frames, long *timestamps, int max_frames, int rx_socket) {
+    struct mmsghdr headers[CAN_RX_BUDGET];
+    struct iovec iovs[CAN_RX_BUDGET];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct cmsghdr align;
+    } controls[CAN_RX_BUDGET];
+
+    if (max_frames > CAN_RX_BUDGET) {
+        max_frames = CAN_RX_BUDGET;
+    }
+
+    memset(headers, 0, sizeof(struct mmsghdr) * max_frames);
+    for (int i = 0; i < max_frames; i++) {
+        iovs[i].iov_base = &frames[i];
+        iovs[i].iov_len = sizeof(struct canfd_frame);
+        headers[i].msg_hdr.msg_iov = &iovs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        if (timestamps != NULL) {
+            headers[i].msg_hdr.msg_control = controls[i].buf;
+            headers[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+        }
+    }
+
+    // MSG_WAITFORONE: a blocking socket only waits for the first frame, afterwards everything that is queued is returned
+    int n_received = recvmmsg(rx_socket, headers, max_frames, MSG_WAITFORONE, NULL);
+    if (n_received < 0) {
+        return -1;
+    }
+
+    // The kernel writes the frames directly into the buffer of the caller, a frame is only moved if a malformed frame
+    // before it was dropped
+    int n_frames = 0;
+    for (int i = 0; i < n_received; i++) {
+        can_rx_stats.received++;
+        if (!rx_header_is_valid(&frames[i], headers[i].msg_len)) {
+            can_rx_stats.dropped_malformed++;
+            continue;
+        }
+        if (headers[i].msg_len == CAN_MTU) {
+            // A classic CAN frame has padding where the CAN FD flags are, so it can be handled like a CAN FD frame
+            frames[i].flags = 0;
+            frames[i].__res0 = 0;
+            frames[i].__res1 = 0;
+        }
+
+        if (timestamps != NULL) {
+            // Use the time at which the kernel received the frame, only fall back to the current time if it is missing
+            timestamps[n_frames] = 0;
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&headers[i].msg_hdr); cmsg != NULL;
+                 cmsg = CMSG_NXTHDR(&headers[i].msg_hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                    struct scm_timestamping timestamping;
+                    memcpy(&timestamping, CMSG_DATA(cmsg), sizeof(timestamping));
+                    timestamps[n_frames] = timestamping.ts[0].tv_sec * 1000000 + timestamping.ts[0].tv_nsec / 1000;
+                }
+            }
+            if (timestamps[n_frames] == 0) {
+                timestamps[n_frames] = micros();
+            }
+        }
+
+        if (n_frames != i) {
+            frames[n_frames] = frames[i];
+        }
+        n_frames++;
+    }
+    return n_frames;
+}
+
+int read_can_batch(can_message_t *msgs, int max_msgs, int rx_socket) {
+    struct canfd_frame frames[CAN_RX_BUDGET];
+    long timestamps[CAN_RX_BUDGET];
+
+    // The header peek is the first stage and already happens in read_can_frames(...)
+    int n_frames = read_can_frames(frames, timestamps, max_msgs, rx_socket);
+    if (n_frames < 0) {
+        return -1;
+    }
+
+    // The frames pass the stages header peek -> ID relevance -> freshness -> authentication/decryption, the cheap
+    // stages come first so the expensive ones only run for frames that this ECU actually consumes
+    int n_msgs = 0;
+    for (int i = 0; i < n_frames; i++) {
+        can_message_t *msg = &msgs[n_msgs];
+
+        if (!rx_id_is_relevant(frames[i].can_id)) {
+            can_rx_stats.dropped_irrelevant++;
+            continue;
+        }
+        msg->timestamp = timestamps[i];
+
+        // unpack_can_frame(...) checks the freshness before it decrypts, so a replayed frame is never decrypted
+        int result = unpack_can_frame(&frames[i], msg);
+        if (result == -1) {
+            can_rx_stats.dropped_replay++;
+        } else if (result != 0) {
+            can_rx_stats.dropped_auth++;
+        } else {
+            can_rx_stats.dispatched++;
+            n_msgs++;
+        }
+    }
+    return n_msgs;
+}
+
+void print_can_rx_stats(const char *bus_name) {
+    printf("CAN RX %s: received %lu, dropped malformed %lu, irrelevant %lu, replay %lu, auth %lu, dispatched %lu\n", bus_name,
+           can_rx_stats.received, can_rx_stats.dropped_malformed, can_rx_stats.dropped_irrelevant, can_rx_stats.dropped_replay,
+           can_rx_stats.dropped_auth, can_rx_stats.dispatched);
+}
+
+ssize_t read_can(can_message_t *msg, int tx_socket) {
+    if (msg == NULL) {
+        return -1;
+    }
+    return read_can_batch(msg, 1, tx_socket);
+}
+
+
+
+int pack_can_frame(can_message_t *msg, struct canfd_frame *frame) {
+    frame->can_id = msg->id;
+    frame->len = 64;
+    frame->flags = 0;
     // First we set the 64 byte canfd_frame data to 0
-    memset(frame.data, 0, frame.len);
+    memset(frame->data, 0, frame->len);
 
-    if (msg.length > 64) {
+    if (msg->length > 64) {
         perror("CAN Write, Invalid payload length");
         return -1;
     }
 
+    if (can_frame_format == CAN_FRAME_FORMAT_COMPACT) {
+        return pack_compact_frame(msg, frame);
+    }
+
     // We only encrypt the message if the encryption flag is set and the key is not NULL
     if (using_encryption && encryption_key != NULL) {
-        // Create random 128bit nonce for the IV
-        unsigned char iv[16];
-        size_t iv_len = 16;
-        for (size_t i = 0; i < iv_len; i++)
-            iv[i] = rand() & 0xFF;
+        // The 128 bit IV holds our message counter and sender ID, so it is never reused
+        unsigned char iv[CRYPTO_IV_LEN];
+        size_t iv_len = CRYPTO_IV_LEN;
+        crypto_next_iv(iv, iv_len);
 
         unsigned char ciphertext[128];
 
@@ -233,24 +589,31 @@ int write_can(can_message_t msg, int tx_socket) {
         aad[5] = tv.tv_sec >> 40 & 0xFF;
         aad[6] = tv.tv_sec >> 48 & 0xFF;
         aad[7] = tv.tv_sec >> 56 & 0xFF;
-        int ciphertext_len = gcm_encrypt(msg.buffer, 16, aad, aad_len, encryption_key, iv, iv_len, ciphertext, tag);
+        int ciphertext_len = gcm_encrypt(crypto_session, msg->buffer, 16, aad, aad_len, iv, ciphertext, tag, CRYPTO_TAG_LEN);
         if (ciphertext_len > 0) {
             // We copy the ciphertext, tag, aad and IV into the canfd message buffer
-            memcpy(frame.data, ciphertext, ciphertext_len);
-            memcpy(frame.data + ciphertext_len, tag, 16);
-            memcpy(frame.data + ciphertext_len + tag_len, aad, aad_len);
-            memcpy(frame.data + ciphertext_len + tag_len + aad_len, iv, iv_len);
+            memcpy(frame->data, ciphertext, ciphertext_len);
+            memcpy(frame->data + ciphertext_len, tag, 16);
+            memcpy(frame->data + ciphertext_len + tag_len, aad, aad_len);
+            memcpy(frame->data + ciphertext_len + tag_len + aad_len, iv, iv_len);
 
         } else {
             printf("Encryption failed\n");
             return -2;
         }
-
-        printf("Sending message %x%x%x%x%x%x%x%x at %lu\n", tag[0], tag[1], tag[2], tag[3], tag[4], tag[5], tag[6],
-               tag[7], micros());
     } else {
         // If no encryption is used we simply copy the first 8 bytes from the message struct to the canfd_frame
-        memcpy(frame.data, msg.buffer, 16);
+        memcpy(frame->data, msg->buffer, 16);
+    }
+    return 0;
+}
+
+int write_can(can_message_t msg, int tx_socket) {
+    struct canfd_frame frame;
+
+    int ret = pack_can_frame(&msg, &frame);
+    if (ret != 0) {
+        return ret;
     }
 
     int nbytes = (int) write(tx_socket, &frame, sizeof(struct canfd_frame));
@@ -261,318 +624,151 @@ int write_can(can_message_t msg, int tx_socket) {
     return nbytes;
 }
 
-void can_write_100_hz_msgs() {
-    for (int i = 0; i < MAX_MSGS; i++) {
-        if ((msg_array[i].enb) & (msg_array[i].freq == 10)) {
-            memset(&out_msg, 0, sizeof(can_message_t));
-            out_msg.length = msg_array[i].dlc;
-            out_msg.id = msg_array[i].id;
-            switch (msg_array[i].id) {
-                case BRAKE_OUTPUT_IND_MSG:
-                    out_msg.buffer[0] = ((ecu_data.brake_output >> 8) & 0xFF);
-                    out_msg.buffer[1] = ((ecu_data.brake_output >> 0) & 0xFF);
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case ENGINE_RPM_MSG:
-                    out_msg.buffer[0] = ((ecu_data.engine_rpm >> 8) & 0xFF);
-                    out_msg.buffer[1] = ((ecu_data.engine_rpm >> 0) & 0xFF);
-                    out_msg.buffer[2] = ((ecu_data.speed_kph >> 8) & 0xFF);
-                    out_msg.buffer[3] = ((ecu_data.speed_kph >> 0) & 0xFF);
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case POWER_STEERING_OUT_IND_MSG:
-                    out_msg.buffer[0] = ((ecu_data.power_steering >> 8) & 0xFF);
-                    out_msg.buffer[1] = ((ecu_data.power_steering >> 0) & 0xFF);
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case SHIFT_POSITION_MSG:
-                    out_msg.buffer[0] = ecu_data.shift_position;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case BRAKE_OPERATION_MSG:
-                    out_msg.buffer[0] = ((ecu_data.brake_value >> 8) & 0xFF);
-                    out_msg.buffer[1] = ((ecu_data.brake_value >> 0) & 0xFF);
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case ACCELERATION_OPERATION_MSG:
-                    out_msg.buffer[0] = ((ecu_data.accelerator_value >> 8) & 0xFF);
-                    out_msg.buffer[1] = ((ecu_data.accelerator_value >> 0) & 0xFF);
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case STEERING_WHEEL_POS_MSG:
-                    out_msg.buffer[0] = ((ecu_data.steering_value >> 8) & 0xFF);
-                    out_msg.buffer[1] = ((ecu_data.steering_value >> 0) & 0xFF);
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case SHIFT_POSITION_SWITCH_MSG:
-                    out_msg.buffer[0] = ecu_data.shift_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case ENGINE_START_MSG:
-                    out_msg.buffer[0] = ecu_data.engine_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case TURN_SWITCH_MSG:
-                    out_msg.buffer[0] = ecu_data.turn_switch_value;
-                    out_msg.buffer[1] = ecu_data.hazard_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case HORN_SWITCH_MSG:
-                    out_msg.buffer[0] = ecu_data.horn_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case TURN_SIGNAL_INDICATOR_MSG:
-                    out_msg.buffer[0] = ecu_data.turn_signal_indicator;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                default:
-                    break;
-            }
-            usleep(CAN_MSG_SPACING);
-        } else if (msg_array[i].freq == 0) {
+int write_can_frames(struct canfd_frame *const *frames, int count, int tx_socket) {
+    struct mmsghdr headers[CAN_RX_BUDGET];
+    struct iovec iovs[CAN_RX_BUDGET];
+#if CAN_TX_USE_TXTIME
+    union {
+        char buf[CMSG_SPACE(sizeof(uint64_t))];
+        struct cmsghdr align;
+    } controls[CAN_RX_BUDGET];
+    struct timespec now;
+    clock_gettime(CLOCK_TAI, &now);
+    uint64_t launch_time = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+
+    if (count > CAN_RX_BUDGET) {
+        count = CAN_RX_BUDGET;
+    }
+
+    memset(headers, 0, sizeof(struct mmsghdr) * count);
+    for (int i = 0; i < count; i++) {
+        iovs[i].iov_base = frames[i];
+        iovs[i].iov_len = sizeof(struct canfd_frame);
+        headers[i].msg_hdr.msg_iov = &iovs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+#if CAN_TX_USE_TXTIME
+        // The frames of one batch get launch times CAN_MSG_SPACING microseconds apart, the etf qdisc spaces them out
+        headers[i].msg_hdr.msg_control = controls[i].buf;
+        headers[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&headers[i].msg_hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        uint64_t frame_launch_time = launch_time + (uint64_t) i * CAN_MSG_SPACING * 1000;
+        memcpy(CMSG_DATA(cmsg), &frame_launch_time, sizeof(uint64_t));
+#endif
+    }
+
+    // sendmmsg may send only a part of the batch, e.g. when the socket buffer is full, so we retry the remainder
+    int sent = 0;
+    while (sent < count) {
+        int ret = sendmmsg(tx_socket, headers + sent, count - sent, 0);
+        if (ret <= 0) {
+            perror("CAN Write");
             break;
         }
+        sent += ret;
     }
-    b_100_hz = false;
+    return sent;
 }
 
-void can_write_20_hz_msgs() {
-    for (int i = 0; i < MAX_MSGS; i++) {
-        if ((msg_array[i].enb) & (msg_array[i].freq == 50)) {
-            memset(&out_msg, 0, sizeof(can_message_t));
-            out_msg.length = msg_array[i].dlc;
-            out_msg.id = msg_array[i].id;
-            switch (msg_array[i].id) {
-                case ENGINE_STATUS_MSG:
-                    out_msg.buffer[0] = ecu_data.engine_status;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case PARKING_BRAKE_STATUS_MSG:
-                    out_msg.buffer[0] = ecu_data.parking_brake_status;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case LIGHT_SWITCH_MSG:
-                    out_msg.buffer[0] = ecu_data.light_switch_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case PARKING_BRAKE_MSG:
-                    out_msg.buffer[0] = ecu_data.parking_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                default:
-                    break;
-            }
-            usleep(CAN_MSG_SPACING);
-        } else if (msg_array[i].freq == 0) {
-            break;
-        }
+int write_can_batch(can_message_t *msgs, int count, int tx_socket) {
+    struct canfd_frame frames[MAX_MSGS];
+    struct canfd_frame *packed_frames[MAX_MSGS];
+    int packed = 0;
+
+    if (count > MAX_MSGS) {
+        count = MAX_MSGS;
     }
-    b_20_hz = false;
-}
 
-void can_write_10_hz_msgs() {
-    for (int i = 0; i < MAX_MSGS; i++) {
-        if ((msg_array[i].enb) & (msg_array[i].freq == 100)) {
-            memset(&out_msg, 0, sizeof(can_message_t));
-            out_msg.length = msg_array[i].dlc;
-            out_msg.id = msg_array[i].id;
-            switch (msg_array[i].id) {
-                case WIPER_SWITCH_FRONT_MSG:
-                    out_msg.buffer[0] = ecu_data.wiper_f_sw_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case WIPER_SWITCH_REAR_MSG:
-                    out_msg.buffer[0] = ecu_data.wiper_r_sw_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case DOOR_LOCK_UNLOCK_MSG:
-                    out_msg.buffer[0] = ecu_data.door_lock_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case L_DOOR_HANDLE_MSG:
-                    out_msg.buffer[0] = ecu_data.l_door_handle_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case R_DOOR_HANDLE_MSG:
-                    out_msg.buffer[0] = ecu_data.r_door_handle_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case L_WINDOW_SWITCH_MSG:
-                    out_msg.buffer[0] = ecu_data.l_window_switch_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case R_WINDOW_SWITCH_MSG:
-                    out_msg.buffer[0] = ecu_data.r_window_switch_value;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case DOOR_LOCK_STATUS_MSG:
-                    out_msg.buffer[0] = ecu_data.door_lock_status;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-
-                default:
-                    break;
-            }
-            usleep(CAN_MSG_SPACING);
-        } else if (msg_array[i].freq == 0) {
-            break;
+    for (int i = 0; i < count; i++) {
+        if (pack_can_frame(&msgs[i], &frames[packed]) != 0) {
+            printf("Failed to pack CAN message ID: 0x%zx\n", msgs[i].id);
+            continue;
         }
+        packed_frames[packed] = &frames[packed];
+        packed++;
     }
-    b_10_hz = false;
+    return write_can_frames(packed_frames, packed, tx_socket);
 }
 
-void can_write_2_hz_msgs() {
-    for (int i = 0; i < MAX_MSGS; i++) {
-        if ((msg_array[i].enb) & (msg_array[i].freq == 500)) {
-            memset(&out_msg, 0, sizeof(can_message_t));
-            out_msg.length = msg_array[i].dlc;
-            out_msg.id = msg_array[i].id;
-            switch (msg_array[i].id) {
-                case L_DOOR_POSITION_MSG:
-                    out_msg.buffer[0] = ecu_data.l_door_position;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                case R_DOOR_POSITION_MSG:
-                    out_msg.buffer[0] = ecu_data.r_door_position;
-                    write_can(out_msg, vcan0_tx_socket);
-                    break;
-                default:
-                    break;
-            }
-            usleep(CAN_MSG_SPACING);
-        } else if (msg_array[i].freq == 0) {
-            break;
-        }
+int encode_can_message(msg_def_t msg, can_message_t *out) {
+    const can_db_msg_t *def = can_db_lookup(msg.id);
+    if (def == NULL) {
+        return -1;
     }
-    b_2_hz = false;
+    can_db_encode(def, &ecu_data, out);
+    out->length = msg.dlc;
+    return 0;
 }
 
 int send_can_message(msg_def_t msg) {
-    memset(&out_msg, 0, sizeof(can_message_t));
-    out_msg.length = msg.dlc;
-    out_msg.id = msg.id;
-    switch (msg.id) {
-        case BRAKE_OUTPUT_IND_MSG:
-            out_msg.buffer[0] = ((ecu_data.brake_output >> 8) & 0xFF);
-            out_msg.buffer[1] = ((ecu_data.brake_output >> 0) & 0xFF);
-            break;
-        case ENGINE_RPM_MSG:
-            out_msg.buffer[0] = ((ecu_data.engine_rpm >> 8) & 0xFF);
-            out_msg.buffer[1] = ((ecu_data.engine_rpm >> 0) & 0xFF);
-            out_msg.buffer[2] = ((ecu_data.speed_kph >> 8) & 0xFF);
-            out_msg.buffer[3] = ((ecu_data.speed_kph >> 0) & 0xFF);
-            break;
-        case POWER_STEERING_OUT_IND_MSG:
-            out_msg.buffer[0] = ((ecu_data.power_steering >> 8) & 0xFF);
-            out_msg.buffer[1] = ((ecu_data.power_steering >> 0) & 0xFF);
-            break;
-        case SHIFT_POSITION_MSG:
-            out_msg.buffer[0] = ecu_data.shift_position;
-            break;
-        case BRAKE_OPERATION_MSG:
-            out_msg.buffer[0] = ((ecu_data.brake_value >> 8) & 0xFF);
-            out_msg.buffer[1] = ((ecu_data.brake_value >> 0) & 0xFF);
-            break;
-        case ACCELERATION_OPERATION_MSG:
-            out_msg.buffer[0] = ((ecu_data.accelerator_value >> 8) & 0xFF);
-            out_msg.buffer[1] = ((ecu_data.accelerator_value >> 0) & 0xFF);
-            break;
-        case STEERING_WHEEL_POS_MSG:
-            out_msg.buffer[0] = ((ecu_data.steering_value >> 8) & 0xFF);
-            out_msg.buffer[1] = ((ecu_data.steering_value >> 0) & 0xFF);
-            break;
-        case SHIFT_POSITION_SWITCH_MSG:
-            out_msg.buffer[0] = ecu_data.shift_value;
-            break;
-        case ENGINE_START_MSG:
-            out_msg.buffer[0] = ecu_data.engine_value;
-            break;
-        case TURN_SWITCH_MSG:
-            out_msg.buffer[0] = ecu_data.turn_switch_value;
-            out_msg.buffer[1] = ecu_data.hazard_value;
-            break;
-        case HORN_SWITCH_MSG:
-            out_msg.buffer[0] = ecu_data.horn_value;
-            break;
-        case TURN_SIGNAL_INDICATOR_MSG:
-            out_msg.buffer[0] = ecu_data.turn_signal_indicator;
-            break;
-        case ENGINE_STATUS_MSG:
-            out_msg.buffer[0] = ecu_data.engine_status;
-            break;
-        case PARKING_BRAKE_STATUS_MSG:
-            out_msg.buffer[0] = ecu_data.parking_brake_status;
-            break;
-        case LIGHT_SWITCH_MSG:
-            out_msg.buffer[0] = ecu_data.light_switch_value;
-            break;
-        case PARKING_BRAKE_MSG:
-            out_msg.buffer[0] = ecu_data.parking_value;
-            break;
-        case WIPER_SWITCH_FRONT_MSG:
-            out_msg.buffer[0] = ecu_data.wiper_f_sw_value;
-            break;
-        case WIPER_SWITCH_REAR_MSG:
-            out_msg.buffer[0] = ecu_data.wiper_r_sw_value;
-            break;
-        case DOOR_LOCK_UNLOCK_MSG:
-            out_msg.buffer[0] = ecu_data.door_lock_value;
-            break;
-        case L_DOOR_HANDLE_MSG:
-            out_msg.buffer[0] = ecu_data.l_door_handle_value;
-            break;
-        case R_DOOR_HANDLE_MSG:
-            out_msg.buffer[0] = ecu_data.r_door_handle_value;
-            break;
-        case L_WINDOW_SWITCH_MSG:
-            out_msg.buffer[0] = ecu_data.l_window_switch_value;
-            break;
-        case R_WINDOW_SWITCH_MSG:
-            out_msg.buffer[0] = ecu_data.r_window_switch_value;
-            break;
-        case DOOR_LOCK_STATUS_MSG:
-            out_msg.buffer[0] = ecu_data.door_lock_status;
-            break;
-        case L_DOOR_POSITION_MSG:
-            out_msg.buffer[0] = ecu_data.l_door_position;
-            break;
-        case R_DOOR_POSITION_MSG:
-            out_msg.buffer[0] = ecu_data.r_door_position;
-            break;
-        default:
-            return -1;
+    if (encode_can_message(msg, &out_msg) != 0) {
+        return -1;
     }
     return write_can(out_msg, vcan0_tx_socket);
 }
 
 int send_pending_can_messages() {
-    int sent_messages = 0;
+    can_message_t batch[MAX_MSGS];
+    int batch_size = 0;
+    long current_time = monotonic_micros();
 
+    // Every message that is due within the CAN_TX_SLACK window belongs to this slot and is sent as one batch
+    while (tx_schedule_size > 0 && tx_schedule[0].due - CAN_TX_SLACK <= current_time) {
+        msg_def_t msg = msg_array[tx_schedule[0].msg_index];
+        long period = (long) msg.freq * 1000;
 
-    for (int i = 0; i < MAX_MSGS; i++) {
-        msg_def_t msg = msg_array[i];
         if (msg.enb) {
-            long current_time = micros();
-            if ((long) msg.freq * 1000 - (current_time - can_msg_timings_send[msg.id]) < 300) {
-                int ret = send_can_message(msg);
-                if (ret <= 0) {
-                    printf("Failed to write CAN message ID: 0x%x, Error Code: %d\n", msg.id, ret);
-                }
-                can_msg_timings_send[msg.id] = current_time;
-                sent_messages++;
-                usleep(CAN_MSG_SPACING);
+            // The message is encoded now, but all messages of the slot are written with a single syscall afterwards
+            if (encode_can_message(msg, &batch[batch_size]) == 0) {
+                batch_size++;
+            } else {
+                printf("Failed to encode CAN message ID: 0x%x\n", msg.id);
             }
         }
+
+        // The next deadline is derived from the previous deadline and not from the time we actually sent the message,
+        // so wakeup latency does not accumulate into the period
+        tx_schedule[0].due += period;
+        if (tx_schedule[0].due - CAN_TX_SLACK <= current_time) {
+            // We fell behind by about a whole period (e.g. the process was stopped), skip the missed slots instead of
+            // sending a burst of stale messages. The test is the one of the loop, otherwise the message would be sent
+            // again in this batch
+            tx_schedule[0].due += ((current_time - (tx_schedule[0].due - CAN_TX_SLACK)) / period + 1) * period;
+        }
+        tx_schedule_sift_down(0);
+    }
+
+    if (batch_size == 0) {
+        return 0;
+    }
+    int sent_messages = write_can_batch(batch, batch_size, vcan0_tx_socket);
+    if (sent_messages < batch_size) {
+        printf("Failed to write %d of %d CAN messages\n", batch_size - sent_messages, batch_size);
     }
     return sent_messages;
 }
 
+long next_can_message_due() {
+    if (tx_schedule_size == 0) {
+        return 0;
+    }
+    return tx_schedule[0].due;
+}
+
+int read_can_bus_and_handle_input() {
+    can_message_t msgs[CAN_RX_BUDGET];
 
-void read_can_bus_and_handle_input() {
-    can_message_t msg;
-    // Check the vcan0 interface for a new message
-    ssize_t n_bytes = read_can(&msg, vcan0_tx_socket);
-    if (n_bytes > 0) {
+    // Drain the vcan0 interface with a single syscall, frames that are still queued afterwards wake the reactor again
+    int n_msgs = read_can_batch(msgs, CAN_RX_BUDGET, vcan0_tx_socket);
+    if (n_msgs <= 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < n_msgs; i++) {
+        can_message_t msg = msgs[i];
         switch (ecu_number) {
             case POWERTRAIN:
                 powertrain_handle_can_msg(msg);
@@ -586,357 +782,99 @@ void read_can_bus_and_handle_input() {
             case OBSERVER:
                 observer_handle_can_msg(msg);
                 break;
-            case GATEWAY:
-                gateway_handle_can_msg(msg, vcan0_tx_socket);
-                break;
             default:
                 break;
         }
     }
-}
-
-void *gateway_read_obd_port_loop() {
-    can_message_t msg;
-    ssize_t n_bytes;
-
-    while (1) {
-        n_bytes = read_can(&msg, vcan1_tx_socket);
-        if (n_bytes > 0) {
-            gateway_handle_can_msg(msg, vcan1_tx_socket);
-        }
-    }
+    return n_msgs;
 }
 
 void powertrain_handle_can_msg(can_message_t msg) {
-    switch (msg.id) {
-        // 100Hz
-        case BRAKE_OPERATION_MSG:
-            ecu_data.brake_value = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-        case ACCELERATION_OPERATION_MSG:
-            ecu_data.accelerator_value = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-        case STEERING_WHEEL_POS_MSG:
-            ecu_data.steering_value = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-        case SHIFT_POSITION_SWITCH_MSG:
-            ecu_data.shift_value = (msg.buffer[0]);
-            break;
-        case ENGINE_START_MSG:
-            ecu_data.engine_value = (msg.buffer[0]);
-            break;
-        case PARKING_BRAKE_MSG:
-            ecu_data.parking_value = (msg.buffer[0]);
-            break;
-        default:
-            break;
-    }
+    can_db_decode(&msg, POWERTRAIN, &ecu_data);
     last_can_msg = millis();
 }
 
 void chassis_handle_can_msg(can_message_t msg) {
-    switch (msg.id) {
-        case BRAKE_OUTPUT_IND_MSG:
-            ecu_data.brake_output = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-        case ENGINE_RPM_MSG:
-            ecu_data.engine_rpm = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            ecu_data.speed_kph = ((msg.buffer[2] << 8) | (msg.buffer[3]));
-            break;
-        case POWER_STEERING_OUT_IND_MSG:
-            ecu_data.power_steering = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-        case SHIFT_POSITION_MSG:
-            ecu_data.shift_position = (msg.buffer[0]);
-            break;
-        case TURN_SIGNAL_INDICATOR_MSG:
-            ecu_data.turn_signal_indicator = (msg.buffer[0]);
-            break;
-            // 20Hz
-        case ENGINE_STATUS_MSG:
-            ecu_data.engine_status = (msg.buffer[0] & 0x01);
-            break;
-        case PARKING_BRAKE_STATUS_MSG:
-            ecu_data.parking_brake_status = (msg.buffer[0] & 0x01);
-            break;
-            // 10Hz
-        case DOOR_LOCK_STATUS_MSG:
-            ecu_data.door_lock_status = (msg.buffer[0]);
-            if (((ecu_data.door_lock_status & 0x04) >> 2) & ((ecu_data_old.door_lock_status & 0x01) >> 0)) {
-                ecu_data.door_lock_value = ecu_data.door_lock_value & 0xfe;
-            } else if (((ecu_data.door_lock_status & 0x08) >> 3) & ((ecu_data_old.door_lock_status & 0x02) >> 1)) {
-                ecu_data.door_lock_value = ecu_data.door_lock_value & 0xfd;
-            }
-            break;
-            // 2Hz
-        case L_DOOR_POSITION_MSG:
-            ecu_data.l_door_position = (msg.buffer[0]);
-            break;
-        case R_DOOR_POSITION_MSG:
-            ecu_data.r_door_position = (msg.buffer[0]);
-            break;
-
-        default:
-            break;
-    }
+    can_db_decode(&msg, CHASSIS, &ecu_data);
     last_can_msg = millis();
 }
 
 void body_handle_can_msg(can_message_t msg) {
-    switch (msg.id) {
-
-        // 100Hz
-        case TURN_SWITCH_MSG:
-            ecu_data.turn_switch_value = msg.buffer[0];
-            ecu_data.hazard_value = msg.buffer[1];
-            break;
-        case HORN_SWITCH_MSG:
-            ecu_data.horn_value = (msg.buffer[0] & 0x01);
-            break;
-        case BRAKE_OPERATION_MSG:
-            ecu_data.brake_value = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-            // 20Hz
-        case LIGHT_SWITCH_MSG:
-            ecu_data.light_switch_value = (msg.buffer[0] & 0x07);
-            break;
-            // 10Hz
-        case WIPER_SWITCH_FRONT_MSG:
-            ecu_data.wiper_f_sw_value = (msg.buffer[0]);
-            break;
-        case WIPER_SWITCH_REAR_MSG:
-            ecu_data.wiper_r_sw_value = (msg.buffer[0]);
-            break;
-        case DOOR_LOCK_UNLOCK_MSG:
-            ecu_data.door_lock_value = (msg.buffer[0]);
-            break;
-        case L_DOOR_HANDLE_MSG:
-            ecu_data.l_door_handle_value = (msg.buffer[0]);
-            break;
-        case R_DOOR_HANDLE_MSG:
-            ecu_data.r_door_handle_value = (msg.buffer[0]);
-            break;
-        case L_WINDOW_SWITCH_MSG:
-            ecu_data.l_window_switch_value = (msg.buffer[0]);
-            break;
-        case R_WINDOW_SWITCH_MSG:
-            ecu_data.r_window_switch_value = (msg.buffer[0]);
-            break;
+    can_db_decode(&msg, BODY, &ecu_data);
+    last_can_msg = millis();
+}
 
-        default:
+/**
+ * Shows the result of a frame in the GUI, a signal whose current value is still invalid stays visible, it is only
+ * checked again when a frame changes it
+ */
+static void observer_show(observer_id_t id, observer_code_t code) {
+    observer_id_t bad_value = payload_detector_active_violation();
+    if (bad_value != NONE) {
+        id = bad_value;
+        code = BAD_VALUE;
+    }
+    // Only a changed result is marked dirty and sent to the GUI
+    ECU_DATA_SET(observer_id, id);
+    ECU_DATA_SET(observer_code, code);
+}
 
-            break;
+/**
+ * An attack can violate the payload checks with every frame, so the log only gets one summary per second and does not
+ * slow down the receive path
+ * @param timestamp receive time of the frame in us
+ * @param n_violations number of violations in the frame
+ */
+static void log_payload_violations(long timestamp, int n_violations) {
+    static long summary_time = 0;
+    static long n_unlogged = 0;
+    n_unlogged += n_violations;
+    if (n_unlogged > 0 && timestamp - summary_time >= 1000000) {
+        printf("%ld payload violations since the last summary\n", n_unlogged);
+        summary_time = timestamp;
+        n_unlogged = 0;
     }
-    last_can_msg = millis();
 }
 
 void observer_handle_can_msg(can_message_t msg) {
 
-    // Reset Observer to OK, it will be overwritten if we find anything irregular
-    ecu_data.observer_id = NONE;
-    ecu_data.observer_code = OK;
-
-    last_can_msg = micros();
-
-    // Ignore Messages with a higher ID so we don't get an access out of bounds
-    if (msg.id >= 0xFFF) {
-        return;
-    }
-    if (can_msg_timings_receive[msg.id] != 0 && can_reverence_timings[msg.id] !=
-                                                0) { // if can_msg_timings[msg.id] is 0, the message was received for the first time
-        int time_deviation = last_can_msg - can_msg_timings_receive[msg.id] - can_reverence_timings[msg.id] * 1000;
-
-        if (time_deviation > 8000 || time_deviation < -8000) {
-            printf("ID: 0x%x, Time: %zu\n", msg.id, last_can_msg);
-            printf("Deviation: %d us\n", time_deviation);
-            ecu_data.observer_code = BAD_TIMING;
-            ecu_data.observer_id = msg.id;
-        }
-    }
+    // The result is OK, unless we find anything irregular. Every detection is also queued as an event, so the GUI sees
+    // it even if the next frame resets the result
+    observer_id_t id = NONE;
+    observer_code_t code = OK;
 
-    switch (msg.id) {
+    // The kernel receive timestamp is not delayed by the time the frame spent in the socket queue
+    last_can_msg = msg.timestamp;
 
-        // 100Hz
-        case TURN_SWITCH_MSG:
-            ecu_data.turn_switch_value = msg.buffer[0];
-            ecu_data.hazard_value = msg.buffer[1];
-            break;
-        case HORN_SWITCH_MSG:
-            ecu_data.horn_value = (msg.buffer[0] & 0x01);
-            break;
-        case BRAKE_OPERATION_MSG:
-            ecu_data.brake_value = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-            // 20Hz
-        case LIGHT_SWITCH_MSG:
-            ecu_data.light_switch_value = (msg.buffer[0] & 0x07);
-            break;
-            // 10Hz
-        case WIPER_SWITCH_FRONT_MSG:
-            ecu_data.wiper_f_sw_value = (msg.buffer[0]);
-            break;
-        case WIPER_SWITCH_REAR_MSG:
-            ecu_data.wiper_r_sw_value = (msg.buffer[0]);
-            break;
-        case DOOR_LOCK_UNLOCK_MSG:
-            ecu_data.door_lock_value = (msg.buffer[0]);
-            break;
-        case L_DOOR_HANDLE_MSG:
-            ecu_data.l_door_handle_value = (msg.buffer[0]);
-            break;
-        case R_DOOR_HANDLE_MSG:
-            ecu_data.r_door_handle_value = (msg.buffer[0]);
-            break;
-        case L_WINDOW_SWITCH_MSG:
-            ecu_data.l_window_switch_value = (msg.buffer[0]);
-            break;
-        case R_WINDOW_SWITCH_MSG:
-            ecu_data.r_window_switch_value = (msg.buffer[0]);
-            break;
-        case BRAKE_OUTPUT_IND_MSG:
-            ecu_data.brake_output = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-        case ENGINE_RPM_MSG:
-            ecu_data.engine_rpm = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            ecu_data.speed_kph = ((msg.buffer[2] << 8) | (msg.buffer[3]));
-            break;
-        case POWER_STEERING_OUT_IND_MSG:
-            ecu_data.power_steering = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-        case SHIFT_POSITION_MSG:
-            ecu_data.shift_position = (msg.buffer[0]);
-            break;
-        case TURN_SIGNAL_INDICATOR_MSG:
-            ecu_data.turn_signal_indicator = (msg.buffer[0]);
-            break;
-            // 20Hz
-        case ENGINE_STATUS_MSG:
-            ecu_data.engine_status = (msg.buffer[0] & 0x01);
-            break;
-        case PARKING_BRAKE_STATUS_MSG:
-            ecu_data.parking_brake_status = (msg.buffer[0] & 0x01);
-            break;
-            // 10Hz
-        case DOOR_LOCK_STATUS_MSG:
-            ecu_data.door_lock_status = (msg.buffer[0]);
-            if (((ecu_data.door_lock_status & 0x04) >> 2) & ((ecu_data_old.door_lock_status & 0x01) >> 0)) {
-                ecu_data.door_lock_value = ecu_data.door_lock_value & 0xfe;
-            } else if (((ecu_data.door_lock_status & 0x08) >> 3) & ((ecu_data_old.door_lock_status & 0x02) >> 1)) {
-                ecu_data.door_lock_value = ecu_data.door_lock_value & 0xfd;
-            }
-            break;
-            // 2Hz
-        case L_DOOR_POSITION_MSG:
-            ecu_data.l_door_position = (msg.buffer[0]);
-            break;
-        case R_DOOR_POSITION_MSG:
-            ecu_data.r_door_position = (msg.buffer[0]);
-            break;
-        case ACCELERATION_OPERATION_MSG:
-            ecu_data.accelerator_value = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-        case STEERING_WHEEL_POS_MSG:
-            ecu_data.steering_value = ((msg.buffer[0] << 8) | (msg.buffer[1]));
-            break;
-        case SHIFT_POSITION_SWITCH_MSG:
-            ecu_data.shift_value = (msg.buffer[0]);
-            break;
-        case ENGINE_START_MSG:
-            ecu_data.engine_value = (msg.buffer[0]);
-            break;
-        case PARKING_BRAKE_MSG:
-            ecu_data.parking_value = (msg.buffer[0]);
-            break;
-        default:
-            ecu_data.observer_code = BAD_CAN_ID;
-            ecu_data.observer_id = msg.id;
-            break;
+    long interval;
+    timing_result_t timing = timing_detector_update(msg.id, msg.timestamp, &interval);
+    if (timing == TIMING_DEVIATION || timing == TIMING_BURST) {
+        code = BAD_TIMING;
+        id = msg.id;
+        observer_event_push(msg.timestamp, msg.id, NONE, BAD_TIMING, interval);
     }
 
-    can_msg_timings_receive[msg.id] = last_can_msg;
-}
-
-void gateway_handle_can_msg(can_message_t msg, int receiving_socket) {
-    if (msg.id > HIGHEST_POSSIBLE_CAN_ID) {
-        perror("Gatway ECU received invalid CAN ID");
+    // Every message of the database is decoded by the observer, anything else is not supposed to be on the bus
+    if (can_db_decode(&msg, OBSERVER, &ecu_data) != 0) {
+        observer_event_push(msg.timestamp, msg.id, NONE, BAD_CAN_ID, 0);
+        observer_show(msg.id, BAD_CAN_ID);
         return;
     }
-    pthread_mutex_lock(&gateway_lock);
-    ecu_data.gateway_id = msg.id;
-    ecu_data.gateway_code = 0; // OK
-    if (receiving_socket == vcan0_tx_socket) {
-        if (gateway_read_whitelist[msg.id] == true) {
-            write_can(msg, vcan1_tx_socket);
-        } else {
-            ecu_data.gateway_code = 1; // READ_BLOCKED
-        }
-    }
 
-    if (receiving_socket == vcan1_tx_socket) {
-        if (gateway_write_whitelist[msg.id] == true) {
-            write_can(msg, vcan0_tx_socket);
-        } else {
-            ecu_data.gateway_code = 2; // WRITE_BLOCKED
-        }
+    // Only the signals of this frame are checked, every violation is queued as an event
+    payload_violation_t violations[PAYLOAD_MAX_VIOLATIONS];
+    int n_violations = payload_detector_check_frame(can_db_lookup(msg.id), &ecu_data, msg.timestamp, violations, PAYLOAD_MAX_VIOLATIONS);
+    log_payload_violations(msg.timestamp, n_violations);
+    for (int i = 0; i < n_violations && i < PAYLOAD_MAX_VIOLATIONS; i++) {
+        code = BAD_VALUE;
+        id = violations[i].id;
+        observer_event_push(msg.timestamp, msg.id, violations[i].id, BAD_VALUE, violations[i].value);
     }
-    pthread_mutex_unlock(&gateway_lock);
+    observer_show(id, code);
 }
 
 void setup_observer_reference_timings() {
-    can_reverence_timings[BRAKE_OUTPUT_IND_MSG] = 10;
-    can_reverence_timings[ENGINE_RPM_MSG] = 10;
-    can_reverence_timings[POWER_STEERING_OUT_IND_MSG] = 10;
-    can_reverence_timings[SHIFT_POSITION_MSG] = 10;
-    can_reverence_timings[BRAKE_OPERATION_MSG] = 10;
-    can_reverence_timings[ACCELERATION_OPERATION_MSG] = 10;
-    can_reverence_timings[STEERING_WHEEL_POS_MSG] = 10;
-    can_reverence_timings[SHIFT_POSITION_SWITCH_MSG] = 10;
-    can_reverence_timings[ENGINE_START_MSG] = 10;
-    can_reverence_timings[TURN_SWITCH_MSG] = 10;
-    can_reverence_timings[HORN_SWITCH_MSG] = 10;
-    can_reverence_timings[TURN_SIGNAL_INDICATOR_MSG] = 10;
-    can_reverence_timings[ENGINE_STATUS_MSG] = 50;
-    can_reverence_timings[PARKING_BRAKE_STATUS_MSG] = 50;
-    can_reverence_timings[LIGHT_SWITCH_MSG] = 50;
-    can_reverence_timings[PARKING_BRAKE_MSG] = 50;
-    can_reverence_timings[WIPER_SWITCH_FRONT_MSG] = 100;
-    can_reverence_timings[WIPER_SWITCH_REAR_MSG] = 100;
-    can_reverence_timings[DOOR_LOCK_UNLOCK_MSG] = 100;
-    can_reverence_timings[L_WINDOW_SWITCH_MSG] = 100;
-    can_reverence_timings[R_WINDOW_SWITCH_MSG] = 100;
-    can_reverence_timings[L_DOOR_HANDLE_MSG] = 100;
-    can_reverence_timings[R_DOOR_HANDLE_MSG] = 100;
-    can_reverence_timings[DOOR_LOCK_STATUS_MSG] = 100;
-    can_reverence_timings[L_DOOR_POSITION_MSG] = 500;
-    can_reverence_timings[R_DOOR_POSITION_MSG] = 500;
-}
-
-void setup_gateway_whitelist() {
-    // true -> reading/writing allowed, by default all values are 0/false
-    gateway_read_whitelist[BRAKE_OUTPUT_IND_MSG] = false;
-    gateway_read_whitelist[ENGINE_RPM_MSG] = true;
-    gateway_read_whitelist[POWER_STEERING_OUT_IND_MSG] = true;
-    gateway_read_whitelist[SHIFT_POSITION_MSG] = true;
-    gateway_read_whitelist[BRAKE_OPERATION_MSG] = true;
-    gateway_read_whitelist[ACCELERATION_OPERATION_MSG] = true;
-    gateway_read_whitelist[STEERING_WHEEL_POS_MSG] = true;
-    gateway_read_whitelist[SHIFT_POSITION_SWITCH_MSG] = true;
-    gateway_read_whitelist[ENGINE_START_MSG] = true;
-    gateway_read_whitelist[TURN_SWITCH_MSG] = true;
-    gateway_read_whitelist[HORN_SWITCH_MSG] = true;
-    gateway_read_whitelist[TURN_SIGNAL_INDICATOR_MSG] = true;
-    gateway_read_whitelist[ENGINE_STATUS_MSG] = true;
-    gateway_read_whitelist[PARKING_BRAKE_STATUS_MSG] = true;
-    gateway_read_whitelist[LIGHT_SWITCH_MSG] = true;
-    gateway_read_whitelist[PARKING_BRAKE_MSG] = true;
-    gateway_read_whitelist[WIPER_SWITCH_FRONT_MSG] = true;
-    gateway_read_whitelist[WIPER_SWITCH_REAR_MSG] = true;
-    gateway_read_whitelist[DOOR_LOCK_UNLOCK_MSG] = true;
-    gateway_read_whitelist[L_WINDOW_SWITCH_MSG] = true;
-    gateway_read_whitelist[R_WINDOW_SWITCH_MSG] = true;
-    gateway_read_whitelist[L_DOOR_HANDLE_MSG] = true;
-    gateway_read_whitelist[R_DOOR_HANDLE_MSG] = true;
-    gateway_read_whitelist[DOOR_LOCK_STATUS_MSG] = true;
-    gateway_read_whitelist[L_DOOR_POSITION_MSG] = true;
-    gateway_read_whitelist[R_DOOR_POSITION_MSG] = true;
+    // The detector learns the interval of every ID from the traffic, the periods of the database are not needed
+    timing_config_t config = TIMING_DEFAULT_CONFIG;
+    timing_detector_init(&config);
 }
@@ -0,0 +1,222 @@
+#include "can_db.h"
+#include "can_id_map.h"
+#include <string.h>
+
+#define SIGNAL(field, offset, width, mask, min, max, observer_id)                                                                                  \
+  { offsetof(ecu_data_t, field), CAN_FIELD_TYPE(field), offset, width, true, mask, min, max, NULL, observer_id }
+#define U16(field, offset, min, max, observer_id) SIGNAL(field, offset, 2, 0xFFFF, min, max, observer_id)
+#define U8(field, offset, min, max, observer_id) SIGNAL(field, offset, 1, 0xFF, min, max, observer_id)
+#define BIT(field, offset, observer_id) SIGNAL(field, offset, 1, 0x01, 0, 1, observer_id)
+#define GEAR_CHAR(field, offset, observer_id)                                                                                                      \
+  { offsetof(ecu_data_t, field), CAN_FIELD_TYPE(field), offset, 1, true, 0xFF, 0, 0, "PNRD", observer_id }
+
+#define MSG(id, dlc, period, sender, consumers, signals, on_decoded)                                                                               \
+  { id, dlc, period, sender, consumers, sizeof(signals) / sizeof(signals[0]), signals, on_decoded }
+
+// The observer decodes every message of the bus
+#define PT (ECU_BIT(POWERTRAIN) | ECU_BIT(OBSERVER))
+#define CH (ECU_BIT(CHASSIS) | ECU_BIT(OBSERVER))
+#define BD (ECU_BIT(BODY) | ECU_BIT(OBSERVER))
+
+// Powertrain
+static const can_signal_t brake_output_ind[] = {U16(brake_output, 0, 0, 65535, BRAKE_OUTPUT)};
+static const can_signal_t engine_rpm[] = {U16(engine_rpm, 0, 0, 65535, ENGINE_RPM), U16(speed_kph, 2, 0, 255, SPEED_KPH)};
+static const can_signal_t power_steering_out_ind[] = {U16(power_steering, 0, 330, 390, POWER_STEERING)};
+static const can_signal_t shift_position[] = {GEAR_CHAR(shift_position, 0, SHIFT_POSITION)};
+static const can_signal_t engine_status[] = {BIT(engine_status, 0, ENGINE_STATUS)};
+static const can_signal_t parking_brake_status[] = {BIT(parking_brake_status, 0, PARKING_BRAKE_STATUS)};
+
+// Chassis
+static const can_signal_t brake_operation[] = {U16(brake_value, 0, 0, 100, BRAKE_VALUE)};
+static const can_signal_t acceleration_operation[] = {U16(accelerator_value, 0, 0, 100, ACCELERATOR_VALUE)};
+static const can_signal_t steering_wheel_pos[] = {U16(steering_value, 0, 0, 720, STEERING_VALUE)};
+static const can_signal_t shift_position_switch[] = {GEAR_CHAR(shift_value, 0, SHIFT_VALUE)};
+static const can_signal_t engine_start[] = {U8(engine_value, 0, 0, 1, ENGINE_VALUE)};
+static const can_signal_t turn_switch[] = {U8(turn_switch_value, 0, 0, 3, TURN_SWITCH_VALUE), U8(hazard_value, 1, 0, 1, HAZARD_VALUE)};
+static const can_signal_t horn_switch[] = {BIT(horn_value, 0, HORN_VALUE)};
+static const can_signal_t light_switch[] = {SIGNAL(light_switch_value, 0, 1, 0x07, 0, 2, LIGHT_SWITCH_VALUE)};
+static const can_signal_t parking_brake[] = {U8(parking_value, 0, 0, 1, PARKING_VALUE)};
+static const can_signal_t wiper_switch_front[] = {U8(wiper_f_sw_value, 0, 0, 1, WIPER_F_SW_VALUE)};
+static const can_signal_t wiper_switch_rear[] = {U8(wiper_r_sw_value, 0, 0, 1, WIPER_R_SW_VALUE)};
+static const can_signal_t door_lock_unlock[] = {U8(door_lock_value, 0, 0, 255, DOOR_LOCK_VALUE)};
+static const can_signal_t l_window_switch[] = {U8(l_window_switch_value, 0, 0, 2, L_WINDOW_SWITCH_VALUE)};
+static const can_signal_t r_window_switch[] = {U8(r_window_switch_value, 0, 0, 2, R_WINDOW_SWITCH_VALUE)};
+static const can_signal_t l_door_handle[] = {U8(l_door_handle_value, 0, 0, 2, L_DOOR_HANDLE_VALUE)};
+static const can_signal_t r_door_handle[] = {U8(r_door_handle_value, 0, 0, 1, R_DOOR_HANDLE_VALUE)};
+
+// Body
+static const can_signal_t turn_signal_indicator[] = {U8(turn_signal_indicator, 0, 0, 3, TURN_SIGNAL_INDICATOR)};
+static const can_signal_t door_lock_status[] = {U8(door_lock_status, 0, 0, 1, DOOR_LOCK_STATUS)};
+static const can_signal_t l_door_position[] = {U8(l_door_position, 0, 0, 1, L_DOOR_POSITION)};
+static const can_signal_t r_door_position[] = {U8(r_door_position, 0, 0, 2, R_DOOR_POSITION)};
+
+/**
+ * Releases the lock/unlock button of the chassis ECU once the body ECU reports that the doors were locked/unlocked
+ */
+static void door_lock_status_decoded(ecu_data_t *data) {
+  // Status of the previous DOOR_LOCK_STATUS message
+  static unsigned char previous_status = 0;
+  unsigned char door_lock_value = data->door_lock_value;
+  if (((data->door_lock_status & 0x04) >> 2) & ((previous_status & 0x01) >> 0)) {
+    door_lock_value = door_lock_value & 0xfe;
+  } else if (((data->door_lock_status & 0x08) >> 3) & ((previous_status & 0x02) >> 1)) {
+    door_lock_value = door_lock_value & 0xfd;
+  }
+  if (data->door_lock_value != door_lock_value) {
+    data->door_lock_value = door_lock_value;
+    ecu_data_mark_dirty(offsetof(ecu_data_t, door_lock_value));
+  }
+  previous_status = data->door_lock_status;
+}
+
+const can_db_msg_t can_db_messages[] = {
+    // Powertrain
+    MSG(BRAKE_OUTPUT_IND_MSG, 8, 10, POWERTRAIN, CH, brake_output_ind, NULL),
+    // The gateway tracks the speed for the conditions of its policy
+    MSG(ENGINE_RPM_MSG, 8, 10, POWERTRAIN, CH | ECU_BIT(GATEWAY), engine_rpm, NULL),
+    MSG(POWER_STEERING_OUT_IND_MSG, 8, 10, POWERTRAIN, CH, power_steering_out_ind, NULL),
+    MSG(SHIFT_POSITION_MSG, 8, 10, POWERTRAIN, CH, shift_position, NULL),
+    MSG(ENGINE_STATUS_MSG, 8, 50, POWERTRAIN, CH, engine_status, NULL),
+    MSG(PARKING_BRAKE_STATUS_MSG, 8, 50, POWERTRAIN, CH, parking_brake_status, NULL),
+    // Chassis
+    MSG(BRAKE_OPERATION_MSG, 8, 10, CHASSIS, PT | BD, brake_operation, NULL),
+    MSG(ACCELERATION_OPERATION_MSG, 8, 10, CHASSIS, PT, acceleration_operation, NULL),
+    MSG(STEERING_WHEEL_POS_MSG, 8, 10, CHASSIS, PT, steering_wheel_pos, NULL),
+    MSG(SHIFT_POSITION_SWITCH_MSG, 8, 10, CHASSIS, PT, shift_position_switch, NULL),
+    MSG(ENGINE_START_MSG, 8, 10, CHASSIS, PT, engine_start, NULL),
+    MSG(TURN_SWITCH_MSG, 8, 10, CHASSIS, BD, turn_switch, NULL),
+    MSG(HORN_SWITCH_MSG, 8, 10, CHASSIS, BD, horn_switch, NULL),
+    MSG(LIGHT_SWITCH_MSG, 8, 50, CHASSIS, BD, light_switch, NULL),
+    MSG(PARKING_BRAKE_MSG, 8, 50, CHASSIS, PT, parking_brake, NULL),
+    MSG(WIPER_SWITCH_FRONT_MSG, 8, 100, CHASSIS, BD, wiper_switch_front, NULL),
+    MSG(WIPER_SWITCH_REAR_MSG, 8, 100, CHASSIS, BD, wiper_switch_rear, NULL),
+    MSG(DOOR_LOCK_UNLOCK_MSG, 8, 100, CHASSIS, BD, door_lock_unlock, NULL),
+    MSG(L_WINDOW_SWITCH_MSG, 8, 100, CHASSIS, BD, l_window_switch, NULL),
+    MSG(R_WINDOW_SWITCH_MSG, 8, 100, CHASSIS, BD, r_window_switch, NULL),
+    MSG(L_DOOR_HANDLE_MSG, 8, 100, CHASSIS, BD, l_door_handle, NULL),
+    MSG(R_DOOR_HANDLE_MSG, 8, 100, CHASSIS, BD, r_door_handle, NULL),
+    // Body
+    MSG(TURN_SIGNAL_INDICATOR_MSG, 8, 10, BODY, CH, turn_signal_indicator, NULL),
+    MSG(DOOR_LOCK_STATUS_MSG, 8, 100, BODY, CH, door_lock_status, door_lock_status_decoded),
+    MSG(L_DOOR_POSITION_MSG, 8, 500, BODY, CH, l_door_position, NULL),
+    MSG(R_DOOR_POSITION_MSG, 8, 500, BODY, CH, r_door_position, NULL),
+};
+const size_t can_db_message_count = sizeof(can_db_messages) / sizeof(can_db_messages[0]);
+
+void can_db_init() {
+  // The messages are interned first and in table order, so the dense index of a database ID is its row in the table
+  can_id_map_reset();
+  for (size_t i = 0; i < can_db_message_count; i++)
+    can_id_intern(can_db_messages[i].id);
+}
+
+const can_db_msg_t *can_db_lookup(size_t id) {
+  int index = can_id_lookup(id);
+  if (index < 0 || (size_t)index >= can_db_message_count)
+    return NULL;
+  return &can_db_messages[index];
+}
+
+bool can_db_consumes(size_t id, ecu_type_t consumer) {
+  const can_db_msg_t *def = can_db_lookup(id);
+  return def != NULL && (def->consumers & ECU_BIT(consumer));
+}
+
+size_t can_db_consumed_ids(ecu_type_t consumer, unsigned int *ids, size_t max_ids) {
+  size_t count = 0;
+  for (size_t i = 0; i < can_db_message_count && count < max_ids; i++) {
+    if (can_db_messages[i].consumers & ECU_BIT(consumer))
+      ids[count++] = can_db_messages[i].id;
+  }
+  return count;
+}
+
+int can_db_field_value(const ecu_data_t *data, size_t field, can_field_type_t type) {
+  const char *value = (const char *)data + field;
+  switch (type) {
+  case CAN_FIELD_INT:
+    return *(const int *)value;
+  case CAN_FIELD_UINT:
+    return *(const unsigned int *)value;
+  case CAN_FIELD_UCHAR:
+    return *(const unsigned char *)value;
+  case CAN_FIELD_CHAR:
+    return *(const char *)value;
+  case CAN_FIELD_BOOL:
+    return *(const bool *)value;
+  }
+  return 0;
+}
+
+int can_db_signal_value(const ecu_data_t *data, const can_signal_t *signal) { return can_db_field_value(data, signal->field, signal->type); }
+
+/**
+ * @return true if the value of the field changed
+ */
+static bool store_field(ecu_data_t *data, const can_signal_t *signal, int value) {
+  if (signal->type == CAN_FIELD_BOOL)
+    value = value != 0;
+  if (can_db_signal_value(data, signal) == value)
+    return false;
+  char *field = (char *)data + signal->field;
+  switch (signal->type) {
+  case CAN_FIELD_INT:
+    *(int *)field = value;
+    break;
+  case CAN_FIELD_UINT:
+    *(unsigned int *)field = value;
+    break;
+  case CAN_FIELD_UCHAR:
+    *(unsigned char *)field = value;
+    break;
+  case CAN_FIELD_CHAR:
+    *(char *)field = value;
+    break;
+  case CAN_FIELD_BOOL:
+    *(bool *)field = value;
+    break;
+  }
+  return true;
+}
+
+void can_db_encode(const can_db_msg_t *def, const ecu_data_t *data, can_message_t *out) {
+  memset(out, 0, sizeof(can_message_t));
+  out->id = def->id;
+  out->length = def->dlc;
+  for (int i = 0; i < def->n_signals; i++) {
+    const can_signal_t *signal = &def->signals[i];
+    uint32_t value = can_db_signal_value(data, signal);
+    for (int byte = 0; byte < signal->width; byte++) {
+      int shift = signal->big_endian ? signal->width - 1 - byte : byte;
+      out->buffer[signal->offset + byte] = value >> (8 * shift) & 0xFF;
+    }
+  }
+}
+
+int can_db_decode(const can_message_t *msg, ecu_type_t consumer, ecu_data_t *data) {
+  const can_db_msg_t *def = can_db_lookup(msg->id);
+  if (def == NULL)
+    return -1;
+  if (!(def->consumers & ECU_BIT(consumer)))
+    return -2;
+
+  for (int i = 0; i < def->n_signals; i++) {
+    const can_signal_t *signal = &def->signals[i];
+    uint32_t value = 0;
+    for (int byte = 0; byte < signal->width; byte++) {
+      int shift = signal->big_endian ? signal->width - 1 - byte : byte;
+      value |= (uint32_t)msg->buffer[signal->offset + byte] << (8 * shift);
+    }
+    if (store_field(data, signal, value & signal->mask))
+      ecu_data_mark_dirty(signal->field);
+  }
+  if (def->on_decoded != NULL)
+    def->on_decoded(data);
+  return 0;
+}
+
+bool can_db_signal_valid(const can_signal_t *signal, int value) {
+  if (signal->allowed != NULL)
+    return value != 0 && strchr(signal->allowed, value) != NULL;
+  return value >= signal->min && value <= signal->max;
+}
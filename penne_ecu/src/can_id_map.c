@@ -0,0 +1,63 @@
+#include "can_id_map.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Not a valid key, the RTR and error flags are masked out of every key
+#define KEY_MASK (CAN_EFF_FLAG | CAN_EFF_MASK)
+#define EMPTY_KEY UINT32_MAX
+
+// Keys and indices are separate arrays, so a probe sequence only touches the keys (16 per cache line)
+static uint32_t keys[CAN_ID_MAP_SLOTS];
+static int16_t indices[CAN_ID_MAP_SLOTS];
+static canid_t ids[CAN_ID_MAX_INTERNED];
+static size_t n_ids = 0;
+static bool initialized = false;
+
+void can_id_map_reset() {
+  memset(keys, 0xFF, sizeof(keys));
+  n_ids = 0;
+  initialized = true;
+}
+
+// Fibonacci hashing, the upper bits of the product are the best mixed ones
+static size_t slot_of(uint32_t key) { return (uint32_t)(key * 2654435761u) >> (32 - __builtin_ctz(CAN_ID_MAP_SLOTS)); }
+
+/**
+ * @return the slot that holds the key or the empty slot where it would be inserted
+ */
+static size_t find(uint32_t key) {
+  size_t slot = slot_of(key);
+  // The table is never more than half full, so there always is an empty slot that ends the probe sequence
+  while (keys[slot] != key && keys[slot] != EMPTY_KEY)
+    slot = (slot + 1) & (CAN_ID_MAP_SLOTS - 1);
+  return slot;
+}
+
+int can_id_intern(canid_t id) {
+  if (!initialized)
+    can_id_map_reset();
+  uint32_t key = id & KEY_MASK;
+  size_t slot = find(key);
+  if (keys[slot] == key)
+    return indices[slot];
+  if (n_ids == CAN_ID_MAX_INTERNED)
+    return -1;
+
+  keys[slot] = key;
+  indices[slot] = n_ids;
+  ids[n_ids] = key;
+  return n_ids++;
+}
+
+int can_id_lookup(canid_t id) {
+  if (!initialized)
+    return -1;
+  uint32_t key = id & KEY_MASK;
+  size_t slot = find(key);
+  return keys[slot] == key ? indices[slot] : -1;
+}
+
+canid_t can_id_at(int index) { return ids[index]; }
+
+size_t can_id_count() { return n_ids; }
@@ -2,41 +2,134 @@
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
 
 // In the default case we do not want to use encryption, so we set the key to NULL and the flag to false
 unsigned char *encryption_key = NULL;
 bool using_encryption = false;
 
+_Thread_local crypto_session_t *crypto_session = NULL;
+
+// The counter is shared by all threads of the ECU, it starts at 1 so that 0 never appears in an IV
+static _Atomic uint64_t nonce_counter = 1;
+static uint8_t nonce_sender_id = 0;
+
+// Random bytes for the IVs, every thread has its own pool so no locking is needed
+static _Thread_local unsigned char random_pool[CRYPTO_RANDOM_POOL_SIZE];
+static _Thread_local size_t random_pool_pos = CRYPTO_RANDOM_POOL_SIZE;
+
 void handleErrors(void) {
   ERR_print_errors_fp(stderr);
   abort();
 }
 
-int gcm_encrypt(unsigned char *plaintext, int plaintext_len, unsigned char *aad, int aad_len, unsigned char *key, unsigned char *iv, int iv_len,
-                unsigned char *ciphertext, unsigned char *tag) {
-  EVP_CIPHER_CTX *ctx;
+static uint64_t realtime_us() {
+  struct timespec spec;
+  clock_gettime(CLOCK_REALTIME, &spec);
+  return (uint64_t)spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
 
-  int len;
+void crypto_nonce_init(uint8_t sender_id) {
+  nonce_sender_id = sender_id;
+  atomic_store(&nonce_counter, realtime_us());
+}
 
-  int ciphertext_len;
+uint8_t crypto_nonce_sender_id() { return nonce_sender_id; }
+
+uint64_t crypto_next_counter() {
+  // The counter is the current time in microseconds, or one more than the last value if frames are sent faster
+  uint64_t now = realtime_us();
+  uint64_t counter = atomic_load_explicit(&nonce_counter, memory_order_relaxed);
+  uint64_t next;
+  do {
+    next = counter + 1 > now ? counter + 1 : now;
+  } while (!atomic_compare_exchange_weak_explicit(&nonce_counter, &counter, next, memory_order_relaxed, memory_order_relaxed));
+  return next;
+}
+
+/**
+ * Copies random bytes from the pool of the calling thread, the pool is refilled when it is empty.
+ * If the kernel can not provide random bytes zeros are used, the IV is still unique because of the counter.
+ */
+static void take_random_bytes(unsigned char *dst, size_t len) {
+  while (len > 0) {
+    if (random_pool_pos == CRYPTO_RANDOM_POOL_SIZE) {
+      if (getrandom(random_pool, CRYPTO_RANDOM_POOL_SIZE, 0) != CRYPTO_RANDOM_POOL_SIZE)
+        memset(random_pool, 0, CRYPTO_RANDOM_POOL_SIZE);
+      random_pool_pos = 0;
+    }
+    size_t n = CRYPTO_RANDOM_POOL_SIZE - random_pool_pos;
+    if (n > len)
+      n = len;
+    memcpy(dst, random_pool + random_pool_pos, n);
+    random_pool_pos += n;
+    dst += n;
+    len -= n;
+  }
+}
+
+uint64_t crypto_next_iv(unsigned char *iv, int iv_len) {
+  uint64_t counter = crypto_next_counter();
+  for (int i = 7; i >= 0; i--)
+    iv[7 - i] = counter >> (8 * i) & 0xFF;
+  iv[8] = nonce_sender_id;
+  if (iv_len > 9)
+    take_random_bytes(iv + 9, iv_len - 9);
+  return counter;
+}
 
-  /* Create and initialise the context */
-  if (!(ctx = EVP_CIPHER_CTX_new()))
+crypto_session_t *crypto_session_new(unsigned char *key, int iv_len) {
+  crypto_session_t *session = malloc(sizeof(crypto_session_t));
+  if (session == NULL)
     handleErrors();
 
-  /* Initialise the encryption operation. */
-  if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL))
+  /* Create the contexts, they are reused for every frame */
+  if (!(session->encrypt_ctx = EVP_CIPHER_CTX_new()))
+    handleErrors();
+  if (!(session->decrypt_ctx = EVP_CIPHER_CTX_new()))
     handleErrors();
 
-  /*
-   * Set IV length if default 12 bytes (96 bits) is not appropriate
-   */
-  if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL))
+  /* Select the cipher and set the IV length if default 12 bytes (96 bits) is not appropriate */
+  if (1 != EVP_EncryptInit_ex(session->encrypt_ctx, EVP_aes_256_gcm(), NULL, NULL, NULL))
+    handleErrors();
+  if (1 != EVP_CIPHER_CTX_ctrl(session->encrypt_ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL))
+    handleErrors();
+  if (1 != EVP_DecryptInit_ex(session->decrypt_ctx, EVP_aes_256_gcm(), NULL, NULL, NULL))
+    handleErrors();
+  if (1 != EVP_CIPHER_CTX_ctrl(session->decrypt_ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL))
     handleErrors();
 
-  /* Initialise key and IV */
-  if (1 != EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv))
+  /* Expand the key once, gcm_encrypt/gcm_decrypt only set the IV */
+  if (1 != EVP_EncryptInit_ex(session->encrypt_ctx, NULL, NULL, key, NULL))
+    handleErrors();
+  if (1 != EVP_DecryptInit_ex(session->decrypt_ctx, NULL, NULL, key, NULL))
+    handleErrors();
+
+  return session;
+}
+
+void crypto_session_free(crypto_session_t *session) {
+  if (session == NULL)
+    return;
+  EVP_CIPHER_CTX_free(session->encrypt_ctx);
+  EVP_CIPHER_CTX_free(session->decrypt_ctx);
+  free(session);
+}
+
+int gcm_encrypt(crypto_session_t *session, unsigned char *plaintext, int plaintext_len, unsigned char *aad, int aad_len, unsigned char *iv,
+                unsigned char *ciphertext, unsigned char *tag, int tag_len) {
+  EVP_CIPHER_CTX *ctx = session->encrypt_ctx;
+
+  int len;
+
+  int ciphertext_len;
+
+  /* Set the IV, the key schedule of the session is kept */
+  if (1 != EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv))
     handleErrors();
 
   /*
@@ -63,36 +156,21 @@ int gcm_encrypt(unsigned char *plaintext, int plaintext_len, unsigned char *aad,
   ciphertext_len += len;
 
   /* Get the tag */
-  if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag))
+  if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_len, tag))
     handleErrors();
 
-  /* Clean up */
-  EVP_CIPHER_CTX_free(ctx);
-
   return ciphertext_len;
 }
 
-int gcm_decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned char *aad, int aad_len, unsigned char *tag, unsigned char *key, unsigned char *iv,
-                int iv_len, unsigned char *plaintext) {
-  EVP_CIPHER_CTX *ctx;
+int gcm_decrypt(crypto_session_t *session, unsigned char *ciphertext, int ciphertext_len, unsigned char *aad, int aad_len, unsigned char *tag,
+                int tag_len, unsigned char *iv, unsigned char *plaintext) {
+  EVP_CIPHER_CTX *ctx = session->decrypt_ctx;
   int len;
   int plaintext_len;
   int ret;
 
-  /* Create and initialise the context */
-  if (!(ctx = EVP_CIPHER_CTX_new()))
-    handleErrors();
-
-  /* Initialise the decryption operation. */
-  if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL))
-    handleErrors();
-
-  /* Set IV length. Not necessary if this is 12 bytes (96 bits) */
-  if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL))
-    handleErrors();
-
-  /* Initialise key and IV */
-  if (!EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv))
+  /* Set the IV, the key schedule of the session is kept */
+  if (!EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv))
     handleErrors();
 
   /*
@@ -111,7 +189,7 @@ int gcm_decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned char *aa
   plaintext_len = len;
 
   /* Set expected tag value. Works in OpenSSL 1.0.1d and later */
-  if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, tag))
+  if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag_len, tag))
     handleErrors();
 
   /*
@@ -120,9 +198,6 @@ int gcm_decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned char *aa
    */
   ret = EVP_DecryptFinal_ex(ctx, plaintext + len, &len);
 
-  /* Clean up */
-  EVP_CIPHER_CTX_free(ctx);
-
   if (ret > 0) {
     /* Success */
     plaintext_len += len;
@@ -1,19 +1,30 @@
 #include "ecu.h"
 #include "can.h"
+#include "can_db.h"
+#include "gateway.h"
+#include "gui_protocol.h"
+#include "gui_reporter.h"
 #include "helpers.h"
+#include "payload_detector.h"
+#include "reactor.h"
+#include "shm_export.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
 
 ecu_type_t ecu_number;
-ecu_data_t ecu_data, ecu_data_old;
+ecu_data_t ecu_data;
+uint64_t ecu_data_dirty[ECU_DATA_DIRTY_WORDS];
 
-pthread_mutex_t gateway_lock;
+long last_simulation = 0;
+long last_rx_stats_print = 0;
 
-size_t ticks_till_next_simulation = 0;
-
-// Global flag to send the entire ecu_data if there were no updates for a certain time
-bool send_all_ecu_data_to_gui = false;
+// timerfd that wakes the main loop when the next cyclic CAN message or GUI update is due
+int wakeup_timer_fd = -1;
 
 unsigned long last_serial_msg = 0; // PT: CH: BO: Used to check last msg time
 void timer_handler(int sig, siginfo_t *si, void *uc) {
@@ -32,477 +43,372 @@ void timer_handler(int sig, siginfo_t *si, void *uc) {
     }
 }
 
-void ecu_setup() {
-    // Here we define the cyclic CAN messages that the ECU sends
+/**
+ * Reactor handler for the vcan0 socket, handles all frames that are waiting on the bus
+ */
+static void on_can_readable(int fd, uint32_t events) {
+    (void) fd;
+    (void) events;
+    read_can_bus_and_handle_input();
+}
+
+/**
+ * Reactor handler for the eventfd of the gateway, shows the latest forwarding result in the GUI
+ */
+static void on_gateway_events(int fd, uint32_t events) {
+    (void) fd;
+    (void) events;
+    gateway_drain_events();
+}
+
+/**
+ * Reactor handler for the serial port of the chassis ECU, reads the commands that the GUI sent
+ */
+static void on_serial_readable(int fd, uint32_t events) {
+    if (read_chassis_ecu_data() <= 0 && (events & (EPOLLHUP | EPOLLERR))) {
+        // The GUI closed its end of the pty, stop waiting on it so we don't wake up in a loop
+        printf("Serial port was closed by the GUI\n");
+        reactor_remove(fd);
+    }
+}
+
+/**
+ * Reactor handler for the wakeup timer, sends all cyclic CAN messages that are due
+ */
+static void on_timer_expired(int fd, uint32_t events) {
+    (void) events;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("Failed to read wakeup timer");
+    }
+    send_pending_can_messages();
+}
+
+int ecu_setup() {
+    // The cyclic CAN messages that the ECU sends are the messages of the signal database with this ECU as sender
+    can_db_init();
+    for (size_t i = 0; i < can_db_message_count; i++) {
+        if (can_db_messages[i].sender == ecu_number) {
+            define_rep_msg(can_db_messages[i].id, can_db_messages[i].dlc, 1, can_db_messages[i].period);
+        }
+    }
     switch (ecu_number) {
         case POWERTRAIN:
-            // 100 Hz
-            define_rep_msg(BRAKE_OUTPUT_IND_MSG, 64, 1, 10);
-            define_rep_msg(ENGINE_RPM_MSG, 64, 1, 10);
-            define_rep_msg(POWER_STEERING_OUT_IND_MSG, 64, 1, 10);
-            define_rep_msg(SHIFT_POSITION_MSG, 64, 1, 10);
-            // 20 Hz
-            define_rep_msg(ENGINE_STATUS_MSG, 8, 1, 50);
-            define_rep_msg(PARKING_BRAKE_STATUS_MSG, 8, 1, 50);
-            break;
         case CHASSIS:
-            // 100 Hz
-            define_rep_msg(BRAKE_OPERATION_MSG, 8, 1, 10);
-            define_rep_msg(ACCELERATION_OPERATION_MSG, 8, 1, 10);
-            define_rep_msg(STEERING_WHEEL_POS_MSG, 8, 1, 10);
-            define_rep_msg(SHIFT_POSITION_SWITCH_MSG, 8, 1, 10);
-            define_rep_msg(ENGINE_START_MSG, 8, 1, 10);
-            define_rep_msg(TURN_SWITCH_MSG, 8, 1, 10);
-            define_rep_msg(HORN_SWITCH_MSG, 8, 1, 10);
-            // 20 Hz
-            define_rep_msg(LIGHT_SWITCH_MSG, 8, 1, 50);
-            define_rep_msg(PARKING_BRAKE_MSG, 8, 1, 50);
-            // 10 Hz
-            define_rep_msg(WIPER_SWITCH_FRONT_MSG, 8, 1, 100);
-            define_rep_msg(WIPER_SWITCH_REAR_MSG, 8, 1, 100);
-            define_rep_msg(DOOR_LOCK_UNLOCK_MSG, 8, 1, 100);
-            define_rep_msg(L_WINDOW_SWITCH_MSG, 8, 1, 100);
-            define_rep_msg(R_WINDOW_SWITCH_MSG, 8, 1, 100);
-            define_rep_msg(L_DOOR_HANDLE_MSG, 8, 1, 100);
-            define_rep_msg(R_DOOR_HANDLE_MSG, 8, 1, 100);
-            break;
-        case BODY:
-            // 100 Hz
-            define_rep_msg(TURN_SIGNAL_INDICATOR_MSG, 8, 1, 10);
-            // 20 Hz
-            // 10 Hz
-            define_rep_msg(DOOR_LOCK_STATUS_MSG, 8, 1, 100);
-            // 2 Hz
-            define_rep_msg(L_DOOR_POSITION_MSG, 8, 1, 500);
-            define_rep_msg(R_DOOR_POSITION_MSG, 8, 1, 500);
+        case BODY: {
+            // The kernel drops every frame that the handler of this ECU would ignore anyway. The observer and the
+            // gateway keep the full feed of the bus, they have to see unknown IDs as well
+            unsigned int consumed_ids[MAX_MSGS];
+            size_t n_ids = can_db_consumed_ids(ecu_number, consumed_ids, MAX_MSGS);
+            if (set_can_receive_filter(vcan0_tx_socket, consumed_ids, n_ids) != 0) {
+                return -5;
+            }
             break;
+        }
         case OBSERVER:
-            // The OBSERVER ECU sends no CAN messages but it reads the bus and checks the timings,
-            // therefore we save the reference time intervalls for all messages
+            // The OBSERVER ECU sends no CAN messages but it reads the bus and checks the timings and the payloads,
+            // therefore we set up both detectors
             setup_observer_reference_timings();
+            payload_detector_init();
             break;
         case GATEWAY:
-            // Here we define which CAN messages the gateway allows the OBD-II port to read and write
-            setup_gateway_whitelist();
-
+            // Here we define which CAN messages the gateway allows the OBD-II port to read and write, a policy file
+            // replaces the built-in whitelist
+            if (gateway_load_policy() != 0) {
+                return -7;
+            }
             break;
     }
 
-    // Setup Timers
-    // The gateway and the observer ECU do not send any CAN messages on regular timings
-    if (ecu_number != GATEWAY && ecu_number != OBSERVER) {
-        make_timer(&timer_100_hz, 10, 10);
-        make_timer(&timer_20_hz, 50, 50);
-        if (ecu_number != POWERTRAIN)
-            make_timer(&timer_10_hz, 100, 100);
-        if (ecu_number == BODY)
-            make_timer(&timer_2_hz, 500, 500);
+    // Setup the reactor, the main loop sleeps until a CAN frame, a GUI command or the wakeup timer is ready
+    if (reactor_init() != 0) {
+        return -1;
+    }
+    if (ecu_number == GATEWAY) {
+        // Both directions are forwarded by their own threads, the main thread only reports their events to the GUI
+        if (gateway_start() != 0 || reactor_add(gateway_event_fd, on_gateway_events) != 0) {
+            return -6;
+        }
+    } else {
+        // The socket is drained in read_can_bus_and_handle_input(), so it must not block once it is empty
+        if (fcntl(vcan0_tx_socket, F_SETFL, fcntl(vcan0_tx_socket, F_GETFL) | O_NONBLOCK) != 0) {
+            perror("Failed to make CAN socket non-blocking");
+            return -2;
+        }
+        if (reactor_add(vcan0_tx_socket, on_can_readable) != 0) {
+            return -3;
+        }
+    }
+    // The Chassis ECU is the only ECU that reads updates from the GUI, with shared memory they are polled in loop()
+    if (ecu_number == CHASSIS && gui_transport == GUI_TRANSPORT_SERIAL && reactor_add(serial_port, on_serial_readable) != 0) {
+        return -3;
+    }
+    wakeup_timer_fd = make_timerfd();
+    if (wakeup_timer_fd < 0 || reactor_add(wakeup_timer_fd, on_timer_expired) != 0) {
+        return -4;
+    }
+    // All messages to the GUI are written by the reporter thread, so they never delay the CAN handling of the main loop
+    if (gui_reporter_start() != 0) {
+        return -8;
+    }
+    return 0;
+}
+
+long next_wakeup_time() {
+    // We have to wake up at least for the periodic full update of the GUI
+    long next_wakeup = (long) (last_serial_msg + GUI_FULL_UPDATE_INTERVAL + 1) * 1000;
+    long next_can_message = next_can_message_due();
+
+    if (next_can_message != 0 && next_can_message < next_wakeup) {
+        next_wakeup = next_can_message;
     }
+    return next_wakeup;
 }
 
 void check_message_timers() {
-    long check_time = millis();
-    if (check_time - last_serial_msg > 100) {
-        send_all_ecu_data_to_gui = true;
+    long check_time = monotonic_micros() / 1000;
+    if (check_time - last_serial_msg > GUI_FULL_UPDATE_INTERVAL) {
+        ecu_data_mark_all_dirty();
+    }
+}
+
+/**
+ * A field of ecu_data that the GUI shows, with the field ID of the GUI protocol
+ */
+typedef struct gui_field_t {
+    uint8_t id;
+    size_t field; // offsetof(ecu_data_t, <field>)
+    can_field_type_t type;
+} gui_field_t;
+
+#define GUI_FIELD(id, field) {id, offsetof(ecu_data_t, field), CAN_FIELD_TYPE(field)}
+
+static const gui_field_t powertrain_gui_fields[] = {
+    GUI_FIELD(0x00, shift_position), GUI_FIELD(0x01, engine_status), GUI_FIELD(0x02, brake_output),
+    GUI_FIELD(0x03, parking_brake_status), GUI_FIELD(0x04, gear), GUI_FIELD(0x05, power_steering),
+};
+static const gui_field_t chassis_gui_fields[] = {
+    GUI_FIELD(0x00, engine_rpm), GUI_FIELD(0x01, shift_position), GUI_FIELD(0x02, engine_status),
+    GUI_FIELD(0x03, parking_brake_status), GUI_FIELD(0x04, turn_signal_indicator), GUI_FIELD(0x05, door_open_indicator),
+    GUI_FIELD(0x06, door_lock_indicator), GUI_FIELD(0x07, speed_kph),
+};
+static const gui_field_t body_gui_fields[] = {
+    GUI_FIELD(0x00, horn_operation), GUI_FIELD(0x01, light_status), GUI_FIELD(0x02, turn_signal_indicator),
+    GUI_FIELD(0x03, front_wiper_status), GUI_FIELD(0x04, rear_wiper_status), GUI_FIELD(0x05, door_lock_status),
+    GUI_FIELD(0x06, l_door_position), GUI_FIELD(0x07, r_door_position), GUI_FIELD(0x08, l_window_position),
+    GUI_FIELD(0x09, r_window_position),
+};
+static const gui_field_t gateway_gui_fields[] = {
+    GUI_FIELD(0x00, gateway_id), GUI_FIELD(0x01, gateway_code), GUI_FIELD(0x02, gateway_read_dropped),
+    GUI_FIELD(0x03, gateway_write_dropped),
+};
+static const gui_field_t observer_gui_fields[] = {
+    GUI_FIELD(0x00, observer_id), GUI_FIELD(0x01, observer_code),
+};
+
+#define GUI_FIELDS(fields) (*n_fields = sizeof(fields) / sizeof(fields[0]), fields)
+
+/**
+ * @return the fields that the GUI shows for the ECU type
+ */
+static const gui_field_t *gui_fields_of(ecu_type_t ecu_type, size_t *n_fields) {
+    switch (ecu_type) {
+        case POWERTRAIN:
+            return GUI_FIELDS(powertrain_gui_fields);
+        case CHASSIS:
+            return GUI_FIELDS(chassis_gui_fields);
+        case BODY:
+            return GUI_FIELDS(body_gui_fields);
+        case GATEWAY:
+            return GUI_FIELDS(gateway_gui_fields);
+        case OBSERVER:
+            return GUI_FIELDS(observer_gui_fields);
     }
+    *n_fields = 0;
+    return NULL;
 }
 
+void ecu_data_mark_dirty(size_t field) { ecu_data_dirty[field / 64] |= 1ull << (field % 64); }
+
+void ecu_data_mark_all_dirty() { memset(ecu_data_dirty, 0xFF, sizeof(ecu_data_dirty)); }
+
 void write_powertrain_ecu_data() {
-    ecu_data.parking_brake_status = ecu_data.parking_value;
+    ECU_DATA_SET(parking_brake_status, ecu_data.parking_value);
 
-    ecu_data.shift_position = ecu_data.shift_value;
+    ECU_DATA_SET(shift_position, ecu_data.shift_value);
 
     // Only switch engine on when in Parking position
     if (ecu_data.shift_position == 'P' && ecu_data.engine_value) {
-        ecu_data.engine_status = true;
+        ECU_DATA_SET(engine_status, true);
     }
     if (!ecu_data.engine_value) {
-        ecu_data.engine_status = false;
+        ECU_DATA_SET(engine_status, false);
     }
 
-    // We use a counter (ticks_till_next_simulation) to simulate the RPM and the automatic shifting only every X cycles
-    if (ticks_till_next_simulation == 0) {
-        ticks_till_next_simulation = 20;
+    // The RPM and the automatic shifting are only simulated every SIMULATION_INTERVAL milliseconds
+    long now = millis();
+    if (now - last_simulation >= SIMULATION_INTERVAL) {
+        last_simulation = now;
+
+        // The simulation works on copies, so a field is only marked dirty if its final value changed
+        int engine_rpm = ecu_data.engine_rpm;
+        char gear = ecu_data.gear;
+        int brake_output = ecu_data.brake_output;
+        int speed_kph = ecu_data.speed_kph;
 
         // Gas pedal
         if (ecu_data.accelerator_value > 0 && ecu_data.engine_status &&
             (ecu_data.shift_position == 'D' || ecu_data.shift_position == 'N' ||
              ecu_data.shift_position == 'R')) { // Increase RPM
-            ecu_data.engine_rpm += ecu_data.accelerator_value;
-            if (ecu_data.gear < 6 && ecu_data.engine_rpm > 60000 && ecu_data.shift_position == 'D') { // Shift up
-                ecu_data.gear += 1;
-                ecu_data.engine_rpm = 5000;
+            engine_rpm += ecu_data.accelerator_value;
+            if (gear < 6 && engine_rpm > 60000 && ecu_data.shift_position == 'D') { // Shift up
+                gear += 1;
+                engine_rpm = 5000;
             }
-            if (ecu_data.engine_rpm > 65535)
-                ecu_data.engine_rpm = 65535;
+            if (engine_rpm > 65535)
+                engine_rpm = 65535;
         } else { // Decrease RPM
-            ecu_data.engine_rpm -= 100;
-            if (ecu_data.gear > 1 && ecu_data.engine_rpm < 5000 && ecu_data.shift_position == 'D') { // Shift down
-                ecu_data.gear -= 1;
-                ecu_data.engine_rpm = 50000;
+            engine_rpm -= 100;
+            if (gear > 1 && engine_rpm < 5000 && ecu_data.shift_position == 'D') { // Shift down
+                gear -= 1;
+                engine_rpm = 50000;
             }
-            if (ecu_data.engine_rpm < 0) {
-                ecu_data.engine_rpm = 0;
+            if (engine_rpm < 0) {
+                engine_rpm = 0;
             }
         }
         if (ecu_data.shift_position == 'R') {
-            ecu_data.gear = 1;
+            gear = 1;
         }
 
         // Brake Pedal
         if (ecu_data.brake_value > 0) {
-            ecu_data.brake_output += ecu_data.brake_value;
-            if (ecu_data.brake_output > 65535)
-                ecu_data.brake_output = 65535;
+            brake_output += ecu_data.brake_value;
+            if (brake_output > 65535)
+                brake_output = 65535;
         } else {
-            ecu_data.brake_output = 0;
+            brake_output = 0;
         }
 
         // We scale the rpm and gear to a speed value between 0 and 255
-        int shall_speed = (ecu_data.engine_rpm + (ecu_data.gear - 1) * 65535) / 1542;
+        int shall_speed = (engine_rpm + (gear - 1) * 65535) / 1542;
 
         // Add the influence of the brake to the speed
-        shall_speed -= ecu_data.brake_output * 100 / 65535;
+        shall_speed -= brake_output * 100 / 65535;
         shall_speed -= ecu_data.parking_brake_status * 40;
 
         // This is neccessary to prevent the speed from jumping up after braking, if the gas pedal is not pressed, the speed can not be increased
-        if (ecu_data.accelerator_value == 0 && shall_speed > ecu_data.speed_kph) {
-            shall_speed = ecu_data.speed_kph;
+        if (ecu_data.accelerator_value == 0 && shall_speed > speed_kph) {
+            shall_speed = speed_kph;
         }
 
-        ecu_data.speed_kph += ceil((shall_speed - ecu_data.speed_kph) / 2.0f);
+        if (ecu_data.shift_position == 'P') {
+            // The parking lock stops the car, the speed halves with every step until it reaches 0
+            speed_kph /= 2;
+        } else {
+            speed_kph += ceil((shall_speed - speed_kph) / 2.0f);
+        }
 
-        if (ecu_data.speed_kph < 0) {
-            ecu_data.speed_kph = 0;
+        if (speed_kph < 0) {
+            speed_kph = 0;
         }
-        if (ecu_data.speed_kph > 255) {
-            ecu_data.speed_kph = 255;
+        if (speed_kph > 255) {
+            speed_kph = 255;
         }
+
+        ECU_DATA_SET(engine_rpm, engine_rpm);
+        ECU_DATA_SET(gear, gear);
+        ECU_DATA_SET(brake_output, brake_output);
+        ECU_DATA_SET(speed_kph, speed_kph);
     }
-    ticks_till_next_simulation -= 1;
 
     // Transform the steering wheel angle (from 0° to 720°, 360° is center) to the actual tire angle (-30° to +30° with an offset of 360°)
-    ecu_data.power_steering = (ecu_data.steering_value - 360) * 30 / 360 + 360;
+    ECU_DATA_SET(power_steering, (ecu_data.steering_value - 360) * 30 / 360 + 360);
 
     write_ecu_data_to_serial();
 }
 
 void write_chassis_ecu_data() {
-    ecu_data.door_open_indicator = ecu_data.l_door_position | ecu_data.r_door_position;
-    ecu_data.door_lock_indicator = ecu_data.door_lock_status;
+    ECU_DATA_SET(door_open_indicator, ecu_data.l_door_position | ecu_data.r_door_position);
+    ECU_DATA_SET(door_lock_indicator, ecu_data.door_lock_status);
     write_ecu_data_to_serial();
 }
 
 void write_body_ecu_data() {
     if (ecu_data.hazard_value)
-        ecu_data.turn_signal_indicator = 3;
+        ECU_DATA_SET(turn_signal_indicator, 3);
     else
-        ecu_data.turn_signal_indicator = ecu_data.turn_switch_value;
+        ECU_DATA_SET(turn_signal_indicator, ecu_data.turn_switch_value);
 
-    ecu_data.front_wiper_status = ecu_data.wiper_f_sw_value;
-    ecu_data.rear_wiper_status = ecu_data.wiper_r_sw_value;
-    if (ecu_data.light_flash_value)
-        ecu_data.light_status = 2;
-    else
-        ecu_data.light_status = ecu_data.light_switch_value;
-    ecu_data.horn_operation = ecu_data.horn_value;
-    ecu_data.light_status = ecu_data.light_switch_value;
+    ECU_DATA_SET(front_wiper_status, ecu_data.wiper_f_sw_value);
+    ECU_DATA_SET(rear_wiper_status, ecu_data.wiper_r_sw_value);
+    // Set once with the final value, so the field is only marked dirty if it really changed
+    ECU_DATA_SET(light_status, ecu_data.light_flash_value ? 2 : ecu_data.light_switch_value);
+    ECU_DATA_SET(horn_operation, ecu_data.horn_value);
 
     if (ecu_data.l_door_handle_value == 2)                                        // Door close button
-        ecu_data.l_door_position = 0;                                               // 0 => Door is closed
+        ECU_DATA_SET(l_door_position, 0);                                           // 0 => Door is closed
     else if (ecu_data.l_door_handle_value == 1 && ecu_data.door_lock_status == 0) // Door open button
-        ecu_data.l_door_position = 1;                                               // 1 => Door is open
+        ECU_DATA_SET(l_door_position, 1);                                           // 1 => Door is open
     if (ecu_data.r_door_handle_value == 2)                                        // Door close button
-        ecu_data.r_door_position = 0;                                               // 0 => Door is closed
+        ECU_DATA_SET(r_door_position, 0);                                           // 0 => Door is closed
     else if (ecu_data.r_door_handle_value == 1 && ecu_data.door_lock_status == 0) // Door open button
-        ecu_data.r_door_position = 1;                                               // 1 => Door is open
+        ECU_DATA_SET(r_door_position, 1);                                           // 1 => Door is open
 
     if (ecu_data.l_window_switch_value == 1)      // Window Up button
-        ecu_data.l_window_position = 0;             // 0 => Window is up/closed
+        ECU_DATA_SET(l_window_position, 0);         // 0 => Window is up/closed
     else if (ecu_data.l_window_switch_value == 2) // Window Down button
-        ecu_data.l_window_position = 1;             // 1 => Window is down/open
+        ECU_DATA_SET(l_window_position, 1);         // 1 => Window is down/open
     if (ecu_data.r_window_switch_value == 1)      // Window Up button
-        ecu_data.r_window_position = 0;             // 0 => Window is up/closed
+        ECU_DATA_SET(r_window_position, 0);         // 0 => Window is up/closed
     else if (ecu_data.r_window_switch_value == 2) // Window Down button
-        ecu_data.r_window_position = 1;             // 1 => Window is down/open
+        ECU_DATA_SET(r_window_position, 1);         // 1 => Window is down/open
 
     // Only lock the doors if it is unlocked, the lock button is pressed and all doors are closed
     if (ecu_data.door_lock_value == 1 && ecu_data.door_lock_status != 1 && ecu_data.l_door_position == 0 &&
         ecu_data.r_door_position == 0) {
-        ecu_data.door_lock_status = 1;
+        ECU_DATA_SET(door_lock_status, 1);
     }
     // Unlock the doors whenever the unlock button is pressed
     if (ecu_data.door_lock_value == 2) {
-        ecu_data.door_lock_status = 0;
+        ECU_DATA_SET(door_lock_status, 0);
     }
 
     write_ecu_data_to_serial();
 }
 
 void write_observer_ecu_data() {
-
-    // Look for not allowed values in ecu_data
-    if (ecu_data.accelerator_value < 0 || ecu_data.accelerator_value > 100) {
-        ecu_data.observer_id = ACCELERATOR_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.brake_output < 0 || ecu_data.brake_output > 65535) {
-        ecu_data.observer_id = BRAKE_OUTPUT;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.brake_value < 0 || ecu_data.brake_value > 100) {
-        ecu_data.observer_id = BRAKE_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.door_lock_indicator < 0 || ecu_data.door_lock_indicator > 1) {
-        ecu_data.observer_id = DOOR_LOCK_INDICATOR;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.door_lock_status < 0 || ecu_data.door_lock_status > 1) {
-        ecu_data.observer_id = DOOR_LOCK_STATUS;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.door_open_indicator < 0 || ecu_data.door_open_indicator > 1) {
-        ecu_data.observer_id = DOOR_OPEN_INDICATOR;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.engine_rpm < 0 || ecu_data.engine_rpm > 65535) {
-        ecu_data.observer_id = ENGINE_RPM;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.engine_status < 0 || ecu_data.engine_status > 1) {
-        ecu_data.observer_id = ENGINE_STATUS;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.engine_value < 0 || ecu_data.engine_value > 1) {
-        ecu_data.observer_id = ENGINE_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.front_wiper_status < 0 || ecu_data.front_wiper_status > 1) {
-        ecu_data.observer_id = FRONT_WIPER_STATUS;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.gear < 0 || ecu_data.gear > 6) {
-        ecu_data.observer_id = GEAR;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.hazard_value < 0 || ecu_data.hazard_value > 1) {
-        ecu_data.observer_id = HAZARD_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.horn_operation < 0 || ecu_data.horn_operation > 1) {
-        ecu_data.observer_id = HORN_OPERATION;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.horn_value < 0 || ecu_data.horn_value > 1) {
-        ecu_data.observer_id = HORN_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.l_door_handle_value < 0 || ecu_data.l_door_handle_value > 2) {
-        ecu_data.observer_id = L_DOOR_HANDLE_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.l_door_position < 0 || ecu_data.l_door_position > 1) {
-        ecu_data.observer_id = L_DOOR_POSITION;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.l_window_position < 0 || ecu_data.l_window_position > 1) {
-        ecu_data.observer_id = L_WINDOW_POSITION;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.l_window_switch_value < 0 || ecu_data.l_window_switch_value > 2) {
-        ecu_data.observer_id = L_WINDOW_SWITCH_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.light_flash_value < 0 || ecu_data.light_flash_value > 1) {
-        ecu_data.observer_id = LIGHT_FLASH_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.light_status < 0 || ecu_data.light_status > 2) {
-        ecu_data.observer_id = LIGHT_STATUS;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.light_switch_value < 0 || ecu_data.light_switch_value > 2) {
-        ecu_data.observer_id = LIGHT_SWITCH_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.parking_brake_status < 0 || ecu_data.parking_brake_status > 1) {
-        ecu_data.observer_id = PARKING_BRAKE_STATUS;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.parking_value < 0 || ecu_data.parking_value > 1) {
-        ecu_data.observer_id = PARKING_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.power_steering < 330 || ecu_data.power_steering > 390) {
-        ecu_data.observer_id = POWER_STEERING;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.r_door_handle_value < 0 || ecu_data.r_door_handle_value > 1) {
-        ecu_data.observer_id = R_DOOR_HANDLE_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.r_door_position < 0 || ecu_data.r_door_position > 2) {
-        ecu_data.observer_id = R_DOOR_POSITION;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.r_window_position < 0 || ecu_data.r_window_position > 1) {
-        ecu_data.observer_id = R_WINDOW_POSITION;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.r_window_switch_value < 0 || ecu_data.r_window_switch_value > 2) {
-        ecu_data.observer_id = R_WINDOW_SWITCH_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.rear_wiper_status < 0 || ecu_data.rear_wiper_status > 1) {
-        ecu_data.observer_id = REAR_WIPER_STATUS;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.shift_position != 'P' && ecu_data.shift_position != 'N' && ecu_data.shift_position != 'R' &&
-               ecu_data.shift_position != 'D') {
-        ecu_data.observer_id = ecu_data.shift_position;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.shift_value != 'P' && ecu_data.shift_value != 'N' && ecu_data.shift_value != 'R' &&
-               ecu_data.shift_value != 'D') {
-        ecu_data.observer_id = SHIFT_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.speed_kph < 0 || ecu_data.speed_kph > 255) {
-        ecu_data.observer_id = SPEED_KPH;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.steering_value < 0 || ecu_data.steering_value > 720) {
-        ecu_data.observer_id = STEERING_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.turn_signal_indicator < 0 || ecu_data.turn_signal_indicator > 3) {
-        ecu_data.observer_id = TURN_SIGNAL_INDICATOR;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.turn_switch_value < 0 || ecu_data.turn_switch_value > 3) {
-        ecu_data.observer_id = TURN_SWITCH_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.wiper_f_sw_value < 0 || ecu_data.wiper_f_sw_value > 1) {
-        ecu_data.observer_id = WIPER_F_SW_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    } else if (ecu_data.wiper_r_sw_value < 0 || ecu_data.wiper_r_sw_value > 1) {
-        ecu_data.observer_id = WIPER_R_SW_VALUE;
-        ecu_data.observer_code = BAD_VALUE;
-    }
+    // The detections were already written to ecu_data by observer_handle_can_msg(), the events are flushed by the reporter
     write_ecu_data_to_serial();
 }
 
 void write_gateway_ecu_data() { write_ecu_data_to_serial(); }
 
 void write_ecu_data_to_serial() {
-    char msg[256] = {0};
-    char cat[256] = {0};
-    strcpy(msg, "EXU");
-    switch (ecu_number) {
-        case POWERTRAIN:
-            if (ecu_data_old.shift_position != ecu_data.shift_position || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 00%x", ecu_data.shift_position);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.engine_status != ecu_data.engine_status || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 01%x", ecu_data.engine_status);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.brake_output != ecu_data.brake_output || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 02%x", ecu_data.brake_output);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.parking_brake_status != ecu_data.parking_brake_status ||
-                send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 03%x", ecu_data.parking_brake_status);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.gear != ecu_data.gear || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 04%x", ecu_data.gear);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.power_steering != ecu_data.power_steering || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 05%x", ecu_data.power_steering);
-                strcat(msg, cat);
-            }
-            break;
-
-        case CHASSIS:
-            if (ecu_data_old.engine_rpm != ecu_data.engine_rpm || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 00%x", ecu_data.engine_rpm);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.shift_position != ecu_data.shift_position || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 01%x", ecu_data.shift_position);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.engine_status != ecu_data.engine_status || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 02%x", ecu_data.engine_status);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.parking_brake_status != ecu_data.parking_brake_status ||
-                send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 03%x", ecu_data.parking_brake_status);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.turn_signal_indicator != ecu_data.turn_signal_indicator ||
-                send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 04%x", ecu_data.turn_signal_indicator);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.door_open_indicator != ecu_data.door_open_indicator || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 05%x", ecu_data.door_open_indicator);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.door_lock_indicator != ecu_data.door_lock_indicator || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 06%x", ecu_data.door_lock_indicator);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.speed_kph != ecu_data.speed_kph || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 07%x", ecu_data.speed_kph);
-                strcat(msg, cat);
-            }
-            break;
-        case BODY:
-            if (ecu_data_old.horn_operation != ecu_data.horn_operation || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 00%x", ecu_data.horn_operation);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.light_status != ecu_data.light_status || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 01%x", ecu_data.light_status);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.turn_signal_indicator != ecu_data.turn_signal_indicator ||
-                send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 02%x", ecu_data.turn_signal_indicator);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.wiper_f_sw_value != ecu_data.wiper_f_sw_value || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 03%x", ecu_data.front_wiper_status);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.wiper_r_sw_value != ecu_data.wiper_r_sw_value || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 04%x", ecu_data.rear_wiper_status);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.door_lock_value != ecu_data.door_lock_value || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 05%x", ecu_data.door_lock_status);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.l_door_position != ecu_data.l_door_position || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 06%x", ecu_data.l_door_position);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.r_door_position != ecu_data.r_door_position || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 07%x", ecu_data.r_door_position);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.l_window_position != ecu_data.l_window_position || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 08%x", ecu_data.l_window_position);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.r_window_position != ecu_data.r_window_position || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 09%x", ecu_data.r_window_position);
-                strcat(msg, cat);
-            }
-            break;
-        case GATEWAY:
-            if (ecu_data_old.gateway_id != ecu_data.gateway_id || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 00%x", ecu_data.gateway_id);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.gateway_code != ecu_data.gateway_code || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 01%x", ecu_data.gateway_code);
-                strcat(msg, cat);
-            }
-            break;
-        case OBSERVER:
-            if (ecu_data_old.observer_id != ecu_data.observer_id || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 00%x", ecu_data.observer_id);
-                strcat(msg, cat);
-            }
-            if (ecu_data_old.observer_code != ecu_data.observer_code || send_all_ecu_data_to_gui == true) {
-                sprintf(cat, " 01%x", ecu_data.observer_code);
-                strcat(msg, cat);
-            }
-            break;
-        default:
-            break;
+    size_t n_fields;
+    const gui_field_t *fields = gui_fields_of(ecu_number, &n_fields);
+    bool dirty = false;
+    for (size_t i = 0; i < ECU_DATA_DIRTY_WORDS; i++) {
+        dirty |= ecu_data_dirty[i] != 0;
     }
-    if (strlen(msg) > 3) {
-        strcat(msg, "\n");
-        if (write(serial_port, msg, strlen(msg)) <= 0) {
-            perror("Failed to write to serial");
+    if (!dirty) {
+        return;
+    }
+
+    // The dirty fields are handed to the reporter thread, which coalesces them and sends them at its own rate
+    uint8_t ids[GUI_REPORTER_MAX_FIELDS];
+    uint32_t values[GUI_REPORTER_MAX_FIELDS];
+    size_t n_dirty = 0;
+    for (size_t i = 0; i < n_fields; i++) {
+        if (ecu_data_dirty[fields[i].field / 64] & (1ull << (fields[i].field % 64))) {
+            ids[n_dirty] = fields[i].id;
+            values[n_dirty++] = can_db_field_value(&ecu_data, fields[i].field, fields[i].type);
         }
-        last_serial_msg = millis();
-        send_all_ecu_data_to_gui = false;
+    }
+    memset(ecu_data_dirty, 0, sizeof(ecu_data_dirty));
+    if (n_dirty > 0) {
+        gui_reporter_post(ids, values, n_dirty);
+        last_serial_msg = monotonic_micros() / 1000;
     }
 }
 
@@ -511,58 +417,58 @@ void set_ecu_id_to_value(int id, int value) {
     if (ecu_number == CHASSIS) {
         switch (id) {
             case 0x00:
-                ecu_data.brake_value = value;
+                ECU_DATA_SET(brake_value, value);
                 break; // C Brake operation amount
             case 0x01:
-                ecu_data.accelerator_value = value;
+                ECU_DATA_SET(accelerator_value, value);
                 break; // C Accelerator operation amount
             case 0x02:
-                ecu_data.steering_value = value;
+                ECU_DATA_SET(steering_value, value);
                 break; // C Handle operation position
             case 0x03:
-                ecu_data.shift_value = value;
+                ECU_DATA_SET(shift_value, value);
                 break; // C Shift position switch
             case 0x04:
-                ecu_data.turn_switch_value = value;
+                ECU_DATA_SET(turn_switch_value, value);
                 break; // C Blinker left / right
             case 0x05:
-                ecu_data.horn_value = value;
+                ECU_DATA_SET(horn_value, value);
                 break; // C Horn switch
             case 0x06:
-                ecu_data.light_switch_value = value;
+                ECU_DATA_SET(light_switch_value, value);
                 break; // C Position headlight high beam switch
             case 0x07:
-                ecu_data.light_flash_value = value;
+                ECU_DATA_SET(light_flash_value, value);
                 break; // C Passing switch
             case 0x08:
-                ecu_data.parking_value = value;
+                ECU_DATA_SET(parking_value, value);
                 break;
             case 0x09:
-                ecu_data.wiper_f_sw_value = value;
+                ECU_DATA_SET(wiper_f_sw_value, value);
                 break;
             case 0x0A:
-                ecu_data.wiper_r_sw_value = value;
+                ECU_DATA_SET(wiper_r_sw_value, value);
                 break;
             case 0x0B:
-                ecu_data.door_lock_value = value;
+                ECU_DATA_SET(door_lock_value, value);
                 break;
             case 0x0C:
-                ecu_data.l_door_handle_value = value;
+                ECU_DATA_SET(l_door_handle_value, value);
                 break;
             case 0x0D:
-                ecu_data.r_door_handle_value = value;
+                ECU_DATA_SET(r_door_handle_value, value);
                 break;
             case 0x0E:
-                ecu_data.l_window_switch_value = value;
+                ECU_DATA_SET(l_window_switch_value, value);
                 break;
             case 0x0F:
-                ecu_data.r_window_switch_value = value;
+                ECU_DATA_SET(r_window_switch_value, value);
                 break;
             case 0x10:
-                ecu_data.hazard_value = value;
+                ECU_DATA_SET(hazard_value, value);
                 break;
             case 0x11:
-                ecu_data.engine_value = value;
+                ECU_DATA_SET(engine_value, value);
                 break;
             default:
                 printf("Error: Bad ID: 0x%x\n", id);
@@ -577,7 +483,7 @@ void update_ecu_data_serial() {
             break;
         case CHASSIS:
             // The Chassis ECU is the only ECU that reads updates from the GUI, all the buttons, steeringwheel, pedals etc. belong to the chassis
-            read_chassis_ecu_data();
+            // The commands are read by the reactor as soon as the GUI sent them, see on_serial_readable()
             write_chassis_ecu_data();
             break;
         case BODY:
@@ -596,27 +502,23 @@ void update_ecu_data_serial() {
 
 
 int loop() {
+    // Sleep until the next cyclic CAN message is due, unless a CAN frame or a GUI command arrives earlier
+    set_timerfd_deadline(wakeup_timer_fd, next_wakeup_time());
+    if (reactor_wait(-1) < 0) {
+        return -1;
+    }
+
+    if (ecu_number == CHASSIS && gui_transport == GUI_TRANSPORT_SHM) {
+        // Every wakeup is at most one period of the fastest cyclic CAN message apart, that is soon enough for the GUI
+        shm_export_poll_commands(set_ecu_id_to_value);
+    }
     check_message_timers();
     update_ecu_data_serial();
-    read_can_bus_and_handle_input();
-    ecu_data_old = ecu_data;
 
-    // Optimization to reduce delays of the CAN messages, as the timer based solution produced some delays
-    send_pending_can_messages();
-    /*
-    if (b_100_hz) {
-        can_write_100_hz_msgs();
-    }
-    if (b_20_hz) {
-        can_write_20_hz_msgs();
-    }
-    if (b_10_hz) {
-        can_write_10_hz_msgs();
-    }
-    if (b_2_hz) {
-        can_write_2_hz_msgs();
+    // The gateway threads log the statistics of their buses themselves
+    if (ecu_number != GATEWAY && millis() - last_rx_stats_print >= CAN_RX_STATS_INTERVAL) {
+        last_rx_stats_print = millis();
+        print_can_rx_stats("vcan0");
     }
-     */
-    usleep(10);
     return 0;
 }
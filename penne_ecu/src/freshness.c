@@ -0,0 +1,45 @@
+#include "freshness.h"
+
+// One window per sender and thread, about 70 KiB per thread
+static _Thread_local freshness_window_t windows[FRESHNESS_MAX_SENDERS];
+static _Thread_local unsigned long rejected = 0;
+
+int freshness_check(uint8_t sender, uint64_t counter) {
+  freshness_window_t *window = &windows[sender];
+  if (!window->valid || counter > window->highest)
+    return 0;
+
+  // A late frame, only the rare out of order frames pay for the scan of the history
+  bool fresh = window->highest - counter < FRESHNESS_WINDOW_US &&
+               (window->n_history < FRESHNESS_HISTORY || counter > window->history[window->lowest]);
+  for (int i = 0; fresh && i < window->n_history; i++)
+    fresh = window->history[i] != counter;
+  if (!fresh) {
+    rejected++;
+    return -1;
+  }
+  return 0;
+}
+
+void freshness_accept(uint8_t sender, uint64_t counter) {
+  freshness_window_t *window = &windows[sender];
+  if (!window->valid || counter > window->highest)
+    window->highest = counter;
+  window->valid = true;
+
+  // The new counter replaces the lowest one of a full history, freshness_check(...) made sure that it is higher
+  if (window->n_history < FRESHNESS_HISTORY) {
+    window->history[window->n_history++] = counter;
+  } else {
+    window->history[window->lowest] = counter;
+  }
+  window->lowest = 0;
+  for (int i = 1; i < window->n_history; i++) {
+    if (window->history[i] < window->history[window->lowest])
+      window->lowest = i;
+  }
+}
+
+bool freshness_known(uint8_t sender) { return windows[sender].valid; }
+
+unsigned long freshness_rejected_count() { return rejected; }
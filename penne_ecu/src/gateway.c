@@ -0,0 +1,280 @@
+#include "gateway.h"
+#include "can_db.h"
+#include "crypto.h"
+#include "ecu.h"
+#include "gateway_policy.h"
+#include "helpers.h"
+#include <errno.h>
+#include <linux/can.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Built-in whitelist of the IDs that the OBD-II port may read, used if no policy file is given.
+// BRAKE_OUTPUT_IND_MSG is not readable, nothing may be written
+static const canid_t gateway_read_whitelist[] = {
+    ENGINE_RPM_MSG, POWER_STEERING_OUT_IND_MSG, SHIFT_POSITION_MSG, BRAKE_OPERATION_MSG, ACCELERATION_OPERATION_MSG,
+    STEERING_WHEEL_POS_MSG, SHIFT_POSITION_SWITCH_MSG, ENGINE_START_MSG, TURN_SWITCH_MSG, HORN_SWITCH_MSG,
+    TURN_SIGNAL_INDICATOR_MSG, ENGINE_STATUS_MSG, PARKING_BRAKE_STATUS_MSG, LIGHT_SWITCH_MSG, PARKING_BRAKE_MSG,
+    WIPER_SWITCH_FRONT_MSG, WIPER_SWITCH_REAR_MSG, DOOR_LOCK_UNLOCK_MSG, L_WINDOW_SWITCH_MSG, R_WINDOW_SWITCH_MSG,
+    L_DOOR_HANDLE_MSG, R_DOOR_HANDLE_MSG, DOOR_LOCK_STATUS_MSG, L_DOOR_POSITION_MSG, R_DOOR_POSITION_MSG};
+
+int gateway_event_fd = -1;
+const char *gateway_policy_path = NULL;
+
+/**
+ * State of one forwarding direction, only the counters and the ring are shared with the main thread
+ */
+typedef struct gateway_direction_t {
+  const char *name;
+  int rx_socket;
+  int tx_socket;
+  gateway_direction_id_t policy_direction;
+  gateway_code_t blocked_code;
+  gateway_code_t rate_limited_code;
+  int core;
+  pthread_t thread;
+  _Atomic unsigned long forwarded;
+  _Atomic unsigned long blocked;
+  _Atomic unsigned long rate_limited;
+  gateway_ring_t ring;
+} gateway_direction_t;
+
+static gateway_direction_t directions[2];
+
+static bool gateway_ring_push(gateway_ring_t *ring, gateway_event_t event) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail == GATEWAY_RING_SIZE) {
+    // The GUI only shows the latest event anyway, the forwarding must never wait for the main thread
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return false;
+  }
+  ring->events[head & (GATEWAY_RING_SIZE - 1)] = event;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+static bool gateway_ring_pop(gateway_ring_t *ring, gateway_event_t *event) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail == head)
+    return false;
+  *event = ring->events[tail & (GATEWAY_RING_SIZE - 1)];
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+static void print_gateway_stats(gateway_direction_t *direction, unsigned long forwarded_since, long interval_ms) {
+  printf("Gateway %s: forwarded %lu (%.0f frames/s), blocked %lu, rate limited %lu, events dropped %lu\n", direction->name,
+         atomic_load_explicit(&direction->forwarded, memory_order_relaxed), forwarded_since * 1000.0 / interval_ms,
+         atomic_load_explicit(&direction->blocked, memory_order_relaxed), atomic_load_explicit(&direction->rate_limited, memory_order_relaxed),
+         atomic_load_explicit(&direction->ring.dropped, memory_order_relaxed));
+  print_can_rx_stats(direction->name);
+}
+
+/**
+ * @return the current local time in minutes since midnight, localtime_r(...) is only called once per second
+ */
+static int minute_of_day() {
+  static _Thread_local time_t last_second = 0;
+  static _Thread_local int minute = 0;
+  time_t now = time(NULL);
+  if (now != last_second) {
+    struct tm local;
+    localtime_r(&now, &local);
+    minute = local.tm_hour * 60 + local.tm_min;
+    last_second = now;
+  }
+  return minute;
+}
+
+/**
+ * Decrypts a copy of a frame for the payload checks of the policy and the vehicle state, the forwarded frame itself stays untouched
+ * @return 0 if the payload in msg is valid, otherwise the result of unpack_can_frame(...)
+ */
+static int inspect_frame(const struct canfd_frame *frame, can_message_t *msg) {
+  struct canfd_frame copy = *frame;
+  return unpack_can_frame(&copy, msg);
+}
+
+/**
+ * Checks one frame against the policy
+ * @return the verdict of the policy
+ */
+static gateway_verdict_t gateway_check_frame(gateway_direction_t *direction, const struct canfd_frame *frame, long now_us, int minute) {
+  can_message_t msg;
+  const unsigned char *payload = NULL;
+  int payload_len = 0;
+  bool is_state = direction->policy_direction == GATEWAY_DIRECTION_READ && can_db_consumes(frame->can_id, GATEWAY);
+
+  bool needs_payload = gateway_policy_needs_payload(direction->policy_direction, frame->can_id);
+
+  // Only the frames whose rule looks at the payload and the frames that carry the vehicle state are decrypted
+  if (is_state || needs_payload) {
+    if (inspect_frame(frame, &msg) == 0) {
+      payload = msg.buffer;
+      payload_len = msg.length;
+      if (is_state) {
+        static _Thread_local ecu_data_t state;
+        if (can_db_decode(&msg, GATEWAY, &state) == 0)
+          atomic_store_explicit(&gateway_state.speed_kph, state.speed_kph, memory_order_relaxed);
+      }
+    } else if (needs_payload) {
+      // A payload that cannot be authenticated cannot be checked
+      return GATEWAY_POLICY_DENY;
+    }
+  }
+  return gateway_policy_check(direction->policy_direction, frame->can_id, payload, payload_len, now_us, minute);
+}
+
+/**
+ * Forwarding thread of one direction: reads a batch of raw frames from one bus, checks them against the policy and writes
+ * the allowed frames to the other bus with a single syscall. The frames are passed through untouched, they are only
+ * decrypted (as a copy) if the policy has to look at their payload, so the receivers verify the tag and the freshness
+ * value of the original sender
+ */
+static void *gateway_forward_loop(void *arg) {
+  gateway_direction_t *direction = arg;
+  struct canfd_frame frames[CAN_RX_BUDGET];
+  struct canfd_frame *allowed[CAN_RX_BUDGET];
+  long last_stats_print = millis();
+  unsigned long forwarded_at_last_print = 0;
+
+  // The key schedule is per thread, the payload checks of the policy decrypt frames in this thread
+  if (using_encryption)
+    crypto_session = crypto_session_new(encryption_key, can_frame_iv_len());
+
+  while (1) {
+    // The socket has a receive timeout, so the thread also wakes up on an idle bus to print the statistics
+    int n_frames = read_can_frames(frames, NULL, CAN_RX_BUDGET, direction->rx_socket);
+    int n_allowed = 0;
+    int n_rate_limited = 0;
+    bool published = false;
+    long now_us = micros();
+    int minute = minute_of_day();
+
+    for (int i = 0; i < n_frames; i++) {
+      canid_t id = frames[i].can_id;
+      gateway_verdict_t verdict = gateway_check_frame(direction, &frames[i], now_us, minute);
+      gateway_event_t event = {.id = id, .code = GATEWAY_OK};
+      if (verdict == GATEWAY_POLICY_ALLOW) {
+        allowed[n_allowed++] = &frames[i];
+      } else if (verdict == GATEWAY_POLICY_RATE_LIMITED) {
+        event.code = direction->rate_limited_code;
+        n_rate_limited++;
+      } else {
+        event.code = direction->blocked_code;
+      }
+      published |= gateway_ring_push(&direction->ring, event);
+    }
+    if (n_allowed > 0)
+      atomic_fetch_add_explicit(&direction->forwarded, write_can_frames(allowed, n_allowed, direction->tx_socket), memory_order_relaxed);
+    if (n_frames > n_allowed + n_rate_limited)
+      atomic_fetch_add_explicit(&direction->blocked, n_frames - n_allowed - n_rate_limited, memory_order_relaxed);
+    if (n_rate_limited > 0)
+      atomic_fetch_add_explicit(&direction->rate_limited, n_rate_limited, memory_order_relaxed);
+
+    // One wakeup of the main thread per batch, not per frame
+    if (published) {
+      uint64_t one = 1;
+      if (write(gateway_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("Failed to signal gateway events");
+    }
+
+    long now = millis();
+    if (now - last_stats_print >= CAN_RX_STATS_INTERVAL) {
+      unsigned long forwarded = atomic_load_explicit(&direction->forwarded, memory_order_relaxed);
+      print_gateway_stats(direction, forwarded - forwarded_at_last_print, now - last_stats_print);
+      forwarded_at_last_print = forwarded;
+      last_stats_print = now;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Pins a thread to a core, core 0 is left to the main thread. Nothing is pinned on a single core machine
+ */
+static void pin_to_core(pthread_t thread, int core) {
+  long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_cores < 2)
+    return;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(core % n_cores, &cpus);
+  if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0)
+    printf("Failed to pin gateway thread to core %ld\n", core % n_cores);
+}
+
+int gateway_start() {
+  gateway_event_fd = eventfd(0, EFD_NONBLOCK);
+  if (gateway_event_fd < 0) {
+    perror("Failed to create gateway eventfd");
+    return -1;
+  }
+
+  directions[0] = (gateway_direction_t){.name = "vcan0->vcan1",
+                                        .rx_socket = vcan0_tx_socket,
+                                        .tx_socket = vcan1_tx_socket,
+                                        .policy_direction = GATEWAY_DIRECTION_READ,
+                                        .blocked_code = GATEWAY_READ_BLOCKED,
+                                        .rate_limited_code = GATEWAY_READ_RATE_LIMITED,
+                                        .core = 1};
+  directions[1] = (gateway_direction_t){.name = "vcan1->vcan0",
+                                        .rx_socket = vcan1_tx_socket,
+                                        .tx_socket = vcan0_tx_socket,
+                                        .policy_direction = GATEWAY_DIRECTION_WRITE,
+                                        .blocked_code = GATEWAY_WRITE_BLOCKED,
+                                        .rate_limited_code = GATEWAY_WRITE_RATE_LIMITED,
+                                        .core = 2};
+
+  for (int i = 0; i < 2; i++) {
+    if (pthread_create(&directions[i].thread, NULL, gateway_forward_loop, &directions[i]) != 0) {
+      perror("Failed to create Gateway thread!\n");
+      return -2;
+    }
+    pin_to_core(directions[i].thread, directions[i].core);
+  }
+  return 0;
+}
+
+int gateway_load_policy() {
+  if (gateway_policy_path == NULL) {
+    gateway_policy_load_whitelist(gateway_read_whitelist, sizeof(gateway_read_whitelist) / sizeof(gateway_read_whitelist[0]), NULL, 0);
+    return 0;
+  }
+  return gateway_policy_load_file(gateway_policy_path) == 0 ? 0 : -1;
+}
+
+int gateway_drain_events() {
+  uint64_t signals;
+  if (read(gateway_event_fd, &signals, sizeof(signals)) < 0 && errno != EAGAIN)
+    perror("Failed to read gateway events");
+
+  // The GUI shows one ID and code at a time, a blocked message is more interesting than the ones that passed
+  int n_events = 0;
+  gateway_event_t latest = {0}, latest_blocked = {.code = GATEWAY_OK};
+  for (int i = 0; i < 2; i++) {
+    gateway_event_t event;
+    while (gateway_ring_pop(&directions[i].ring, &event)) {
+      latest = event;
+      if (event.code != GATEWAY_OK)
+        latest_blocked = event;
+      n_events++;
+    }
+  }
+  if (n_events > 0) {
+    gateway_event_t shown = latest_blocked.code != GATEWAY_OK ? latest_blocked : latest;
+    ECU_DATA_SET(gateway_id, shown.id);
+    ECU_DATA_SET(gateway_code, shown.code);
+  }
+  // The GUI shows the counters modulo 2^32
+  ECU_DATA_SET(gateway_read_dropped, (uint32_t)atomic_load_explicit(&directions[0].rate_limited, memory_order_relaxed));
+  ECU_DATA_SET(gateway_write_dropped, (uint32_t)atomic_load_explicit(&directions[1].rate_limited, memory_order_relaxed));
+  return n_events;
+}
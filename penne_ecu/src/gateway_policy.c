@@ -0,0 +1,473 @@
+#include "gateway_policy.h"
+#include "can_id_map.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+gateway_state_t gateway_state = {0};
+
+/**
+ * Token bucket of one ID, only used by the forwarding thread of its direction
+ */
+typedef struct gateway_bucket_t {
+  double tokens;
+  long last_refill_us; // 0 until the first frame, the bucket starts full
+} gateway_bucket_t;
+
+/**
+ * IDs and directions that a rule covers, only needed while the policy is compiled
+ */
+typedef struct gateway_rule_scope_t {
+  canid_t first;
+  canid_t last;
+  bool read;
+  bool write;
+} gateway_rule_scope_t;
+
+// Rule 0 is the implicit deny rule of every ID that no rule covers
+static gateway_rule_t rules[GATEWAY_MAX_RULES + 1];
+static gateway_rule_scope_t scopes[GATEWAY_MAX_RULES + 1];
+static size_t n_rules = 0;
+
+// Rule of every interned ID (see can_id_map.h), this is the O(1) path for the IDs that the database and the rules name
+static uint16_t rule_of_index[2][CAN_ID_MAX_INTERNED];
+static gateway_bucket_t buckets[2][CAN_ID_MAX_INTERNED];
+
+// Every other ID is looked up in the sorted segments of the ID ranges, segment i covers the IDs from segment_start[i]
+// to segment_start[i + 1] - 1
+#define GATEWAY_MAX_SEGMENTS (2 * GATEWAY_MAX_RULES + 1)
+static canid_t segment_start[2][GATEWAY_MAX_SEGMENTS];
+static uint16_t segment_rule[2][GATEWAY_MAX_SEGMENTS];
+static size_t n_segments[2];
+
+// An ID that only a range rule covers gets its own bucket when its first frame passes the rule. The table of a direction
+// is only used by its forwarding thread, the shared can_id_map.h stays read-only. Once GATEWAY_MAX_RANGE_IDS IDs have a
+// bucket, further IDs share the bucket of their rule
+#define GATEWAY_RANGE_ID_SLOTS (2 * GATEWAY_MAX_RANGE_IDS)
+#define EMPTY_RANGE_KEY UINT32_MAX
+static uint32_t range_keys[2][GATEWAY_RANGE_ID_SLOTS];
+static int16_t range_index[2][GATEWAY_RANGE_ID_SLOTS];
+static gateway_bucket_t range_buckets[2][GATEWAY_MAX_RANGE_IDS];
+static size_t n_range_ids[2];
+static gateway_bucket_t rule_buckets[2][GATEWAY_MAX_RULES + 1];
+
+static gateway_limits_t limits[2];
+static gateway_bucket_t total_buckets[2];
+
+static void reset_policy() {
+  memset(rule_of_index, 0, sizeof(rule_of_index));
+  memset(buckets, 0, sizeof(buckets));
+  memset(rule_buckets, 0, sizeof(rule_buckets));
+  memset(range_keys, 0xFF, sizeof(range_keys));
+  memset(range_buckets, 0, sizeof(range_buckets));
+  n_range_ids[GATEWAY_DIRECTION_READ] = n_range_ids[GATEWAY_DIRECTION_WRITE] = 0;
+  memset(total_buckets, 0, sizeof(total_buckets));
+  for (int i = 0; i < 2; i++) {
+    segment_start[i][0] = 0;
+    segment_rule[i][0] = 0;
+    n_segments[i] = 1;
+  }
+  for (int i = 0; i < 2; i++)
+    limits[i] = (gateway_limits_t){GATEWAY_DEFAULT_ID_RATE, GATEWAY_DEFAULT_ID_BURST, GATEWAY_DEFAULT_TOTAL_RATE, GATEWAY_DEFAULT_TOTAL_BURST};
+  rules[0] = (gateway_rule_t){.allow = false, .max_speed = -1, .time_from = -1, .time_to = -1};
+  n_rules = 0;
+}
+
+/**
+ * Parses "HH:MM" into the minute of the day
+ * @return the minute of the day or -1 if the string is no valid time
+ */
+static int parse_time_of_day(const char *str, const char **end) {
+  unsigned int hours, minutes;
+  int consumed;
+  if (sscanf(str, "%2u:%2u%n", &hours, &minutes, &consumed) != 2 || hours > 23 || minutes > 59)
+    return -1;
+  *end = str + consumed;
+  return hours * 60 + minutes;
+}
+
+/**
+ * Parses "<id>[-<last id>]", standard and extended IDs share one number space of 29 bits
+ */
+static int parse_id_range(const char *str, unsigned long *first, unsigned long *last) {
+  char *end;
+  errno = 0;
+  *first = strtoul(str, &end, 0);
+  *last = *first;
+  if (*end == '-')
+    *last = strtoul(end + 1, &end, 0);
+  if (errno != 0 || *end != '\0' || *first > *last || *last > CAN_EFF_MASK)
+    return -1;
+  return 0;
+}
+
+/**
+ * Parses "<frames per second>[/<burst>]", the burst defaults to one second of the rate
+ * @param allow_off true if a rate of 0 (no limit) is valid
+ * @return 0 if the rate is valid, -1 otherwise
+ */
+static int parse_rate(const char *str, double *rate, double *burst, bool allow_off) {
+  char *end;
+  *rate = strtod(str, &end);
+  *burst = *rate;
+  if (*end == '/')
+    *burst = strtod(end + 1, &end);
+  if (*end != '\0' || *rate < 0 || (*rate == 0 && !allow_off))
+    return -1;
+  // A bucket smaller than one token would never let a frame pass
+  return *rate == 0 || *burst >= 1 ? 0 : -1;
+}
+
+/**
+ * Parses one option of a rule (everything after allow/deny) into the rule
+ * @return 0 if the option is valid, -1 otherwise
+ */
+static int parse_option(const char *option, gateway_rule_t *rule) {
+  char *end;
+  if (strncmp(option, "rate=", 5) == 0)
+    return parse_rate(option + 5, &rule->rate, &rule->burst, false);
+  if (strncmp(option, "max_speed=", 10) == 0) {
+    rule->max_speed = strtol(option + 10, &end, 0);
+    return *end == '\0' && rule->max_speed >= 0 ? 0 : -1;
+  }
+  if (strncmp(option, "time=", 5) == 0) {
+    const char *pos;
+    rule->time_from = parse_time_of_day(option + 5, &pos);
+    if (rule->time_from < 0 || *pos != '-')
+      return -1;
+    rule->time_to = parse_time_of_day(pos + 1, &pos);
+    return rule->time_to >= 0 && *pos == '\0' ? 0 : -1;
+  }
+  if (strncmp(option, "byte", 4) == 0) {
+    unsigned int byte, mask, min, max;
+    int consumed;
+    if (rule->n_payload_checks == GATEWAY_MAX_PAYLOAD_CHECKS)
+      return -1;
+    if (sscanf(option, "byte%u=%i:%i-%i%n", &byte, &mask, &min, &max, &consumed) != 4 || option[consumed] != '\0')
+      return -1;
+    if (byte >= CANFD_MAX_DLEN || mask > 0xFF || min > max || max > 0xFF)
+      return -1;
+    rule->payload_checks[rule->n_payload_checks++] = (gateway_payload_check_t){.byte = byte, .mask = mask, .min = min, .max = max};
+    return 0;
+  }
+  return -1;
+}
+
+/**
+ * Parses the options of a "limit <direction> ..." line, the first option was already split off by the caller
+ * @return 0 if the line is valid, -1 otherwise
+ */
+static int compile_limit(const char *direction, char *option, char *save) {
+  bool read = strcmp(direction, "read") == 0 || strcmp(direction, "both") == 0;
+  bool write = strcmp(direction, "write") == 0 || strcmp(direction, "both") == 0;
+  if (!read && !write)
+    return -1;
+
+  gateway_limits_t parsed = limits[read ? GATEWAY_DIRECTION_READ : GATEWAY_DIRECTION_WRITE];
+  for (; option != NULL && option[0] != '#'; option = strtok_r(NULL, " \t\r\n", &save)) {
+    if (strncmp(option, "id=", 3) == 0) {
+      if (parse_rate(option + 3, &parsed.id_rate, &parsed.id_burst, true) != 0)
+        return -1;
+    } else if (strncmp(option, "total=", 6) == 0) {
+      if (parse_rate(option + 6, &parsed.total_rate, &parsed.total_burst, true) != 0)
+        return -1;
+    } else {
+      return -1;
+    }
+  }
+  if (read)
+    limits[GATEWAY_DIRECTION_READ] = parsed;
+  if (write)
+    limits[GATEWAY_DIRECTION_WRITE] = parsed;
+  return 0;
+}
+
+/**
+ * Adds a rule, the lookup tables are only built by compile_tables() once all rules are known
+ * @return 0 if the rule was added, -1 if there are too many rules
+ */
+static int add_rule(const gateway_rule_t *rule, bool read, bool write, canid_t first, canid_t last) {
+  if (n_rules == GATEWAY_MAX_RULES)
+    return -1;
+  rules[++n_rules] = *rule;
+  scopes[n_rules] = (gateway_rule_scope_t){.first = first, .last = last, .read = read, .write = write};
+  // A rule for a single ID gets per-ID state now, an ID that only a range names gets its bucket on its first frame
+  if (first == last)
+    can_id_intern(first);
+  return 0;
+}
+
+static bool rule_covers(size_t rule, gateway_direction_id_t direction, canid_t id) {
+  const gateway_rule_scope_t *scope = &scopes[rule];
+  bool in_direction = direction == GATEWAY_DIRECTION_READ ? scope->read : scope->write;
+  return in_direction && id >= scope->first && id <= scope->last;
+}
+
+/**
+ * @return the rule that decides about an ID, the last rule in the file that covers it or 0 (deny)
+ */
+static uint16_t resolve_rule(gateway_direction_id_t direction, canid_t id) {
+  for (size_t rule = n_rules; rule > 0; rule--) {
+    if (rule_covers(rule, direction, id))
+      return rule;
+  }
+  return 0;
+}
+
+static int compare_ids(const void *a, const void *b) {
+  canid_t x = *(const canid_t *)a, y = *(const canid_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Builds the rule of every interned ID and the segments of all ranges, runs once at startup so it may take O(rules^2)
+ */
+static void compile_tables() {
+  for (int direction = 0; direction < 2; direction++) {
+    for (size_t index = 0; index < can_id_count(); index++)
+      rule_of_index[direction][index] = resolve_rule(direction, can_id_at(index) & CAN_EFF_MASK);
+
+    // Every first ID and every ID after a last ID of a rule may start a new segment
+    canid_t starts[GATEWAY_MAX_SEGMENTS];
+    size_t n_starts = 0;
+    starts[n_starts++] = 0;
+    for (size_t rule = 1; rule <= n_rules; rule++) {
+      starts[n_starts++] = scopes[rule].first;
+      if (scopes[rule].last < CAN_EFF_MASK)
+        starts[n_starts++] = scopes[rule].last + 1;
+    }
+    qsort(starts, n_starts, sizeof(canid_t), compare_ids);
+
+    n_segments[direction] = 0;
+    for (size_t i = 0; i < n_starts; i++) {
+      uint16_t rule = resolve_rule(direction, starts[i]);
+      size_t n = n_segments[direction];
+      // Duplicate starts and neighbouring segments with the same rule are merged
+      if (n > 0 && (segment_start[direction][n - 1] == starts[i] || segment_rule[direction][n - 1] == rule))
+        continue;
+      segment_start[direction][n] = starts[i];
+      segment_rule[direction][n] = rule;
+      n_segments[direction]++;
+    }
+  }
+}
+
+/**
+ * Finds the rule of an ID, O(1) for interned IDs and a binary search over the segments for all others
+ * @param index set to the dense index of the ID or -1
+ */
+static uint16_t rule_of(gateway_direction_id_t direction, canid_t id, int *index) {
+  *index = can_id_lookup(id);
+  if (*index >= 0)
+    return rule_of_index[direction][*index];
+
+  canid_t key = id & CAN_EFF_MASK;
+  size_t low = 0, high = n_segments[direction];
+  while (high - low > 1) {
+    size_t mid = (low + high) / 2;
+    if (segment_start[direction][mid] <= key)
+      low = mid;
+    else
+      high = mid;
+  }
+  return segment_rule[direction][low];
+}
+
+/**
+ * Parses one line of a policy into a rule
+ * @return 0 if the line was valid or empty, -1 otherwise
+ */
+static int compile_line(char *line) {
+  char *save;
+  char *direction = strtok_r(line, " \t\r\n", &save);
+  if (direction == NULL || direction[0] == '#')
+    return 0;
+  char *ids = strtok_r(NULL, " \t\r\n", &save);
+  char *action = strtok_r(NULL, " \t\r\n", &save);
+  if (ids == NULL || action == NULL)
+    return -1;
+
+  if (strcmp(direction, "limit") == 0)
+    return compile_limit(ids, action, save);
+
+  bool read = strcmp(direction, "read") == 0 || strcmp(direction, "both") == 0;
+  bool write = strcmp(direction, "write") == 0 || strcmp(direction, "both") == 0;
+  unsigned long first, last;
+  if ((!read && !write) || parse_id_range(ids, &first, &last) != 0)
+    return -1;
+
+  gateway_rule_t rule = {.max_speed = -1, .time_from = -1, .time_to = -1};
+  if (strcmp(action, "allow") == 0)
+    rule.allow = true;
+  else if (strcmp(action, "deny") != 0)
+    return -1;
+  for (char *option = strtok_r(NULL, " \t\r\n", &save); option != NULL; option = strtok_r(NULL, " \t\r\n", &save)) {
+    if (option[0] == '#')
+      break;
+    if (parse_option(option, &rule) != 0)
+      return -1;
+  }
+
+  return add_rule(&rule, read, write, first, last);
+}
+
+int gateway_policy_load_file(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror("Failed to open gateway policy");
+    return -1;
+  }
+  char *policy = NULL;
+  size_t policy_size = 0;
+  // The policy is compiled once at startup, so it is simply read as a whole
+  FILE *buffer = open_memstream(&policy, &policy_size);
+  if (buffer == NULL) {
+    perror("Failed to read gateway policy");
+    fclose(file);
+    return -1;
+  }
+  char chunk[512];
+  size_t n;
+  bool failed = false;
+  while (!failed && (n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    failed = fwrite(chunk, 1, n, buffer) != n;
+  // The buffer is only complete (and allocated at all) once the stream was closed successfully
+  failed |= ferror(file) != 0;
+  failed |= fclose(buffer) != 0 || policy == NULL;
+  fclose(file);
+  if (failed) {
+    perror("Failed to read gateway policy");
+    free(policy);
+    return -1;
+  }
+
+  int result = gateway_policy_load_string(policy);
+  if (result == 0)
+    printf("Loaded %zu gateway rules from %s\n", n_rules, path);
+  else
+    printf("Failed to load gateway policy %s\n", path);
+  free(policy);
+  return result;
+}
+
+int gateway_policy_load_string(const char *policy) {
+  reset_policy();
+  int line_number = 0;
+  while (*policy != '\0') {
+    size_t len = strcspn(policy, "\n");
+    char line[512];
+    line_number++;
+    if (len >= sizeof(line)) {
+      printf("Invalid gateway rule in line %d\n", line_number);
+      reset_policy();
+      return -2;
+    }
+    memcpy(line, policy, len);
+    line[len] = '\0';
+    if (compile_line(line) != 0) {
+      printf("Invalid gateway rule in line %d\n", line_number);
+      reset_policy();
+      return -2;
+    }
+    policy += policy[len] == '\n' ? len + 1 : len;
+  }
+  compile_tables();
+  return 0;
+}
+
+void gateway_policy_load_whitelist(const canid_t *read_ids, size_t n_read, const canid_t *write_ids, size_t n_write) {
+  reset_policy();
+  gateway_rule_t allow = {.allow = true, .max_speed = -1, .time_from = -1, .time_to = -1};
+  for (size_t i = 0; i < n_read; i++)
+    add_rule(&allow, true, false, read_ids[i], read_ids[i]);
+  for (size_t i = 0; i < n_write; i++)
+    add_rule(&allow, false, true, write_ids[i], write_ids[i]);
+  compile_tables();
+}
+
+bool gateway_policy_needs_payload(gateway_direction_id_t direction, canid_t id) {
+  int index;
+  return rules[rule_of(direction, id, &index)].n_payload_checks > 0;
+}
+
+/**
+ * Finds the bucket of an ID that is not interned and adds one for an ID that has none yet
+ * @return the bucket of the ID, or the bucket of its rule if the table of the direction is full
+ */
+static gateway_bucket_t *range_bucket(gateway_direction_id_t direction, canid_t id, uint16_t rule_index) {
+  uint32_t key = id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+  uint32_t *keys = range_keys[direction];
+  // Fibonacci hashing like can_id_map.c, the table is never more than half full, so the probe sequence always ends
+  size_t slot = (uint32_t)(key * 2654435761u) >> (32 - __builtin_ctz(GATEWAY_RANGE_ID_SLOTS));
+  while (keys[slot] != key && keys[slot] != EMPTY_RANGE_KEY)
+    slot = (slot + 1) & (GATEWAY_RANGE_ID_SLOTS - 1);
+  if (keys[slot] == key)
+    return &range_buckets[direction][range_index[direction][slot]];
+  if (n_range_ids[direction] == GATEWAY_MAX_RANGE_IDS)
+    return &rule_buckets[direction][rule_index];
+
+  keys[slot] = key;
+  range_index[direction][slot] = n_range_ids[direction];
+  return &range_buckets[direction][n_range_ids[direction]++];
+}
+
+/**
+ * Refills a token bucket for the time since its last refill
+ * @return true if the bucket holds at least one token
+ */
+static bool refill(gateway_bucket_t *bucket, double rate, double burst, long now_us) {
+  if (bucket->last_refill_us == 0)
+    bucket->tokens = burst;
+  else
+    bucket->tokens += (now_us - bucket->last_refill_us) * rate / 1000000.0;
+  if (bucket->tokens > burst)
+    bucket->tokens = burst;
+  bucket->last_refill_us = now_us;
+  return bucket->tokens >= 1;
+}
+
+gateway_verdict_t gateway_policy_check(gateway_direction_id_t direction, canid_t id, const unsigned char *payload, int payload_len, long now_us,
+                                       int minute_of_day) {
+  int index;
+  uint16_t rule_index = rule_of(direction, id, &index);
+  const gateway_rule_t *rule = &rules[rule_index];
+  if (!rule->allow)
+    return GATEWAY_POLICY_DENY;
+
+  if (rule->max_speed >= 0 && atomic_load_explicit(&gateway_state.speed_kph, memory_order_relaxed) > rule->max_speed)
+    return GATEWAY_POLICY_CONDITION_FAILED;
+  if (rule->time_from >= 0) {
+    bool in_window = rule->time_from <= rule->time_to ? minute_of_day >= rule->time_from && minute_of_day <= rule->time_to
+                                                      : minute_of_day >= rule->time_from || minute_of_day <= rule->time_to;
+    if (!in_window)
+      return GATEWAY_POLICY_CONDITION_FAILED;
+  }
+  for (int i = 0; i < rule->n_payload_checks; i++) {
+    const gateway_payload_check_t *check = &rule->payload_checks[i];
+    if (payload == NULL || check->byte >= payload_len)
+      return GATEWAY_POLICY_CONDITION_FAILED;
+    uint8_t value = payload[check->byte] & check->mask;
+    if (value < check->min || value > check->max)
+      return GATEWAY_POLICY_CONDITION_FAILED;
+  }
+
+  // The tokens are only taken once all other conditions passed and both buckets have one, so a blocked frame uses up
+  // neither the rate of its ID nor the rate of the direction
+  const gateway_limits_t *limit = &limits[direction];
+  double id_rate = rule->rate > 0 ? rule->rate : limit->id_rate;
+  double id_burst = rule->rate > 0 ? rule->burst : limit->id_burst;
+  gateway_bucket_t *id_bucket = NULL;
+  if (id_rate > 0)
+    id_bucket = index >= 0 ? &buckets[direction][index] : range_bucket(direction, id, rule_index);
+  gateway_bucket_t *total_bucket = &total_buckets[direction];
+  if (id_rate > 0 && !refill(id_bucket, id_rate, id_burst, now_us))
+    return GATEWAY_POLICY_RATE_LIMITED;
+  if (limit->total_rate > 0 && !refill(total_bucket, limit->total_rate, limit->total_burst, now_us))
+    return GATEWAY_POLICY_RATE_LIMITED;
+  if (id_rate > 0)
+    id_bucket->tokens -= 1;
+  if (limit->total_rate > 0)
+    total_bucket->tokens -= 1;
+  return GATEWAY_POLICY_ALLOW;
+}
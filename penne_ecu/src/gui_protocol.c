@@ -0,0 +1,180 @@
+#include "gui_protocol.h"
+#include "shm_export.h"
+#include <stdio.h>
+#include <unistd.h>
+
+gui_protocol_t gui_protocol = GUI_PROTOCOL_BINARY;
+gui_transport_t gui_transport = GUI_TRANSPORT_SERIAL;
+
+// Longest text of a field (" " + 2 digit ID + 8 digit value) and of an event (" " + 5 numbers of at most 16 digits)
+#define TEXT_FIELD_MAX_LEN 11
+#define TEXT_EVENT_MAX_LEN 81
+
+static const char *text_prefix(gui_frame_type_t type) {
+  switch (type) {
+  case GUI_FRAME_COMMAND:
+    return "EXD";
+  case GUI_FRAME_OBSERVER_EVENTS:
+    return "EVT";
+  default:
+    return "EXU";
+  }
+}
+
+static void put_u8(gui_message_t *msg, uint8_t value) { msg->data[msg->len++] = value; }
+
+static void put_u32(gui_message_t *msg, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    msg->data[msg->len++] = value >> (8 * i);
+}
+
+static void put_u64(gui_message_t *msg, uint64_t value) {
+  put_u32(msg, value);
+  put_u32(msg, value >> 32);
+}
+
+static uint32_t get_u32(const uint8_t *data) { return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24; }
+
+/**
+ * Appends the value as lowercase hex without leading zeros, like "%x" but without parsing a format string
+ */
+static void put_hex(gui_message_t *msg, uint64_t value, int min_digits) {
+  char digits[16];
+  int n = 0;
+  do {
+    digits[n++] = "0123456789abcdef"[value & 0xF];
+    value >>= 4;
+  } while (value != 0 || n < min_digits);
+  while (n > 0)
+    msg->data[msg->len++] = digits[--n];
+}
+
+static size_t payload_len(const gui_message_t *msg) { return msg->len - GUI_FRAME_HEADER_LEN; }
+
+void gui_message_begin(gui_message_t *msg, gui_frame_type_t type) {
+  msg->type = type;
+  msg->len = 0;
+  msg->n_items = 0;
+  if (gui_protocol == GUI_PROTOCOL_TEXT) {
+    for (const char *c = text_prefix(type); *c != 0; c++)
+      put_u8(msg, *c);
+    return;
+  }
+  put_u8(msg, GUI_FRAME_SYNC);
+  put_u8(msg, GUI_FRAME_VERSION);
+  put_u8(msg, type);
+  // The length is filled in by gui_message_send(...)
+  put_u8(msg, 0);
+}
+
+void gui_message_begin_events(gui_message_t *msg, uint32_t dropped) {
+  gui_message_begin(msg, GUI_FRAME_OBSERVER_EVENTS);
+  if (gui_protocol == GUI_PROTOCOL_TEXT) {
+    put_u8(msg, ' ');
+    put_hex(msg, dropped, 1);
+  } else {
+    put_u32(msg, dropped);
+  }
+}
+
+int gui_message_add_field(gui_message_t *msg, uint8_t field, uint32_t value) {
+  if (gui_protocol == GUI_PROTOCOL_TEXT) {
+    // One byte is kept for the line ending
+    if (msg->len + TEXT_FIELD_MAX_LEN + 1 > sizeof(msg->data))
+      return -1;
+    put_u8(msg, ' ');
+    put_hex(msg, field, 2);
+    put_hex(msg, value, 1);
+  } else {
+    if (payload_len(msg) + GUI_FIELD_LEN > GUI_FRAME_MAX_PAYLOAD)
+      return -1;
+    put_u8(msg, field);
+    put_u32(msg, value);
+  }
+  msg->n_items++;
+  return 0;
+}
+
+int gui_message_add_event(gui_message_t *msg, uint64_t timestamp_ms, uint32_t can_id, uint8_t signal, uint8_t code, uint32_t value) {
+  if (gui_protocol == GUI_PROTOCOL_TEXT) {
+    if (msg->len + TEXT_EVENT_MAX_LEN + 1 > sizeof(msg->data))
+      return -1;
+    put_u8(msg, ' ');
+    put_hex(msg, timestamp_ms, 1);
+    uint32_t fields[] = {can_id, signal, code, value};
+    for (int i = 0; i < 4; i++) {
+      put_u8(msg, ':');
+      put_hex(msg, fields[i], 1);
+    }
+  } else {
+    if (payload_len(msg) + GUI_EVENT_LEN > GUI_FRAME_MAX_PAYLOAD)
+      return -1;
+    put_u64(msg, timestamp_ms);
+    put_u32(msg, can_id);
+    put_u8(msg, signal);
+    put_u8(msg, code);
+    put_u32(msg, value);
+  }
+  msg->n_items++;
+  return 0;
+}
+
+int gui_message_send(gui_message_t *msg, int fd) {
+  if (gui_transport == GUI_TRANSPORT_SHM)
+    return shm_export_publish(msg);
+  if (gui_protocol == GUI_PROTOCOL_TEXT) {
+    // The GUI ends its commands with a carriage return, the ECUs end their messages with a newline
+    put_u8(msg, msg->type == GUI_FRAME_COMMAND ? '\r' : '\n');
+  } else {
+    msg->data[3] = payload_len(msg);
+    uint16_t crc = gui_crc16(msg->data + 1, msg->len - 1);
+    put_u8(msg, crc);
+    put_u8(msg, crc >> 8);
+  }
+  if (write(fd, msg->data, msg->len) <= 0) {
+    perror("Failed to write to serial");
+    return -1;
+  }
+  return 0;
+}
+
+uint16_t gui_crc16(const uint8_t *data, size_t len) {
+  static uint16_t table[256];
+  static bool table_ready = false;
+  if (!table_ready) {
+    for (int byte = 0; byte < 256; byte++) {
+      uint16_t crc = byte << 8;
+      for (int bit = 0; bit < 8; bit++)
+        crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+      table[byte] = crc;
+    }
+    table_ready = true;
+  }
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < len; i++)
+    crc = (crc << 8) ^ table[(crc >> 8) ^ data[i]];
+  return crc;
+}
+
+int gui_frame_check(const uint8_t *data, size_t len, size_t *frame_len) {
+  if (len < GUI_FRAME_HEADER_LEN)
+    return 0;
+  if (data[0] != GUI_FRAME_SYNC || data[1] != GUI_FRAME_VERSION)
+    return -1;
+  size_t total = GUI_FRAME_HEADER_LEN + data[3] + GUI_FRAME_CRC_LEN;
+  if (len < total)
+    return 0;
+  uint16_t crc = data[total - 2] | data[total - 1] << 8;
+  if (gui_crc16(data + 1, total - GUI_FRAME_CRC_LEN - 1) != crc)
+    return -1;
+  *frame_len = total;
+  return 1;
+}
+
+int gui_frame_for_each_field(const uint8_t *frame, void (*handler)(int field, int value)) {
+  int n_fields = frame[3] / GUI_FIELD_LEN;
+  const uint8_t *field = frame + GUI_FRAME_HEADER_LEN;
+  for (int i = 0; i < n_fields; i++, field += GUI_FIELD_LEN)
+    handler(field[0], get_u32(field + 1));
+  return n_fields;
+}
@@ -0,0 +1,84 @@
+#include "gui_reporter.h"
+#include "gui_protocol.h"
+#include "helpers.h"
+#include "observer_events.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+int gui_report_rate_hz = GUI_REPORT_RATE_HZ;
+
+static pthread_t reporter_thread;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t pending_mask = 0;
+static uint32_t pending_values[GUI_REPORTER_MAX_FIELDS];
+
+void gui_reporter_post(const uint8_t *ids, const uint32_t *values, size_t n_fields) {
+  pthread_mutex_lock(&pending_lock);
+  for (size_t i = 0; i < n_fields; i++) {
+    if (ids[i] < GUI_REPORTER_MAX_FIELDS) {
+      pending_values[ids[i]] = values[i];
+      pending_mask |= 1u << ids[i];
+    }
+  }
+  pthread_mutex_unlock(&pending_lock);
+}
+
+/**
+ * Sends the queued fields as one message
+ */
+static void send_pending_fields() {
+  uint32_t values[GUI_REPORTER_MAX_FIELDS];
+  pthread_mutex_lock(&pending_lock);
+  uint32_t mask = pending_mask;
+  memcpy(values, pending_values, sizeof(values));
+  pending_mask = 0;
+  pthread_mutex_unlock(&pending_lock);
+  if (mask == 0)
+    return;
+
+  gui_message_t msg;
+  gui_message_begin(&msg, GUI_FRAME_ECU_DATA);
+  while (mask != 0) {
+    int id = __builtin_ctz(mask);
+    mask &= mask - 1;
+    gui_message_add_field(&msg, id, values[id]);
+  }
+  gui_message_send(&msg, serial_port);
+}
+
+static void *reporter_loop(void *arg) {
+  (void)arg;
+  long period_ns = 1000000000L / gui_report_rate_hz;
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (1) {
+    next.tv_nsec += period_ns;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    // A write that blocked for longer than a period does not cause a burst of catch-up updates
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+      next = now;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    send_pending_fields();
+    observer_events_flush();
+  }
+  return NULL;
+}
+
+int gui_reporter_start() {
+  if (gui_report_rate_hz <= 0)
+    gui_report_rate_hz = GUI_REPORT_RATE_HZ;
+  if (pthread_create(&reporter_thread, NULL, reporter_loop, NULL) != 0) {
+    perror("Failed to start the GUI reporter");
+    return -1;
+  }
+  printf("Reporting to the GUI at %d Hz\n", gui_report_rate_hz);
+  return 0;
+}
@@ -3,11 +3,14 @@
 //
 #include "helpers.h"
 #include "ecu.h"
+#include "gui_protocol.h"
+#include <endian.h>
 #include <errno.h> // Error integer and strerror() function
 #include <fcntl.h> // Contains file controls like O_RDWR
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/timerfd.h>
 #include <termios.h> // Contains POSIX terminal control definitions
 #include <time.h>
 
@@ -82,6 +85,39 @@ int make_timer(timer_t *timer_id, int expire_ms, int interval_ms) {
   return 0;
 }
 
+long monotonic_micros() {
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
+
+int make_timerfd() {
+  // A step of the wall clock (NTP, date) must not move the deadlines of the cyclic CAN messages
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd < 0) {
+    perror("timerfd_create");
+    return -1;
+  }
+  return timer_fd;
+}
+
+int set_timerfd_deadline(int timer_fd, long deadline_us) {
+  struct itimerspec its = {0};
+
+  // An all-zero it_value would disarm the timer, so we clamp the deadline to at least 1ns after the start of the clock
+  its.it_value.tv_sec = deadline_us / 1000000;
+  its.it_value.tv_nsec = (deadline_us % 1000000) * 1000;
+  if (its.it_value.tv_sec <= 0 && its.it_value.tv_nsec <= 0) {
+    its.it_value.tv_sec = 0;
+    its.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+    perror("timerfd_settime");
+    return -1;
+  }
+  return 0;
+}
+
 int init_serial_port(char *port) {
   char serial_port_name[strlen(SERIAL_PORT) + strlen(port)];
   strcpy(serial_port_name, SERIAL_PORT);
@@ -147,109 +183,158 @@ int init_serial_port(char *port) {
   return 0;
 }
 
+/**
+ * Applies the backspaces of a command typed into the pty by hand, the GUI itself never sends them
+ * @return the length of the edited command
+ */
+static size_t apply_backspaces(char *cmd, size_t len) {
+  size_t out = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (cmd[i] == 0x08 || cmd[i] == 0x7F) {
+      if (out > 0)
+        out--;
+    } else {
+      cmd[out++] = cmd[i];
+    }
+  }
+  return out;
+}
+
+/**
+ * Handles every complete command and frame in the buffer without copying them
+ * @return the number of bytes that were handled, the rest is the beginning of the next command or frame
+ */
+static size_t parse_console_buffer(char *buffer, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    if ((uint8_t)buffer[pos] == GUI_FRAME_SYNC) {
+      // A text command never starts with the sync byte
+      size_t frame_len;
+      int result = gui_frame_check((uint8_t *)buffer + pos, len - pos, &frame_len);
+      if (result == 0)
+        break;
+      if (result < 0) {
+        // Resynchronize on the next sync byte
+        printf("Invalid frame from GUI\n");
+        pos++;
+        continue;
+      }
+      frame_job((uint8_t *)buffer + pos);
+      pos += frame_len;
+      continue;
+    }
+    char *end = memchr(buffer + pos, '\r', len - pos);
+    if (end == NULL)
+      break;
+    *end = 0;
+    command_job(buffer + pos, end - (buffer + pos));
+    pos = end - buffer + 1;
+  }
+  return pos;
+}
+
 ssize_t read_chassis_ecu_data() {
-  int i;
+  ssize_t total = 0;
   ssize_t num_bytes;
-  char buffer[128] = {0};
-  char c;
-  num_bytes = read(serial_port, buffer, sizeof(buffer));
-
-  if (num_bytes != 0) {
-    for (i = 0; i < num_bytes; i++) {
-      c = buffer[i];
-      if (c == 0x0D) { //  [CR]
-        sci_console.buffer[sci_console.write_pointer] = 0;
-        sci_console.write_pointer = 0;
-        // Finished reading, we can now process the command
-        command_job(sci_console.buffer);
-      } else if (c == 0x08 || c == 0x7F) { // Delete 1 character
-        if (sci_console.write_pointer > 0) {
-          sci_console.write_pointer--;
-        }
-      } else {
-        if (c >= 0x61 && c <= 0x7a) { // Convert lowercase to uppercase
-          sci_console.buffer[sci_console.write_pointer] = c - 0x20;
-        } else {
-          sci_console.buffer[sci_console.write_pointer] = c;
-        }
-        sci_console.write_pointer++;
-        if (sci_console.write_pointer >= COMMAND_BUF_MAX) {
-          sci_console.write_pointer = 0;
-        }
-      }
+  // The whole backlog is read on every wakeup, the port returns 0 once it is empty (VMIN = VTIME = 0)
+  while ((num_bytes = read(serial_port, sci_console.buffer + sci_console.write_pointer, COMMAND_BUF_MAX - sci_console.write_pointer)) > 0) {
+    total += num_bytes;
+    sci_console.write_pointer += num_bytes;
+    size_t handled = parse_console_buffer(sci_console.buffer, sci_console.write_pointer);
+    if (handled == 0 && sci_console.write_pointer == COMMAND_BUF_MAX) {
+      printf("Command too long\n");
+      handled = COMMAND_BUF_MAX;
     }
+    // Only an incomplete command or frame at the end is moved to the front
+    sci_console.write_pointer -= handled;
+    memmove(sci_console.buffer, sci_console.buffer + handled, sci_console.write_pointer);
   }
-  return num_bytes;
+  return total > 0 ? total : num_bytes;
 }
 
-void command_job(char *cmd) {
-  if (*cmd == '\n') {
+void command_job(char *cmd, size_t len) {
+  if (len > 0 && *cmd == '\n') {
     cmd++;
+    len--;
+  }
+  if (memchr(cmd, 0x08, len) != NULL || memchr(cmd, 0x7F, len) != NULL) {
+    len = apply_backspaces(cmd, len);
+    cmd[len] = 0;
   }
-  if (cmd[0] == 'E' && cmd[1] == 'X' && cmd[2] == 'D') {
-    ecu_input_update(cmd + 3);
+  if (len >= 3 && (cmd[0] | 0x20) == 'e' && (cmd[1] | 0x20) == 'x' && (cmd[2] | 0x20) == 'd') {
+    ecu_input_update(cmd + 3, len - 3);
   } else {
     printf("Invalid command: %s\n", cmd);
   }
-  (*cmd)++;
 }
 
-void ecu_input_update(char *cmd) {
-  int i, f;
-  int id;
-  char c;
-  unsigned long d;
-
-  if (cmd == 0 || *cmd == 0) {
-    return;
+void frame_job(const uint8_t *frame) {
+  if (frame[2] == GUI_FRAME_COMMAND) {
+    gui_frame_for_each_field(frame, set_ecu_id_to_value);
+  } else {
+    printf("Invalid frame type: %d\n", frame[2]);
   }
-  // Rewriting process
-  while (*cmd != 0) {
-    while (*cmd == ' ') {
-      cmd++;
-    }
-    // Get target ID
-    id = 0;
-    // Convert HEX to Decimal
-    for (i = 0; i < 2; i++) {
-      c = *cmd;
-      if (c >= 'a' && c <= 'f') {
-        c -= 0x27;
-      }
-      if (c >= 'A' && c <= 'F') {
-        c -= 7;
-      }
-      if (c < 0x30 || c > 0x3F) {
-        break;
-      }
-      id = (id << 4) | (unsigned char)(c & 0x0F);
+}
+
+#define SWAR_ONES 0x0101010101010101ull
+#define SWAR_HIGH_BITS (0x80 * SWAR_ONES)
+// Sets the high bit of every byte that is >= c, the bytes must be below 0x80 so that no carry crosses into the next byte
+#define SWAR_GE(x, c) (((x) + (0x80 - (c)) * SWAR_ONES) & SWAR_HIGH_BITS)
+
+int hex_decode(const char *digits, size_t n_digits, uint32_t *value) {
+  if (n_digits == 0 || n_digits > 8)
+    return -1;
+  uint64_t chunk;
+  memcpy(&chunk, digits, sizeof(chunk));
+  // The first digit is in the lowest byte, the digits are moved to the top and the bytes below are filled with '0', so
+  // the last digit ends up in the highest byte
+  chunk = le64toh(chunk) << 8 * (8 - n_digits);
+  chunk |= ('0' * SWAR_ONES) & ~(~0ull << 8 * (8 - n_digits));
+
+  if (chunk & SWAR_HIGH_BITS)
+    return -1;
+  uint64_t lower = chunk | 0x20 * SWAR_ONES; // Digits stay digits, letters become lowercase
+  uint64_t is_digit = SWAR_GE(chunk, '0') & ~SWAR_GE(chunk, '9' + 1);
+  uint64_t is_letter = SWAR_GE(lower, 'a') & ~SWAR_GE(lower, 'f' + 1);
+  if ((is_digit | is_letter) != SWAR_HIGH_BITS)
+    return -1;
+
+  // '0'-'9' have 0-9 in the low nibble, 'A'-'F' and 'a'-'f' have 1-6 and bit 6 set
+  uint64_t nibbles = (chunk & 0x0F * SWAR_ONES) + ((chunk & 0x40 * SWAR_ONES) >> 6) * 9;
+  // Merge neighbouring nibbles, bytes and words, the lower address holds the more significant half
+  nibbles = ((nibbles << 4) | (nibbles >> 8)) & 0x00FF00FF00FF00FFull;
+  nibbles = ((nibbles << 8) | (nibbles >> 16)) & 0x0000FFFF0000FFFFull;
+  nibbles = ((nibbles << 16) | (nibbles >> 32)) & 0x00000000FFFFFFFFull;
+  *value = nibbles;
+  return 0;
+}
+
+int ecu_input_update(const char *cmd, size_t len) {
+  uint32_t ids[COMMAND_MAX_FIELDS];
+  uint32_t values[COMMAND_MAX_FIELDS];
+  int n_fields = 0;
+  const char *end = cmd + len;
+
+  // Every field is parsed before the first one is applied, so a malformed command changes nothing
+  while (cmd < end) {
+    if (*cmd == ' ') {
       cmd++;
+      continue;
     }
-    if (i == 2) { // && id < EX_IO_MAX) { // ID normal, data processing
-      f = 0;
-      d = 0;
-      // Convert HEX to Decimal
-      for (i = 0; i < 8; i++) {
-        c = *cmd;
-        if (c >= 'a' && c <= 'f') {
-          c -= 0x27;
-        }
-        if (c >= 'A' && c <= 'F') {
-          c -= 7;
-        }
-        if (c < 0x30 || c > 0x3F) {
-          break;
-        }
-        d = (d << 4) | (unsigned char)(c & 0x0F);
-        cmd++;
-        f++;
-      }
-      if (f > 0) {
-        set_ecu_id_to_value(id, d);
-      }
-    } else {
+    const char *field_end = memchr(cmd, ' ', end - cmd);
+    if (field_end == NULL)
+      field_end = end;
+    // 2 digit ID followed by 1 to 8 digits of the value
+    size_t field_len = field_end - cmd;
+    if (n_fields == COMMAND_MAX_FIELDS || field_len < 3 || hex_decode(cmd, 2, &ids[n_fields]) != 0 ||
+        hex_decode(cmd + 2, field_len - 2, &values[n_fields]) != 0) {
       printf("Failed\n");
-      break;
+      return -1;
     }
+    n_fields++;
+    cmd = field_end;
   }
+  for (int i = 0; i < n_fields; i++)
+    set_ecu_id_to_value(ids[i], values[i]);
+  return n_fields;
 }
@@ -1,13 +1,18 @@
 #include "can.h"
 #include "crypto.h"
 #include "ecu.h"
+#include "gateway.h"
+#include "gui_protocol.h"
+#include "gui_reporter.h"
 #include "helpers.h"
-#include <pthread.h>
+#include "shm_export.h"
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 int main(int argc, char *argv[]) {
-  if (argc < 3 || argc > 4) {
+  if (argc < 3 || argc > 8) {
     printf("Invalid number of args provided!\n");
     return -1;
   }
@@ -27,16 +32,62 @@ int main(int argc, char *argv[]) {
     return -2;
   }
   printf("Starting %s ECU on port %s\n", argv[1], argv[2]);
-  printf("Initializing serial port %s\n", argv[2]);
-  if (init_serial_port(argv[2]) != 0) {
-    return -3;
+  if (strcmp(argv[2], "shm") == 0) {
+    // The state is published in shared memory instead of being written to a socat pty
+    gui_transport = GUI_TRANSPORT_SHM;
+    serial_port = -1;
+    if (shm_export_open(argv[1]) != 0) {
+      return -3;
+    }
+  } else {
+    printf("Initializing serial port %s\n", argv[2]);
+    if (init_serial_port(argv[2]) != 0) {
+      return -3;
+    }
+  }
+
+  // The optional arguments are the encryption key, the frame format, the policy file of the gateway, the rate of the GUI
+  // updates and "text" to talk to the GUI with the old text protocol, a 256 bit key can never be one of the names. All
+  // ECUs on a bus have to be started with the same format
+  int key_arg = 0;
+  for (int i = 3; i < argc; i++) {
+    if (strncmp(argv[i], "policy=", 7) == 0)
+      gateway_policy_path = argv[i] + 7;
+    else if (strncmp(argv[i], "gui_rate=", 9) == 0) {
+      char *end;
+      errno = 0;
+      long rate = strtol(argv[i] + 9, &end, 10);
+      if (errno != 0 || end == argv[i] + 9 || *end != '\0' || rate <= 0 || rate > GUI_REPORT_MAX_RATE_HZ) {
+        fprintf(stderr, "Error parsing gui_rate, allowed: 1 to %d updates per second\n", GUI_REPORT_MAX_RATE_HZ);
+        return -2;
+      }
+      gui_report_rate_hz = rate;
+    } else if (strcmp(argv[i], "text") == 0)
+      gui_protocol = GUI_PROTOCOL_TEXT;
+    else if (strcmp(argv[i], "compact") == 0)
+      can_frame_format = CAN_FRAME_FORMAT_COMPACT;
+    else if (strcmp(argv[i], "legacy") == 0)
+      can_frame_format = CAN_FRAME_FORMAT_LEGACY;
+    else if (key_arg == 0)
+      key_arg = i;
+    else {
+      fprintf(stderr, "Error parsing frame format, allowed: [\"legacy\", \"compact\"]");
+      return -2;
+    }
   }
 
+  // The shared memory holds the fields themselves, the text protocol only exists on the serial port
+  if (gui_transport == GUI_TRANSPORT_SHM)
+    gui_protocol = GUI_PROTOCOL_BINARY;
+
   // ECU was started with an encryption key as commandline argument
-  if (argc == 4) {
-    encryption_key = (unsigned char *)argv[3];
+  if (key_arg != 0) {
+    encryption_key = (unsigned char *)argv[key_arg];
     using_encryption = true;
     printf("Using encryption with key: %x %x %x %x ...\n", encryption_key[0], encryption_key[1], encryption_key[2], encryption_key[3]);
+    // The ECU number is our sender ID in the IVs, the counter and the key schedule are set up once here
+    crypto_nonce_init(ecu_number);
+    crypto_session = crypto_session_new(encryption_key, can_frame_iv_len());
   } else {
     using_encryption = false;
   }
@@ -53,30 +104,12 @@ int main(int argc, char *argv[]) {
     }
   }
   printf("Setting up %s ECU\n", argv[1]);
-  ecu_setup();
-
-  pthread_t pth;
-  if (ecu_number == GATEWAY) {
-    if (pthread_mutex_init(&gateway_lock, NULL) != 0) {
-      perror("Failed to initialize gateway lock\n");
-      return -5;
-    }
-    if (pthread_create(&pth, NULL, gateway_read_obd_port_loop, NULL) != 0) {
-      perror("Failed to create Gateway thread!\n");
-      return -6;
-    }
+  if (ecu_setup() != 0) {
+    return -7;
   }
 
   printf("Starting main loop\n");
   while (loop() == 0) {
   }
-  if (ecu_number == GATEWAY) {
-    if (pthread_cancel(pth) != 0) {
-      perror("Failed to cancel Gateway thread!\n");
-    }
-    if (pthread_mutex_destroy(&gateway_lock) != 0) {
-      perror("Failed to destroy gateway lock!\n");
-    }
-  }
   return 0;
 }
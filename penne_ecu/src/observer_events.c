@@ -0,0 +1,44 @@
+#include "observer_events.h"
+#include "gui_protocol.h"
+#include "helpers.h"
+#include <stdatomic.h>
+
+// The main thread pushes and the reporter thread flushes, each index is only written by one of them
+static observer_event_t ring[OBSERVER_EVENT_RING_SIZE];
+static _Atomic size_t head = 0;
+static _Atomic size_t tail = 0;
+static _Atomic unsigned long dropped = 0;
+
+void observer_event_push(long timestamp_us, uint16_t can_id, observer_id_t signal, observer_code_t code, uint32_t value) {
+  size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+  if (h - atomic_load_explicit(&tail, memory_order_acquire) == OBSERVER_EVENT_RING_SIZE) {
+    // The oldest events are kept, they explain how an attack started
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+  ring[h & (OBSERVER_EVENT_RING_SIZE - 1)] =
+      (observer_event_t){.timestamp_us = timestamp_us, .can_id = can_id, .signal = signal, .code = code, .value = value};
+  atomic_store_explicit(&head, h + 1, memory_order_release);
+}
+
+int observer_events_flush() {
+  size_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+  size_t h = atomic_load_explicit(&head, memory_order_acquire);
+
+  int n_written = 0;
+  for (int message = 0; message < OBSERVER_EVENT_MESSAGES_PER_FLUSH && h != t; message++) {
+    gui_message_t msg;
+    gui_message_begin_events(&msg, atomic_load_explicit(&dropped, memory_order_relaxed));
+    for (int i = 0; i < OBSERVER_EVENTS_PER_MESSAGE && h != t; i++, t++) {
+      const observer_event_t *event = &ring[t & (OBSERVER_EVENT_RING_SIZE - 1)];
+      gui_message_add_event(&msg, event->timestamp_us / 1000, event->can_id, event->signal, event->code, event->value);
+      n_written++;
+    }
+    // The slots are free again once the events were copied into the message
+    atomic_store_explicit(&tail, t, memory_order_release);
+    gui_message_send(&msg, serial_port);
+  }
+  return n_written;
+}
+
+unsigned long observer_events_dropped() { return atomic_load_explicit(&dropped, memory_order_relaxed); }
@@ -0,0 +1,161 @@
+#include "payload_detector.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The largest changes the simulation of the powertrain makes per step, see write_powertrain_ecu_data()
+static const payload_rate_rule_t rate_rules[PAYLOAD_SIGNAL_COUNT] = {
+    // The gas pedal (0-100) adds at most 100 per step, without gas the RPM drops by 100. Shifting up sets the RPM to
+    // 5000, shifting down to 50000
+    [ENGINE_RPM] = {.max_rise = 100, .max_fall = 100, .n_jump_targets = 2, .jump_targets = {5000, 50000}},
+    // The speed moves half way to the target speed (0-255) per simulation step
+    [SPEED_KPH] = {.max_rise = 128, .max_fall = 128},
+    // The brake output rises by at most the brake pedal value (0-100) per simulation step and drops to 0 when released
+    [BRAKE_OUTPUT] = {.max_rise = 100, .max_fall = 0},
+};
+
+static bool not_driving_while_parked(const ecu_data_t *data) { return !(data->speed_kph > 0 && data->shift_position == 'P'); }
+
+static bool power_steering_follows_wheel(const ecu_data_t *data) {
+  // The powertrain maps 0-720 degrees of the steering wheel to 330-390, one frame of delay is tolerated
+  int expected = (data->steering_value - 360) * 30 / 360 + 360;
+  return abs(data->power_steering - expected) <= 3;
+}
+
+static const payload_invariant_t invariants[] = {
+    // The driver may shift to P while moving, the simulation then halves the speed per step, 255 kph stop after 8 steps
+    {"speed while parked", SPEED_KPH, 2, {SPEED_KPH, SHIFT_POSITION}, not_driving_while_parked, 10 * SIMULATION_INTERVAL * 1000L},
+    {"power steering does not follow the steering wheel", POWER_STEERING, 2, {STEERING_VALUE, POWER_STEERING}, power_steering_follows_wheel, 0},
+};
+#define N_INVARIANTS (sizeof(invariants) / sizeof(invariants[0]))
+
+typedef struct payload_signal_state_t {
+  int value; // Last received value
+  bool seen;
+  int accepted; // Last value that passed the rate of change check, and its receive time
+  long accepted_at;
+} payload_signal_state_t;
+
+static payload_signal_state_t signals[PAYLOAD_SIGNAL_COUNT];
+// Bit i is set if invariants[i] depends on the signal
+static uint32_t invariants_of_signal[PAYLOAD_SIGNAL_COUNT];
+// Signals whose current value is out of range, and invariants that are currently violated
+static uint64_t range_violations;
+static uint32_t invariant_violations;
+// Invariants that are violated but still within their grace period, and since when
+static uint32_t invariant_pending;
+static long invariant_broken_since[N_INVARIANTS];
+
+_Static_assert(PAYLOAD_SIGNAL_COUNT <= 64, "range_violations has one bit per signal");
+_Static_assert(sizeof(invariants) / sizeof(invariants[0]) <= 32, "invariant_violations has one bit per invariant");
+
+void payload_detector_init() {
+  memset(signals, 0, sizeof(signals));
+  memset(invariants_of_signal, 0, sizeof(invariants_of_signal));
+  range_violations = 0;
+  invariant_violations = 0;
+  invariant_pending = 0;
+  for (size_t i = 0; i < N_INVARIANTS; i++) {
+    for (int j = 0; j < invariants[i].n_dependencies; j++)
+      invariants_of_signal[invariants[i].dependencies[j]] |= 1u << i;
+  }
+}
+
+static void report(payload_violation_t *violations, int max_violations, int *n_violations, payload_violation_t violation) {
+  if (*n_violations < max_violations)
+    violations[*n_violations] = violation;
+  (*n_violations)++;
+}
+
+/**
+ * The frames are not sent in sync with the simulation, so one step more than fits into the elapsed time may have
+ * happened, and one more is allowed for the jitter of the send and receive times
+ */
+static long simulation_steps(long elapsed_us) { return (elapsed_us > 0 ? elapsed_us : 0) / (SIMULATION_INTERVAL * 1000L) + 2; }
+
+static bool rate_allowed(const payload_rate_rule_t *rule, int reference, int value, long steps) {
+  for (int i = 0; i < rule->n_jump_targets; i++) {
+    if (value == rule->jump_targets[i])
+      return true;
+  }
+  long change = (long)value - reference;
+  if (rule->max_rise > 0 && change > rule->max_rise * steps)
+    return false;
+  return !(rule->max_fall > 0 && -change > rule->max_fall * steps);
+}
+
+int payload_detector_check_frame(const can_db_msg_t *def, const ecu_data_t *data, long timestamp, payload_violation_t *violations, int max_violations) {
+  int n_violations = 0;
+  // Invariants in their grace period are checked again until they hold or are reported
+  uint32_t dirty_invariants = invariant_pending;
+
+  for (int i = 0; i < def->n_signals; i++) {
+    const can_signal_t *signal = &def->signals[i];
+    observer_id_t id = signal->observer_id;
+    payload_signal_state_t *state = &signals[id];
+    int value = can_db_signal_value(data, signal);
+
+    // Every frame is checked against the last accepted value, a forged value is reported as long as it is sent
+    if (!state->seen || value == state->accepted ||
+        rate_allowed(&rate_rules[id], state->accepted, value, simulation_steps(timestamp - state->accepted_at))) {
+      state->accepted = value;
+      state->accepted_at = timestamp;
+    } else {
+      report(violations, max_violations, &n_violations, (payload_violation_t){id, PAYLOAD_RATE_OF_CHANGE, value});
+    }
+
+    if (state->seen && state->value == value)
+      continue;
+
+    if (can_db_signal_valid(signal, value)) {
+      range_violations &= ~(1ull << id);
+    } else {
+      range_violations |= 1ull << id;
+      report(violations, max_violations, &n_violations, (payload_violation_t){id, PAYLOAD_RANGE, value});
+    }
+
+    state->value = value;
+    state->seen = true;
+    dirty_invariants |= invariants_of_signal[id];
+  }
+
+  while (dirty_invariants != 0) {
+    int i = __builtin_ctz(dirty_invariants);
+    dirty_invariants &= dirty_invariants - 1;
+    if (invariants[i].holds(data)) {
+      invariant_violations &= ~(1u << i);
+      invariant_pending &= ~(1u << i);
+    } else if (!(invariant_violations & (1u << i))) {
+      if (!(invariant_pending & (1u << i))) {
+        invariant_pending |= 1u << i;
+        invariant_broken_since[i] = timestamp;
+      }
+      // Reported once when the grace period is over, it stays active until the invariant holds again
+      if (timestamp - invariant_broken_since[i] >= invariants[i].grace_us) {
+        report(violations, max_violations, &n_violations, (payload_violation_t){invariants[i].reported_id, PAYLOAD_INVARIANT, i});
+        invariant_violations |= 1u << i;
+        invariant_pending &= ~(1u << i);
+      }
+    }
+  }
+  return n_violations;
+}
+
+observer_id_t payload_detector_active_violation() {
+  if (range_violations != 0)
+    return __builtin_ctzll(range_violations);
+  if (invariant_violations != 0)
+    return invariants[__builtin_ctz(invariant_violations)].reported_id;
+  return NONE;
+}
+
+const char *payload_violation_kind_name(payload_violation_kind_t kind) {
+  switch (kind) {
+  case PAYLOAD_RANGE:
+    return "out of range";
+  case PAYLOAD_RATE_OF_CHANGE:
+    return "changed too fast";
+  case PAYLOAD_INVARIANT:
+    return "violates invariant";
+  }
+  return "";
+}
@@ -0,0 +1,76 @@
+#include "reactor.h"
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+
+typedef struct reactor_slot_t {
+  int fd;
+  reactor_handler_t handler;
+} reactor_slot_t;
+
+static int epoll_fd = -1;
+static reactor_slot_t slots[MAX_REACTOR_SLOTS];
+
+int reactor_init() {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    perror("epoll_create1");
+    return -1;
+  }
+  for (int i = 0; i < MAX_REACTOR_SLOTS; i++) {
+    slots[i].fd = -1;
+    slots[i].handler = NULL;
+  }
+  return 0;
+}
+
+int reactor_add(int fd, reactor_handler_t handler) {
+  for (int i = 0; i < MAX_REACTOR_SLOTS; i++) {
+    if (slots[i].fd == -1) {
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = &slots[i];
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("epoll_ctl");
+        return -2;
+      }
+      slots[i].fd = fd;
+      slots[i].handler = handler;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int reactor_remove(int fd) {
+  for (int i = 0; i < MAX_REACTOR_SLOTS; i++) {
+    if (slots[i].fd == fd) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+      slots[i].fd = -1;
+      slots[i].handler = NULL;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int reactor_wait(int timeout_ms) {
+  struct epoll_event events[MAX_REACTOR_SLOTS];
+
+  int n = epoll_wait(epoll_fd, events, MAX_REACTOR_SLOTS, timeout_ms);
+  if (n < 0) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    perror("epoll_wait");
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    reactor_slot_t *slot = events[i].data.ptr;
+    // The slot may have been removed by a handler that ran earlier in this batch
+    if (slot->fd != -1) {
+      slot->handler(slot->fd, events[i].events);
+    }
+  }
+  return n;
+}
@@ -0,0 +1,106 @@
+#include "shm_export.h"
+#include "ecu.h"
+#include "helpers.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static shm_export_t *segment = NULL;
+static uint32_t last_command_sequence = 0;
+
+static uint32_t get_u32(const uint8_t *data) { return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24; }
+
+static uint64_t get_u64(const uint8_t *data) { return get_u32(data) | (uint64_t)get_u32(data + 4) << 32; }
+
+int shm_export_open(const char *ecu_name) {
+  char name[64];
+  snprintf(name, sizeof(name), "/penne_%s", ecu_name);
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+  if (fd < 0) {
+    perror("Failed to create shared memory");
+    return -1;
+  }
+  if (ftruncate(fd, sizeof(shm_export_t)) != 0) {
+    perror("Failed to create shared memory");
+    close(fd);
+    return -1;
+  }
+  segment = mmap(NULL, sizeof(shm_export_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    perror("Failed to map shared memory");
+    segment = NULL;
+    return -2;
+  }
+  // A segment of an earlier run is reset, the GUI ignores it until the magic is set again
+  atomic_store_explicit(&segment->magic, 0, memory_order_relaxed);
+  memset((uint8_t *)segment + sizeof(segment->magic), 0, sizeof(shm_export_t) - sizeof(segment->magic));
+  segment->version = SHM_EXPORT_VERSION;
+  segment->ecu_type = ecu_number;
+  atomic_store_explicit(&segment->magic, SHM_EXPORT_MAGIC, memory_order_release);
+  printf("Publishing the ECU state in shared memory %s\n", name);
+  return 0;
+}
+
+int shm_export_publish(const gui_message_t *msg) {
+  if (segment == NULL)
+    return -1;
+  const uint8_t *payload = msg->data + GUI_FRAME_HEADER_LEN;
+  size_t len = msg->len - GUI_FRAME_HEADER_LEN;
+
+  // There is only one writer, so the sequence needs no read-modify-write
+  uint32_t sequence = atomic_load_explicit(&segment->sequence, memory_order_relaxed);
+  atomic_store_explicit(&segment->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  if (msg->type == GUI_FRAME_OBSERVER_EVENTS) {
+    segment->events_dropped = get_u32(payload);
+    for (size_t offset = 4; offset + GUI_EVENT_LEN <= len; offset += GUI_EVENT_LEN) {
+      const uint8_t *event = payload + offset;
+      segment->events[segment->event_head & (SHM_EXPORT_MAX_EVENTS - 1)] = (shm_event_t){
+          .timestamp_ms = get_u64(event), .can_id = get_u32(event + 8), .signal = event[12], .code = event[13], .value = get_u32(event + 14)};
+      segment->event_head++;
+    }
+  } else {
+    for (size_t offset = 0; offset + GUI_FIELD_LEN <= len; offset += GUI_FIELD_LEN) {
+      uint8_t field = payload[offset];
+      if (field < SHM_EXPORT_MAX_FIELDS) {
+        segment->fields[field] = get_u32(payload + offset + 1);
+        segment->field_mask |= 1u << field;
+      }
+    }
+  }
+  segment->update_count++;
+  segment->timestamp_ms = millis();
+
+  atomic_store_explicit(&segment->sequence, sequence + 2, memory_order_release);
+  return 0;
+}
+
+int shm_export_poll_commands(void (*handler)(int field, int value)) {
+  if (segment == NULL)
+    return 0;
+  uint32_t sequence = atomic_load_explicit(&segment->command_sequence, memory_order_acquire);
+  if (sequence == last_command_sequence || (sequence & 1) != 0)
+    return 0;
+
+  uint32_t mask = segment->command_mask;
+  uint32_t commands[SHM_EXPORT_MAX_FIELDS];
+  memcpy(commands, segment->commands, sizeof(commands));
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&segment->command_sequence, memory_order_relaxed) != sequence) {
+    // The GUI wrote while we copied, the commands are read again on the next wakeup
+    return 0;
+  }
+  last_command_sequence = sequence;
+
+  int n_applied = 0;
+  for (int field = 0; field < SHM_EXPORT_MAX_FIELDS; field++) {
+    if (mask & (1u << field)) {
+      handler(field, commands[field]);
+      n_applied++;
+    }
+  }
+  return n_applied;
+}
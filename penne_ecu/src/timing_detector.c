@@ -0,0 +1,135 @@
+#include "timing_detector.h"
+#include "can_id_map.h"
+#include <string.h>
+
+static timing_config_t config = TIMING_DEFAULT_CONFIG;
+
+// Struct of arrays indexed by the dense ID index (can_id_map.h), the fields that every frame touches are next to the
+// same fields of the other IDs, so the hot state of all IDs of the vehicle fits in a few cache lines
+static long last_us[CAN_ID_MAX_INTERNED];  // Receive time of the last frame, 0 before the first frame
+static float mean_us[CAN_ID_MAX_INTERNED]; // Mean interval
+static float variance[CAN_ID_MAX_INTERNED]; // Sum of squared deviations (Welford M2) while learning, the variance once the ID is enforced
+static uint32_t n_intervals[CAN_ID_MAX_INTERNED]; // Number of intervals that went into mean/variance
+static uint8_t burst[CAN_ID_MAX_INTERNED];  // Consecutive intervals shorter than burst_ratio * mean
+// Consecutive deviating intervals that agree with each other, with their mean and M2 (Welford) for the re-learning
+static uint8_t n_deviations[CAN_ID_MAX_INTERNED];
+static float deviation_mean_us[CAN_ID_MAX_INTERNED];
+static float deviation_m2[CAN_ID_MAX_INTERNED];
+
+void timing_detector_init(const timing_config_t *new_config) {
+  config = *new_config;
+  memset(last_us, 0, sizeof(last_us));
+  memset(mean_us, 0, sizeof(mean_us));
+  memset(variance, 0, sizeof(variance));
+  memset(n_intervals, 0, sizeof(n_intervals));
+  memset(burst, 0, sizeof(burst));
+  memset(n_deviations, 0, sizeof(n_deviations));
+}
+
+/**
+ * @return the number of learned intervals after which an ID is enforced, 0 if IDs are never enforced
+ */
+static uint32_t samples_to_enforce() {
+  switch (config.mode) {
+  case TIMING_MODE_LEARN:
+    return 0;
+  case TIMING_MODE_ENFORCE:
+    // Two intervals are the least that give a variance
+    return 2;
+  case TIMING_MODE_AUTO:
+  default:
+    return config.learn_samples < 2 ? 2 : config.learn_samples;
+  }
+}
+
+/**
+ * Welford's online algorithm, variance holds M2 while the ID is learned
+ */
+static void learn_interval(int i, float interval) {
+  n_intervals[i]++;
+  float delta = interval - mean_us[i];
+  mean_us[i] += delta / n_intervals[i];
+  variance[i] += delta * (interval - mean_us[i]);
+
+  // From now on the ID is enforced and tracks slow drifts with an EWMA, which needs the variance instead of M2
+  if (n_intervals[i] == samples_to_enforce())
+    variance[i] = variance[i] / (n_intervals[i] - 1);
+}
+
+/**
+ * Collects a deviating interval. The intervals of a lasting new period agree with each other, once relearn_intervals of
+ * them were collected they replace the mean and variance of the ID
+ * @return true if the ID was re-learned
+ */
+static bool collect_deviation(int i, float interval, float min_variance) {
+  if (config.relearn_intervals == 0)
+    return false;
+  if (n_deviations[i] > 0) {
+    float spread = deviation_m2[i] / n_deviations[i];
+    float distance = interval - deviation_mean_us[i];
+    if (distance * distance > config.sigma * config.sigma * (spread > min_variance ? spread : min_variance))
+      n_deviations[i] = 0;
+  }
+  if (n_deviations[i] == 0) {
+    deviation_mean_us[i] = 0;
+    deviation_m2[i] = 0;
+  }
+  n_deviations[i]++;
+  float delta = interval - deviation_mean_us[i];
+  deviation_mean_us[i] += delta / n_deviations[i];
+  deviation_m2[i] += delta * (interval - deviation_mean_us[i]);
+  if (n_deviations[i] < config.relearn_intervals)
+    return false;
+
+  mean_us[i] = deviation_mean_us[i];
+  variance[i] = n_deviations[i] > 1 ? deviation_m2[i] / (n_deviations[i] - 1) : 0;
+  n_deviations[i] = 0;
+  return true;
+}
+
+timing_result_t timing_detector_update(canid_t id, long timestamp_us, long *interval_us) {
+  int i = can_id_lookup(id);
+  *interval_us = 0;
+  if (i < 0)
+    return TIMING_UNTRACKED;
+
+  long last = last_us[i];
+  last_us[i] = timestamp_us;
+  if (last == 0)
+    return TIMING_LEARNING;
+  *interval_us = timestamp_us - last;
+  float interval = *interval_us;
+
+  uint32_t required = samples_to_enforce();
+  if (required == 0 || n_intervals[i] < required) {
+    learn_interval(i, interval);
+    return TIMING_LEARNING;
+  }
+
+  if (interval < config.burst_ratio * mean_us[i]) {
+    if (burst[i] < UINT8_MAX)
+      burst[i]++;
+  } else {
+    burst[i] = 0;
+  }
+  if (burst[i] >= config.burst_frames)
+    return TIMING_BURST;
+
+  // Compared squared, so no square root is needed per frame
+  float deviation = interval - mean_us[i];
+  float bounded_variance = variance[i];
+  if (bounded_variance < config.min_stddev_us * config.min_stddev_us)
+    bounded_variance = config.min_stddev_us * config.min_stddev_us;
+  if (deviation * deviation > config.sigma * config.sigma * bounded_variance)
+    return collect_deviation(i, interval, config.min_stddev_us * config.min_stddev_us) ? TIMING_LEARNING : TIMING_DEVIATION;
+
+  n_deviations[i] = 0;
+  mean_us[i] += config.alpha * deviation;
+  variance[i] = (1 - config.alpha) * (variance[i] + config.alpha * deviation * deviation);
+  return TIMING_OK;
+}
+
+float timing_detector_mean_interval(canid_t id) {
+  int i = can_id_lookup(id);
+  return i < 0 ? 0 : mean_us[i];
+}
@@ -0,0 +1,46 @@
+#include "can_id_map.h"
+#include "tests.h"
+#include "unity_fixture.h"
+
+static void test_intern_assigns_dense_indices(void) {
+  can_id_map_reset();
+  TEST_ASSERT_EQUAL_INT(0, can_id_intern(0x43));
+  TEST_ASSERT_EQUAL_INT(1, can_id_intern(0x7FF));
+  TEST_ASSERT_EQUAL_INT(0, can_id_intern(0x43));
+  TEST_ASSERT_EQUAL_UINT(2, can_id_count());
+  TEST_ASSERT_EQUAL_HEX32(0x7FF, can_id_at(1));
+}
+
+static void test_lookup_does_not_intern(void) {
+  can_id_map_reset();
+  can_id_intern(0x100);
+  TEST_ASSERT_EQUAL_INT(0, can_id_lookup(0x100));
+  TEST_ASSERT_EQUAL_INT(-1, can_id_lookup(0x101));
+  TEST_ASSERT_EQUAL_UINT(1, can_id_count());
+}
+
+static void test_flags_of_the_id(void) {
+  can_id_map_reset();
+  can_id_intern(0x123);
+  // RTR and error flags are ignored, an extended ID is a different ID than the standard ID with the same number
+  TEST_ASSERT_EQUAL_INT(0, can_id_lookup(0x123 | CAN_RTR_FLAG));
+  TEST_ASSERT_EQUAL_INT(-1, can_id_lookup(0x123 | CAN_EFF_FLAG));
+  TEST_ASSERT_EQUAL_INT(1, can_id_intern(0x123 | CAN_EFF_FLAG));
+}
+
+static void test_map_is_bounded(void) {
+  can_id_map_reset();
+  for (int i = 0; i < CAN_ID_MAX_INTERNED; i++)
+    TEST_ASSERT_EQUAL_INT(i, can_id_intern(0x1000 + i * 7));
+  TEST_ASSERT_EQUAL_INT(-1, can_id_intern(0x42));
+  // Every interned ID is still found
+  for (int i = 0; i < CAN_ID_MAX_INTERNED; i++)
+    TEST_ASSERT_EQUAL_INT(i, can_id_lookup(0x1000 + i * 7));
+}
+
+void run_can_id_map_tests(void) {
+  RUN_TEST(test_intern_assigns_dense_indices);
+  RUN_TEST(test_lookup_does_not_intern);
+  RUN_TEST(test_flags_of_the_id);
+  RUN_TEST(test_map_is_bounded);
+}
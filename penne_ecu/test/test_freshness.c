@@ -0,0 +1,75 @@
+#include "freshness.h"
+#include "tests.h"
+#include "unity_fixture.h"
+
+// The windows are global per thread and can not be reset, so every test uses its own sender IDs
+
+static void accept(uint8_t sender, uint64_t counter) {
+  TEST_ASSERT_EQUAL_INT(0, freshness_check(sender, counter));
+  freshness_accept(sender, counter);
+}
+
+static void test_first_counter_of_a_sender_is_fresh(void) {
+  TEST_ASSERT_FALSE(freshness_known(10));
+  TEST_ASSERT_EQUAL_INT(0, freshness_check(10, 123456));
+  // A check alone does not change the window
+  TEST_ASSERT_FALSE(freshness_known(10));
+  freshness_accept(10, 123456);
+  TEST_ASSERT_TRUE(freshness_known(10));
+}
+
+static void test_replayed_counter_is_rejected(void) {
+  accept(11, 1000);
+  accept(11, 1001);
+  unsigned long rejected = freshness_rejected_count();
+  TEST_ASSERT_EQUAL_INT(-1, freshness_check(11, 1000));
+  TEST_ASSERT_EQUAL_INT(-1, freshness_check(11, 1001));
+  TEST_ASSERT_EQUAL_UINT32(rejected + 2, freshness_rejected_count());
+}
+
+static void test_out_of_order_counters_within_the_window(void) {
+  accept(12, 5000);
+  // Counters below the highest one are fresh once, as long as they are within the window
+  accept(12, 4990);
+  TEST_ASSERT_EQUAL_INT(-1, freshness_check(12, 4990));
+  accept(12, 5000 - 1);
+  TEST_ASSERT_EQUAL_INT(-1, freshness_check(12, 5000));
+}
+
+static void test_delayed_frame_behind_newer_frames(void) {
+  // The counters are microseconds, a frame that is 5 ms late arrives after the frames the sender sent in the meantime
+  uint64_t delayed = 2000000000;
+  for (int i = 1; i <= 10; i++)
+    accept(13, delayed + i * 500);
+  accept(13, delayed);
+  TEST_ASSERT_EQUAL_INT(-1, freshness_check(13, delayed));
+  // Further behind than the window, the frame is too old even though it was never received
+  TEST_ASSERT_EQUAL_INT(-1, freshness_check(13, delayed + 5000 - FRESHNESS_WINDOW_US));
+}
+
+static void test_history_bounds_late_frames(void) {
+  uint64_t start = 3000000000;
+  for (int i = 0; i < 2 * FRESHNESS_HISTORY; i++)
+    accept(16, start + i * 10);
+  // The first counters left the history, they can not be told apart from replays anymore
+  TEST_ASSERT_EQUAL_INT(-1, freshness_check(16, start));
+  TEST_ASSERT_EQUAL_INT(-1, freshness_check(16, start + 5));
+  // A counter between the remembered ones is still fresh once
+  uint64_t late = start + (2 * FRESHNESS_HISTORY - 2) * 10 + 5;
+  accept(16, late);
+  TEST_ASSERT_EQUAL_INT(-1, freshness_check(16, late));
+}
+
+static void test_senders_have_separate_windows(void) {
+  accept(14, 700);
+  TEST_ASSERT_EQUAL_INT(0, freshness_check(15, 700));
+}
+
+void run_freshness_tests(void) {
+  RUN_TEST(test_first_counter_of_a_sender_is_fresh);
+  RUN_TEST(test_replayed_counter_is_rejected);
+  RUN_TEST(test_out_of_order_counters_within_the_window);
+  RUN_TEST(test_delayed_frame_behind_newer_frames);
+  RUN_TEST(test_history_bounds_late_frames);
+  RUN_TEST(test_senders_have_separate_windows);
+}
@@ -0,0 +1,132 @@
+#include "can_db.h"
+#include "gateway_policy.h"
+#include "tests.h"
+#include "unity_fixture.h"
+
+// Any time that is not 0, a bucket that never saw a frame has a refill time of 0
+#define NOW 1000000L
+#define NOON (12 * 60)
+
+static gateway_verdict_t check(gateway_direction_id_t direction, canid_t id, long now_us) {
+  return gateway_policy_check(direction, id, NULL, 0, now_us, NOON);
+}
+
+static void load(const char *policy) {
+  // The database IDs are interned first, like in the gateway
+  can_db_init();
+  TEST_ASSERT_EQUAL_INT(0, gateway_policy_load_string(policy));
+}
+
+static void test_parser_accepts_comments_and_options(void) {
+  load("# comment\n"
+       "\n"
+       "read 0x000-0x7FF allow # trailing comment\n"
+       "write 0x43 allow rate=10/2 byte0=0xFF:0-100 max_speed=0 time=08:00-20:00\n"
+       "limit both id=50/5 total=500/50\n"
+       "both 0x1FFFFFFF deny\n");
+}
+
+static void test_parser_rejects_invalid_lines(void) {
+  const char *invalid[] = {
+      "sideways 0x43 allow\n",         // Direction
+      "read 0x43\n",                   // Action missing
+      "read 0x43 maybe\n",             // Action
+      "read 0x50-0x40 allow\n",        // Empty range
+      "read 0x20000000 allow\n",       // Longer than 29 bits
+      "read 0x43 allow rate=0\n",      // A rule rate of 0 is not allowed
+      "read 0x43 allow rate=10/0.5\n", // Burst below one frame
+      "read 0x43 allow byte64=0xFF:0-1\n",
+      "read 0x43 allow byte0=0xFF:5-1\n",
+      "read 0x43 allow time=25:00-01:00\n",
+      "read 0x43 allow color=red\n",
+      "limit sideways id=1\n",
+      "limit read speed=1\n",
+  };
+  can_db_init();
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    TEST_ASSERT_EQUAL_INT(-2, gateway_policy_load_string(invalid[i]));
+}
+
+static void test_later_rules_override_earlier_rules(void) {
+  load("read 0x000-0x7FF allow\n"
+       "read 0x1A deny\n"
+       "read 0x300-0x3FF deny\n");
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_READ, 0x19, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_DENY, check(GATEWAY_DIRECTION_READ, 0x1A, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_DENY, check(GATEWAY_DIRECTION_READ, 0x3AB, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_READ, 0x400, NOW));
+  // IDs without a rule and the other direction are denied
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_DENY, check(GATEWAY_DIRECTION_READ, 0x800, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_DENY, check(GATEWAY_DIRECTION_WRITE, 0x19, NOW));
+}
+
+static void test_conditions(void) {
+  load("write 0x43 allow byte0=0xFF:0-100 max_speed=10\n"
+       "read 0x44 allow time=22:00-06:00\n");
+  TEST_ASSERT_TRUE(gateway_policy_needs_payload(GATEWAY_DIRECTION_WRITE, 0x43));
+  TEST_ASSERT_FALSE(gateway_policy_needs_payload(GATEWAY_DIRECTION_READ, 0x44));
+
+  unsigned char valid[] = {100}, invalid[] = {101};
+  atomic_store(&gateway_state.speed_kph, 0);
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, gateway_policy_check(GATEWAY_DIRECTION_WRITE, 0x43, valid, 1, NOW, NOON));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_CONDITION_FAILED, gateway_policy_check(GATEWAY_DIRECTION_WRITE, 0x43, invalid, 1, NOW, NOON));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_CONDITION_FAILED, gateway_policy_check(GATEWAY_DIRECTION_WRITE, 0x43, NULL, 0, NOW, NOON));
+  atomic_store(&gateway_state.speed_kph, 11);
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_CONDITION_FAILED, gateway_policy_check(GATEWAY_DIRECTION_WRITE, 0x43, valid, 1, NOW, NOON));
+  atomic_store(&gateway_state.speed_kph, 0);
+
+  // The time window wraps around midnight
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, gateway_policy_check(GATEWAY_DIRECTION_READ, 0x44, NULL, 0, NOW, 23 * 60));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, gateway_policy_check(GATEWAY_DIRECTION_READ, 0x44, NULL, 0, NOW, 5 * 60));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_CONDITION_FAILED, gateway_policy_check(GATEWAY_DIRECTION_READ, 0x44, NULL, 0, NOW, NOON));
+}
+
+static void test_token_bucket_of_an_id(void) {
+  load("read 0x43 allow rate=10/2\n");
+  // The bucket starts full with the burst, afterwards it refills with 10 frames per second
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_READ, 0x43, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_READ, 0x43, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_RATE_LIMITED, check(GATEWAY_DIRECTION_READ, 0x43, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_RATE_LIMITED, check(GATEWAY_DIRECTION_READ, 0x43, NOW + 50000));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_READ, 0x43, NOW + 100000));
+}
+
+static void test_ids_of_a_range_have_their_own_buckets(void) {
+  load("read 0x600-0x6FF allow rate=10/2\n");
+  for (int i = 0; i < 10; i++)
+    check(GATEWAY_DIRECTION_READ, 0x610, NOW);
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_RATE_LIMITED, check(GATEWAY_DIRECTION_READ, 0x610, NOW));
+  // A flooding ID does not use up the rate of the other IDs of the range
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_READ, 0x620, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_READ, 0x620, NOW));
+}
+
+static void test_total_limit_of_a_direction(void) {
+  load("limit read id=0 total=5/5\n"
+       "both 0x000-0x7FF allow\n");
+  for (canid_t id = 0x100; id < 0x105; id++)
+    TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_READ, id, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_RATE_LIMITED, check(GATEWAY_DIRECTION_READ, 0x105, NOW));
+  // The other direction keeps its default limits
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_WRITE, 0x105, NOW));
+}
+
+static void test_whitelist(void) {
+  const canid_t read_ids[] = {0x43, 0x44};
+  can_db_init();
+  gateway_policy_load_whitelist(read_ids, 2, NULL, 0);
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_ALLOW, check(GATEWAY_DIRECTION_READ, 0x44, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_DENY, check(GATEWAY_DIRECTION_READ, 0x45, NOW));
+  TEST_ASSERT_EQUAL_INT(GATEWAY_POLICY_DENY, check(GATEWAY_DIRECTION_WRITE, 0x43, NOW));
+}
+
+void run_gateway_policy_tests(void) {
+  RUN_TEST(test_parser_accepts_comments_and_options);
+  RUN_TEST(test_parser_rejects_invalid_lines);
+  RUN_TEST(test_later_rules_override_earlier_rules);
+  RUN_TEST(test_conditions);
+  RUN_TEST(test_token_bucket_of_an_id);
+  RUN_TEST(test_ids_of_a_range_have_their_own_buckets);
+  RUN_TEST(test_total_limit_of_a_direction);
+  RUN_TEST(test_whitelist);
+}
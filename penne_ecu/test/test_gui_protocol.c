@@ -0,0 +1,109 @@
+#include "gui_protocol.h"
+#include "tests.h"
+#include "unity_fixture.h"
+#include <string.h>
+#include <unistd.h>
+
+static int received_fields[4][2];
+static int n_received_fields;
+
+static void collect_field(int field, int value) {
+  received_fields[n_received_fields][0] = field;
+  received_fields[n_received_fields][1] = value;
+  n_received_fields++;
+}
+
+/**
+ * Sends a message through a pipe, so the test sees exactly the bytes that would be written to the serial port
+ * @return the length of the frame
+ */
+static size_t send_to_buffer(gui_message_t *msg, uint8_t *frame, size_t size) {
+  int pipe_fds[2];
+  TEST_ASSERT_EQUAL_INT(0, pipe(pipe_fds));
+  TEST_ASSERT_EQUAL_INT(0, gui_message_send(msg, pipe_fds[1]));
+  ssize_t len = read(pipe_fds[0], frame, size);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  TEST_ASSERT_TRUE(len > 0);
+  return len;
+}
+
+static size_t build_command(uint8_t *frame, size_t size) {
+  gui_protocol = GUI_PROTOCOL_BINARY;
+  gui_transport = GUI_TRANSPORT_SERIAL;
+  gui_message_t msg;
+  gui_message_begin(&msg, GUI_FRAME_COMMAND);
+  TEST_ASSERT_EQUAL_INT(0, gui_message_add_field(&msg, 0x00, 100));
+  TEST_ASSERT_EQUAL_INT(0, gui_message_add_field(&msg, 0x11, 0x12345678));
+  return send_to_buffer(&msg, frame, size);
+}
+
+static void test_crc16_check_value(void) {
+  // Check value of CRC-16/CCITT-FALSE
+  TEST_ASSERT_EQUAL_HEX16(0x29B1, gui_crc16((const uint8_t *)"123456789", 9));
+  TEST_ASSERT_EQUAL_HEX16(0xFFFF, gui_crc16(NULL, 0));
+}
+
+static void test_frame_round_trip(void) {
+  uint8_t frame[64];
+  size_t len = build_command(frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_UINT(GUI_FRAME_HEADER_LEN + 2 * GUI_FIELD_LEN + GUI_FRAME_CRC_LEN, len);
+  TEST_ASSERT_EQUAL_HEX8(GUI_FRAME_SYNC, frame[0]);
+  TEST_ASSERT_EQUAL_HEX8(GUI_FRAME_COMMAND, frame[2]);
+
+  size_t frame_len = 0;
+  TEST_ASSERT_EQUAL_INT(1, gui_frame_check(frame, len, &frame_len));
+  TEST_ASSERT_EQUAL_UINT(len, frame_len);
+  n_received_fields = 0;
+  TEST_ASSERT_EQUAL_INT(2, gui_frame_for_each_field(frame, collect_field));
+  TEST_ASSERT_EQUAL_INT(0x00, received_fields[0][0]);
+  TEST_ASSERT_EQUAL_INT(100, received_fields[0][1]);
+  TEST_ASSERT_EQUAL_INT(0x11, received_fields[1][0]);
+  TEST_ASSERT_EQUAL_INT(0x12345678, received_fields[1][1]);
+}
+
+static void test_frame_check_waits_for_incomplete_frames(void) {
+  uint8_t frame[64];
+  size_t len = build_command(frame, sizeof(frame));
+  size_t frame_len = 0;
+  for (size_t prefix = 0; prefix < len; prefix++)
+    TEST_ASSERT_EQUAL_INT(0, gui_frame_check(frame, prefix, &frame_len));
+}
+
+static void test_frame_check_rejects_corrupted_frames(void) {
+  uint8_t frame[64];
+  size_t len = build_command(frame, sizeof(frame));
+  size_t frame_len = 0;
+  // Every flipped bit after the sync byte is found by the version check or the CRC
+  for (size_t i = 1; i < len; i++) {
+    for (int bit = 0; bit < 8; bit++) {
+      uint8_t corrupted[64];
+      memcpy(corrupted, frame, len);
+      corrupted[i] ^= 1 << bit;
+      // A corrupted length may make the frame look incomplete, it must never look valid
+      TEST_ASSERT_NOT_EQUAL(1, gui_frame_check(corrupted, len, &frame_len));
+    }
+  }
+}
+
+static void test_text_message(void) {
+  gui_protocol = GUI_PROTOCOL_TEXT;
+  gui_transport = GUI_TRANSPORT_SERIAL;
+  gui_message_t msg;
+  gui_message_begin(&msg, GUI_FRAME_ECU_DATA);
+  gui_message_add_field(&msg, 0x02, 0x1A);
+  gui_message_add_field(&msg, 0x10, 0);
+  uint8_t text[64] = {0};
+  size_t len = send_to_buffer(&msg, text, sizeof(text) - 1);
+  TEST_ASSERT_EQUAL_UINT(strlen("EXU 021a 100\n"), len);
+  TEST_ASSERT_EQUAL_STRING("EXU 021a 100\n", (const char *)text);
+  gui_protocol = GUI_PROTOCOL_BINARY;
+}
+
+void run_gui_protocol_tests(void) {
+  RUN_TEST(test_crc16_check_value);
+  RUN_TEST(test_frame_round_trip);
+  RUN_TEST(test_frame_check_waits_for_incomplete_frames);
+  RUN_TEST(test_frame_check_rejects_corrupted_frames);
+  RUN_TEST(test_text_message);
+}
@@ -0,0 +1,92 @@
+#include "ecu.h"
+#include "helpers.h"
+#include "tests.h"
+#include "unity_fixture.h"
+#include <string.h>
+
+/**
+ * Decodes the digits at the start of a buffer with padding, hex_decode(...) always loads 8 bytes
+ */
+static int decode(const char *digits, size_t n_digits, uint32_t *value) {
+  char buffer[16];
+  memset(buffer, 'X', sizeof(buffer));
+  memcpy(buffer, digits, n_digits);
+  return hex_decode(buffer, n_digits, value);
+}
+
+static void test_hex_decode_all_lengths(void) {
+  const char *digits = "12345678";
+  const uint32_t expected[] = {0x1, 0x12, 0x123, 0x1234, 0x12345, 0x123456, 0x1234567, 0x12345678};
+  for (size_t n = 1; n <= 8; n++) {
+    uint32_t value = 0;
+    TEST_ASSERT_EQUAL_INT(0, decode(digits, n, &value));
+    TEST_ASSERT_EQUAL_HEX32(expected[n - 1], value);
+  }
+}
+
+static void test_hex_decode_mixed_case(void) {
+  uint32_t value = 0;
+  TEST_ASSERT_EQUAL_INT(0, decode("aBcDeF09", 8, &value));
+  TEST_ASSERT_EQUAL_HEX32(0xABCDEF09, value);
+  TEST_ASSERT_EQUAL_INT(0, decode("ffffffff", 8, &value));
+  TEST_ASSERT_EQUAL_HEX32(0xFFFFFFFF, value);
+  TEST_ASSERT_EQUAL_INT(0, decode("0", 1, &value));
+  TEST_ASSERT_EQUAL_HEX32(0, value);
+}
+
+static void test_hex_decode_ignores_bytes_after_the_digits(void) {
+  // The bytes after the digits are loaded but must not change the value or make it invalid
+  char buffer[16] = "7fG\xff zz";
+  uint32_t value = 0;
+  TEST_ASSERT_EQUAL_INT(0, hex_decode(buffer, 2, &value));
+  TEST_ASSERT_EQUAL_HEX32(0x7F, value);
+}
+
+static void test_hex_decode_rejects_invalid_digits(void) {
+  // The neighbours of the valid ranges ('/' ':' '@' 'G' '`' 'g'), a space and a byte with the high bit set
+  const char *invalid[] = {"/", ":", "@", "G", "`", "g", " ", "\x80", "1234567g", "x1"};
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    uint32_t value = 0;
+    TEST_ASSERT_EQUAL_INT(-1, decode(invalid[i], strlen(invalid[i]), &value));
+  }
+}
+
+static void test_hex_decode_rejects_invalid_lengths(void) {
+  uint32_t value = 0;
+  TEST_ASSERT_EQUAL_INT(-1, decode("1", 0, &value));
+  TEST_ASSERT_EQUAL_INT(-1, decode("123456789", 9, &value));
+}
+
+static void test_ecu_input_update_applies_all_fields(void) {
+  ecu_number = CHASSIS;
+  ecu_data.brake_value = 0;
+  ecu_data.accelerator_value = 0;
+  const char cmd[32] = " 0014 01a2";
+  TEST_ASSERT_EQUAL_INT(2, ecu_input_update(cmd, strlen(cmd)));
+  TEST_ASSERT_EQUAL_INT(0x14, ecu_data.brake_value);
+  TEST_ASSERT_EQUAL_INT(0xA2, ecu_data.accelerator_value);
+}
+
+static void test_ecu_input_update_is_all_or_nothing(void) {
+  ecu_number = CHASSIS;
+  ecu_data.brake_value = 1;
+  ecu_data.accelerator_value = 2;
+  // The second field is malformed, so the first one must not be applied either
+  const char cmd[32] = " 0050 01zz";
+  TEST_ASSERT_EQUAL_INT(-1, ecu_input_update(cmd, strlen(cmd)));
+  TEST_ASSERT_EQUAL_INT(1, ecu_data.brake_value);
+  TEST_ASSERT_EQUAL_INT(2, ecu_data.accelerator_value);
+  // An ID without a value is malformed as well
+  const char short_field[32] = " 00";
+  TEST_ASSERT_EQUAL_INT(-1, ecu_input_update(short_field, strlen(short_field)));
+}
+
+void run_hex_decode_tests(void) {
+  RUN_TEST(test_hex_decode_all_lengths);
+  RUN_TEST(test_hex_decode_mixed_case);
+  RUN_TEST(test_hex_decode_ignores_bytes_after_the_digits);
+  RUN_TEST(test_hex_decode_rejects_invalid_digits);
+  RUN_TEST(test_hex_decode_rejects_invalid_lengths);
+  RUN_TEST(test_ecu_input_update_applies_all_fields);
+  RUN_TEST(test_ecu_input_update_is_all_or_nothing);
+}
@@ -0,0 +1,92 @@
+#include "can_db.h"
+#include "payload_detector.h"
+#include "tests.h"
+#include "unity_fixture.h"
+#include <string.h>
+
+static long now_us;
+
+static const can_db_msg_t *engine_rpm_msg;
+static const can_db_msg_t *shift_position_msg;
+static payload_violation_t violations[PAYLOAD_MAX_VIOLATIONS];
+
+static void start_payload() {
+  can_db_init();
+  payload_detector_init();
+  engine_rpm_msg = can_db_lookup(ENGINE_RPM_MSG);
+  shift_position_msg = can_db_lookup(SHIFT_POSITION_MSG);
+  memset(&ecu_data, 0, sizeof(ecu_data));
+  ecu_data.shift_position = 'D';
+  now_us = 1000000;
+  payload_detector_check_frame(shift_position_msg, &ecu_data, now_us, violations, PAYLOAD_MAX_VIOLATIONS);
+}
+
+static int rpm_frame(int rpm, int speed, long time_us) {
+  ecu_data.engine_rpm = rpm;
+  ecu_data.speed_kph = speed;
+  return payload_detector_check_frame(engine_rpm_msg, &ecu_data, time_us, violations, PAYLOAD_MAX_VIOLATIONS);
+}
+
+static void test_payload_accepts_the_simulation(void) {
+  start_payload();
+  // Full throttle, then a shift up (RPM to 5000) and a shift down (RPM to 50000)
+  int rpm = 1000;
+  for (int i = 0; i < 100; i++) {
+    now_us += 20000;
+    rpm += 100;
+    TEST_ASSERT_EQUAL_INT(0, rpm_frame(rpm, 40, now_us));
+  }
+  TEST_ASSERT_EQUAL_INT(0, rpm_frame(5000, 40, now_us += 20000));
+  TEST_ASSERT_EQUAL_INT(0, rpm_frame(50000, 40, now_us += 20000));
+}
+
+static void test_payload_reports_every_forged_frame(void) {
+  start_payload();
+  // The attack sends 0xFF00 between the frames of the powertrain, every forged frame is reported
+  for (int i = 0; i < 50; i++) {
+    now_us += 10000;
+    TEST_ASSERT_EQUAL_INT(0, rpm_frame(60000 + i * 10, 40, now_us));
+    TEST_ASSERT_EQUAL_INT(1, rpm_frame(0xFF00, 40, now_us + 500));
+    TEST_ASSERT_EQUAL_INT(PAYLOAD_RATE_OF_CHANGE, violations[0].kind);
+    TEST_ASSERT_EQUAL_INT(ENGINE_RPM, violations[0].id);
+  }
+}
+
+static void test_payload_range_violation(void) {
+  start_payload();
+  // The speed has a range of 0-255, the rate of change is checked against the last accepted value
+  TEST_ASSERT_EQUAL_INT(0, rpm_frame(1000, 200, now_us));
+  TEST_ASSERT_EQUAL_INT(1, rpm_frame(1000, 300, now_us + 10000));
+  TEST_ASSERT_EQUAL_INT(PAYLOAD_RANGE, violations[0].kind);
+  TEST_ASSERT_EQUAL_INT(SPEED_KPH, payload_detector_active_violation());
+  rpm_frame(1000, 200, now_us + 20000);
+  TEST_ASSERT_EQUAL_INT(NONE, payload_detector_active_violation());
+}
+
+static void test_payload_parking_while_moving(void) {
+  start_payload();
+  rpm_frame(3000, 200, now_us);
+  ecu_data.shift_position = 'P';
+  TEST_ASSERT_EQUAL_INT(0, payload_detector_check_frame(shift_position_msg, &ecu_data, now_us, violations, PAYLOAD_MAX_VIOLATIONS));
+  // The car stops within the grace period, the speed halves per simulation step
+  for (int speed = 100; speed > 0; speed /= 2)
+    TEST_ASSERT_EQUAL_INT(0, rpm_frame(3000, speed, now_us += 20000));
+  TEST_ASSERT_EQUAL_INT(0, rpm_frame(3000, 0, now_us += 20000));
+  TEST_ASSERT_EQUAL_INT(NONE, payload_detector_active_violation());
+
+  // A speed that stays in P is reported once the grace period is over
+  rpm_frame(3000, 50, now_us += 20000);
+  int n_violations = 0;
+  for (int i = 0; i < 30; i++)
+    n_violations += rpm_frame(3000, 50, now_us += 10000);
+  TEST_ASSERT_EQUAL_INT(1, n_violations);
+  TEST_ASSERT_EQUAL_INT(PAYLOAD_INVARIANT, violations[0].kind);
+  TEST_ASSERT_EQUAL_INT(SPEED_KPH, payload_detector_active_violation());
+}
+
+void run_payload_detector_tests(void) {
+  RUN_TEST(test_payload_accepts_the_simulation);
+  RUN_TEST(test_payload_reports_every_forged_frame);
+  RUN_TEST(test_payload_range_violation);
+  RUN_TEST(test_payload_parking_while_moving);
+}
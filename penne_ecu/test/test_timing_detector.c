@@ -0,0 +1,77 @@
+#include "can_id_map.h"
+#include "tests.h"
+#include "timing_detector.h"
+#include "unity_fixture.h"
+
+#define TEST_ID 0x43
+#define PERIOD_US 10000L
+
+static long now_us;
+
+static void start_timing(uint32_t learn_samples) {
+  can_id_map_reset();
+  can_id_intern(TEST_ID);
+  timing_config_t config = TIMING_DEFAULT_CONFIG;
+  config.learn_samples = learn_samples;
+  timing_detector_init(&config);
+  now_us = 1000000;
+}
+
+static timing_result_t frame_after(long interval_us) {
+  long interval;
+  now_us += interval_us;
+  return timing_detector_update(TEST_ID, now_us, &interval);
+}
+
+static void test_timing_learns_then_enforces(void) {
+  start_timing(20);
+  TEST_ASSERT_EQUAL_INT(TIMING_LEARNING, frame_after(0));
+  for (int i = 0; i < 20; i++)
+    TEST_ASSERT_EQUAL_INT(TIMING_LEARNING, frame_after(PERIOD_US + (i % 3) * 100));
+  TEST_ASSERT_EQUAL_INT(TIMING_OK, frame_after(PERIOD_US));
+  TEST_ASSERT_FLOAT_WITHIN(200, PERIOD_US, timing_detector_mean_interval(TEST_ID));
+  // 4 sigma with a standard deviation of at least 1 ms
+  TEST_ASSERT_EQUAL_INT(TIMING_DEVIATION, frame_after(PERIOD_US + 5000));
+  TEST_ASSERT_EQUAL_INT(TIMING_UNTRACKED, timing_detector_update(0x44, now_us, &(long){0}));
+}
+
+static void test_timing_reports_bursts(void) {
+  start_timing(20);
+  for (int i = 0; i <= 20; i++)
+    frame_after(PERIOD_US);
+  TEST_ASSERT_EQUAL_INT(TIMING_DEVIATION, frame_after(1000));
+  TEST_ASSERT_EQUAL_INT(TIMING_DEVIATION, frame_after(1000));
+  TEST_ASSERT_EQUAL_INT(TIMING_BURST, frame_after(1000));
+  // The flood did not shift the learned period
+  TEST_ASSERT_FLOAT_WITHIN(200, PERIOD_US, timing_detector_mean_interval(TEST_ID));
+}
+
+static void test_timing_relearns_a_lasting_period_change(void) {
+  start_timing(20);
+  for (int i = 0; i <= 20; i++)
+    frame_after(PERIOD_US);
+  timing_config_t config = TIMING_DEFAULT_CONFIG;
+  for (int i = 0; i < config.relearn_intervals - 1; i++)
+    TEST_ASSERT_EQUAL_INT(TIMING_DEVIATION, frame_after(2 * PERIOD_US + (i % 2) * 100));
+  TEST_ASSERT_EQUAL_INT(TIMING_LEARNING, frame_after(2 * PERIOD_US));
+  TEST_ASSERT_FLOAT_WITHIN(200, 2 * PERIOD_US, timing_detector_mean_interval(TEST_ID));
+  TEST_ASSERT_EQUAL_INT(TIMING_OK, frame_after(2 * PERIOD_US));
+}
+
+static void test_timing_does_not_relearn_irregular_gaps(void) {
+  start_timing(20);
+  for (int i = 0; i <= 20; i++)
+    frame_after(PERIOD_US);
+  timing_config_t config = TIMING_DEFAULT_CONFIG;
+  // The gaps deviate, but not consistently, so the period is never replaced
+  for (int i = 0; i < 4 * config.relearn_intervals; i++)
+    TEST_ASSERT_EQUAL_INT(TIMING_DEVIATION, frame_after(i % 2 ? 3 * PERIOD_US : 6 * PERIOD_US));
+  TEST_ASSERT_FLOAT_WITHIN(200, PERIOD_US, timing_detector_mean_interval(TEST_ID));
+}
+
+void run_timing_detector_tests(void) {
+  RUN_TEST(test_timing_learns_then_enforces);
+  RUN_TEST(test_timing_reports_bursts);
+  RUN_TEST(test_timing_relearns_a_lasting_period_change);
+  RUN_TEST(test_timing_does_not_relearn_irregular_gaps);
+}
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "tests.h"
 #include "unity_fixture.h"
 
 void test_dummy(void) { TEST_ASSERT_EQUAL_INT(1, 1); }
@@ -34,5 +35,12 @@ void test_dummy(void) { TEST_ASSERT_EQUAL_INT(1, 1); }
 int main(void) {
   UNITY_BEGIN();
   RUN_TEST(test_dummy);
+  run_freshness_tests();
+  run_gateway_policy_tests();
+  run_timing_detector_tests();
+  run_payload_detector_tests();
+  run_can_id_map_tests();
+  run_gui_protocol_tests();
+  run_hex_decode_tests();
   return UNITY_END();
 }
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef PENNE_TESTS_H
+#define PENNE_TESTS_H
+
+// Every test file runs its tests with RUN_TEST(...) from one of these functions, they are called by main() in tests.c
+
+void run_freshness_tests(void);
+void run_gateway_policy_tests(void);
+void run_timing_detector_tests(void);
+void run_payload_detector_tests(void);
+void run_can_id_map_tests(void);
+void run_gui_protocol_tests(void);
+void run_hex_decode_tests(void);
+
+#endif // PENNE_TESTS_H
@@ -1,4 +1,5 @@
-from dataclasses import dataclass
+from collections import deque
+from dataclasses import dataclass, field
 from enum import Enum
 
 
@@ -13,6 +14,17 @@ class GatewayCode(Enum):
     OK = 0
     R_BLOCKED = 1
     W_BLOCKED = 2
+    R_RATE_LIMITED = 3
+    W_RATE_LIMITED = 4
+
+
+@dataclass
+class ObserverEvent:
+    timestamp_ms: int
+    can_id: int
+    signal: int
+    code: ObserverCode
+    value: int
 
 
 @dataclass
@@ -62,5 +74,10 @@ class Car:
     door_lock_indicator: int = 0
     observer_id: int = 0
     observer_code: ObserverCode = ObserverCode.OK
+    observer_events: deque = field(default_factory=lambda: deque(maxlen=100))
+    observer_event_count: int = 0
+    observer_events_dropped: int = 0
     gateway_id: int = 0
     gateway_code: GatewayCode = GatewayCode.OK
+    gateway_read_dropped: int = 0
+    gateway_write_dropped: int = 0
@@ -1,5 +1,10 @@
+import binascii
+import mmap
+import os
+import struct
 import threading
 import time
+from dataclasses import dataclass, field
 from threading import Thread
 
 import pygame
@@ -19,6 +24,105 @@ BODY_RECEIVED = pygame.USEREVENT + BODY
 OBSERVER_RECEIVED = pygame.USEREVENT + OBSERVER
 GATEWAY_RECEIVED = pygame.USEREVENT + GATEWAY
 
+# Binary frames, see penne_ecu/include/gui_protocol.h:
+# sync | version | type | payload length | payload | CRC-16/CCITT-FALSE (little-endian) over version..payload
+FRAME_SYNC = 0xA5
+FRAME_VERSION = 1
+FRAME_ECU_DATA = 1
+FRAME_COMMAND = 2
+FRAME_OBSERVER_EVENTS = 3
+FRAME_HEADER_LEN = 4
+FRAME_CRC_LEN = 2
+FIELD = struct.Struct("<BI")
+EVENT = struct.Struct("<QIBBI")
+DROPPED = struct.Struct("<I")
+
+# The text protocol ("EXD"/"EXU"/"EVT" lines with hex values) is the fallback, the ECUs are then started with "text"
+USE_BINARY_PROTOCOL = True
+
+# The ECUs publish their state in shared memory instead of a socat pty, see penne_ecu/include/shm_export.h
+USE_SHARED_MEMORY = False
+SHM_PORT = "shm"
+SHM_MAGIC = 0x454E4E50
+SHM_VERSION = 1
+SHM_MAX_FIELDS = 32
+SHM_MAX_EVENTS = 64
+# magic, version, ecu_type, sequence, update_count, timestamp_ms, field_mask, fields, events_dropped, event_head
+SHM_STATE = struct.Struct(f"<IIIIQQI{SHM_MAX_FIELDS}III")
+SHM_SEQUENCE_OFFSET = 12
+SHM_EVENTS_OFFSET = 176
+SHM_EVENT = struct.Struct("<QIBBHII")
+SHM_COMMAND_SEQUENCE_OFFSET = SHM_EVENTS_OFFSET + SHM_MAX_EVENTS * SHM_EVENT.size
+SHM_COMMANDS = struct.Struct(f"<I{SHM_MAX_FIELDS}I")
+SHM_SIZE = SHM_COMMAND_SEQUENCE_OFFSET + 4 + SHM_COMMANDS.size
+U32 = struct.Struct("<I")
+
+
+@dataclass
+class EcuMessage:
+    kind: str  # "EXU" for ECU data, "EVT" for observer events
+    fields: dict = field(default_factory=dict)  # EXU: field ID -> value
+    dropped: int = 0  # EVT: total number of events the observer dropped
+    events: list = field(default_factory=list)  # EVT: (timestamp_ms, can_id, signal, code, value) tuples
+
+
+def encode_frame(frame_type: int, payload: bytes) -> bytes:
+    body = bytes([FRAME_VERSION, frame_type, len(payload)]) + payload
+    return bytes([FRAME_SYNC]) + body + struct.pack("<H", binascii.crc_hqx(body, 0xFFFF))
+
+
+def decode_frame(frame: bytes):
+    payload = frame[FRAME_HEADER_LEN:-FRAME_CRC_LEN]
+    if frame[2] == FRAME_ECU_DATA:
+        return EcuMessage("EXU", fields=dict(FIELD.iter_unpack(payload)))
+    if frame[2] == FRAME_OBSERVER_EVENTS:
+        events = list(EVENT.iter_unpack(payload[DROPPED.size:]))
+        return EcuMessage("EVT", dropped=DROPPED.unpack_from(payload)[0], events=events)
+    return None
+
+
+def decode_text(line: str):
+    parts = line.strip().split(" ")
+    if parts[0] == "EXU":
+        return EcuMessage("EXU", fields={int(part[0:2], 16): int(part[2:], 16) for part in parts[1:] if len(part) > 2})
+    if parts[0] == "EVT" and len(parts) > 1:
+        events = [tuple(int(value, 16) for value in part.split(":")) for part in parts[2:]]
+        return EcuMessage("EVT", dropped=int(parts[1], 16), events=[event for event in events if len(event) == 5])
+    return None
+
+
+def split_messages(buffer: bytearray) -> list:
+    """Removes all complete frames and lines from the buffer and returns them decoded"""
+    messages = []
+    while buffer:
+        if buffer[0] == FRAME_SYNC:
+            if len(buffer) < FRAME_HEADER_LEN:
+                break
+            frame_len = FRAME_HEADER_LEN + buffer[3] + FRAME_CRC_LEN
+            if buffer[1] != FRAME_VERSION:
+                # Not the start of a frame, resynchronize on the next byte
+                del buffer[0]
+                continue
+            if len(buffer) < frame_len:
+                break
+            frame = bytes(buffer[:frame_len])
+            crc = struct.unpack_from("<H", frame, frame_len - FRAME_CRC_LEN)[0]
+            if binascii.crc_hqx(frame[1:-FRAME_CRC_LEN], 0xFFFF) != crc:
+                del buffer[0]
+                continue
+            del buffer[:frame_len]
+            message = decode_frame(frame)
+        else:
+            end = buffer.find(b'\n')
+            if end < 0:
+                break
+            line = buffer[:end].decode("utf-8", errors="replace")
+            del buffer[:end + 1]
+            message = decode_text(line)
+        if message is not None:
+            messages.append(message)
+    return messages
+
 
 class Sender:
     def __init__(self, pts, name):
@@ -35,10 +139,15 @@ class Sender:
         while not self.stopped.is_set():
             time.sleep(0.01)
 
-    def send_command(self, msg):
-        msg = "EXD" + msg + '\r'
+    def send_command(self, fields):
+        # fields are (field ID, value) tuples, all of them are sent in one message
+        if USE_BINARY_PROTOCOL:
+            payload = b"".join(FIELD.pack(field_id, value & 0xFFFFFFFF) for field_id, value in fields)
+            msg = encode_frame(FRAME_COMMAND, payload)
+        else:
+            msg = ("EXD" + "".join(f" {field_id:02X}{value:X}" for field_id, value in fields) + '\r').encode()
         # logging.info("%s sending: %s", self.name, str(msg))
-        self.ser.write(msg.encode())
+        self.ser.write(msg)
 
 
 class Receiver:
@@ -55,23 +164,110 @@ class Receiver:
         self.thread = Thread(target=self.run)
 
     def run(self):
+        buffer = bytearray()
         while not self.stopped.is_set():
-            rec = ''
-            counter = 0
-            while not self.stopped.is_set():
-                temp = self.ser.read()
-                if temp == b'\n':
-                    if counter == 0:
-                        counter = 1
-                    else:
-                        break
-                else:
-                    rec += temp.decode("utf-8")
-            if not self.stopped.is_set():
+            # Everything that arrived is read at once, the observer interleaves ECU data and event messages
+            data = self.ser.read(max(1, self.ser.in_waiting))
+            if not data or self.stopped.is_set():
+                continue
+            buffer += data
+            for message in split_messages(buffer):
                 recv_event = pygame.event.Event(
-                    pygame.USEREVENT + self.ecu_type, message=rec)
+                    pygame.USEREVENT + self.ecu_type, message=message)
                 try:
                     pygame.event.post(recv_event)
                 except Exception:
                     # logging.info(f"{self.name} can't post event, maybe game was closed")
                     pass
+
+
+class SharedState:
+    """Reads the state that an ECU publishes in shared memory, once per rendered frame instead of a thread per ECU"""
+
+    def __init__(self, name, ecu_type, sends_commands=False):
+        self.name = name
+        self.ecu_type = ecu_type
+        self.path = "/dev/shm/penne_" + name
+        self.mm = None
+        self.last_update = 0
+        self.event_head = 0
+        self.events_lost = 0
+        logging.info("Reading %s from %s", self.name, self.path)
+        pub.subscribe(self.poll, "frame")
+        if sends_commands:
+            pub.subscribe(self.send_command, name)
+
+    def open(self):
+        # The ECU creates the segment after it was started, until then there is nothing to read
+        if self.mm is None and os.path.exists(self.path):
+            fd = os.open(self.path, os.O_RDWR)
+            try:
+                self.mm = mmap.mmap(fd, SHM_SIZE)
+            finally:
+                os.close(fd)
+        return self.mm is not None
+
+    def close(self):
+        if self.mm is not None:
+            self.mm.close()
+            self.mm = None
+        # The ECU is killed, so it can not remove its segment itself
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+
+    def snapshot(self):
+        # Seqlock: the copy is consistent if the sequence was even and did not change while copying
+        for _ in range(3):
+            sequence = U32.unpack_from(self.mm, SHM_SEQUENCE_OFFSET)[0]
+            if sequence & 1:
+                continue
+            data = self.mm[:SHM_COMMAND_SEQUENCE_OFFSET]
+            if U32.unpack_from(self.mm, SHM_SEQUENCE_OFFSET)[0] == sequence:
+                return data
+        # The ECU is writing, the next frame gets the snapshot
+        return None
+
+    def poll(self):
+        if not self.open():
+            return
+        data = self.snapshot()
+        if data is None:
+            return
+        state = SHM_STATE.unpack_from(data)
+        magic, version, update_count, field_mask = state[0], state[1], state[4], state[6]
+        fields = state[7:7 + SHM_MAX_FIELDS]
+        dropped, event_head = state[7 + SHM_MAX_FIELDS:]
+        if magic != SHM_MAGIC or version != SHM_VERSION or update_count == self.last_update:
+            return
+        self.last_update = update_count
+
+        messages = [EcuMessage("EXU", fields={i: fields[i] for i in range(SHM_MAX_FIELDS) if field_mask >> i & 1})]
+        if event_head != self.event_head:
+            # Events that were overwritten before this frame are counted as dropped
+            first = max(self.event_head, event_head - SHM_MAX_EVENTS)
+            self.events_lost += first - self.event_head
+            events = []
+            for index in range(first, event_head):
+                event = SHM_EVENT.unpack_from(data, SHM_EVENTS_OFFSET + (index % SHM_MAX_EVENTS) * SHM_EVENT.size)
+                events.append((event[0], event[1], event[2], event[3], event[5]))
+            messages.append(EcuMessage("EVT", dropped=dropped + self.events_lost, events=events))
+            self.event_head = event_head
+        for message in messages:
+            try:
+                pygame.event.post(pygame.event.Event(pygame.USEREVENT + self.ecu_type, message=message))
+            except Exception:
+                pass
+
+    def send_command(self, fields):
+        if not self.open():
+            return
+        mask = 0
+        commands = [0] * SHM_MAX_FIELDS
+        for field_id, value in fields:
+            mask |= 1 << field_id
+            commands[field_id] = value & 0xFFFFFFFF
+        # The GUI is the only writer of the commands, the ECU skips them while the sequence is odd
+        sequence = U32.unpack_from(self.mm, SHM_COMMAND_SEQUENCE_OFFSET)[0]
+        U32.pack_into(self.mm, SHM_COMMAND_SEQUENCE_OFFSET, (sequence + 1) & 0xFFFFFFFF)
+        SHM_COMMANDS.pack_into(self.mm, SHM_COMMAND_SEQUENCE_OFFSET + 4, mask, *commands)
+        U32.pack_into(self.mm, SHM_COMMAND_SEQUENCE_OFFSET, (sequence + 2) & 0xFFFFFFFF)
@@ -8,6 +8,7 @@ from constants import get_asset_path
 from simulator import simulate
 import time
 from car import *
+from ecu import EcuMessage
 from setup_panel import MitigationType
 
 # Create custom events that can be used for callbacks when a message is received from the ECUs
@@ -336,27 +337,29 @@ class GUI:
 
     def send_serial_update(self):
         # Chassis
-        msg = f" 00{self.car.brake_value:X}" \
-              f" 01{self.car.accelerator_value:X}" \
-              f" 02{self.car.steering_value:X}" \
-              f" 03{ord(self.car.shift_value):X}" \
-              f" 04{self.car.turn_switch_value:X}" \
-              f" 05{self.car.horn_value:X}" \
-              f" 06{self.car.light_switch_value:X}" \
-              f" 07{self.car.light_flash_value:X}" \
-              f" 08{self.car.parking_value:X}" \
-              f" 09{self.car.wiper_f_sw_value:X}" \
-              f" 0A{self.car.wiper_r_sw_value:X}" \
-              f" 0B{self.car.door_lock_value:X}" \
-              f" 0C{self.car.l_door_handle_value:X}" \
-              f" 0D{self.car.r_door_handle_value:X}" \
-              f" 0E{self.car.l_window_switch_value:X}" \
-              f" 0F{self.car.r_window_switch_value:X}" \
-              f" 10{self.car.hazard_value:X}" \
-              f" 11{self.car.engine_value:X}"
-        pub.sendMessage("chassis", msg=msg)
+        fields = [(0x00, self.car.brake_value),
+                  (0x01, self.car.accelerator_value),
+                  (0x02, self.car.steering_value),
+                  (0x03, ord(self.car.shift_value)),
+                  (0x04, self.car.turn_switch_value),
+                  (0x05, self.car.horn_value),
+                  (0x06, self.car.light_switch_value),
+                  (0x07, self.car.light_flash_value),
+                  (0x08, self.car.parking_value),
+                  (0x09, self.car.wiper_f_sw_value),
+                  (0x0A, self.car.wiper_r_sw_value),
+                  (0x0B, self.car.door_lock_value),
+                  (0x0C, self.car.l_door_handle_value),
+                  (0x0D, self.car.r_door_handle_value),
+                  (0x0E, self.car.l_window_switch_value),
+                  (0x0F, self.car.r_window_switch_value),
+                  (0x10, self.car.hazard_value),
+                  (0x11, self.car.engine_value)]
+        pub.sendMessage("chassis", fields=fields)
 
     def loop(self):
+        # The shared memory readers (if used) post the snapshot of their ECU now, so it is handled in this frame
+        pub.sendMessage("frame")
         events = pygame.event.get()
         for event in events:
 
@@ -479,94 +482,105 @@ class GUI:
         self.elements["right_door"].set_door_status(self.car.r_door_position)
         self.elements["observer_ecu"].observer_id = self.car.observer_id
         self.elements["observer_ecu"].observer_code = self.car.observer_code
+        self.elements["observer_ecu"].event_count = self.car.observer_event_count
+        self.elements["observer_ecu"].events_dropped = self.car.observer_events_dropped
         self.elements["gateway_ecu"].gateway_id = self.car.gateway_id
         self.elements["gateway_ecu"].gateway_code = self.car.gateway_code
-
-    def parse_and_update_powertrain_data(self, message: str):
-        if message[0:4] == "EXU ":
-            message = message.replace("EXU", "").strip()
-            parts = message.split(" ")
-            for part in parts:
-                if part[0:2] == "00":
-                    self.car.shift_position = int(part[2:], 16)
-                if part[0:2] == "01":
-                    self.car.engine_status = int(part[2:], 16)
-                if part[0:2] == "02":
-                    self.car.brake_output = int(part[2:], 16)
-                if part[0:2] == "03":
-                    self.car.parking_brake_status = int(part[2:], 16)
-                if part[0:2] == "04":
-                    self.car.gear = int(part[2:], 16)
-                if part[0:2] == "05":
-                    self.car.power_steering = int(part[2:], 16)
-
-    def parse_and_update_chassis_data(self, message: str):
-        if message[0:4] == "EXU ":
-            message = message.replace("EXU", "").strip()
-            parts = message.split(" ")
-            for part in parts:
-                if part[0:2] == "00":
-                    self.car.engine_rpm = int(part[2:], 16)
-                if part[0:2] == "01":
-                    self.car.shift_position = int(part[2:], 16)
-                if part[0:2] == "02":
-                    self.car.engine_status = int(part[2:], 16)
-                if part[0:2] == "03":
-                    self.car.parking_brake_status = int(part[2:], 16)
-                if part[0:2] == "04":
-                    self.car.turn_signal_indicator = int(part[2:], 16)
-                if part[0:2] == "05":
-                    self.car.door_open_indicator = int(part[2:], 16)
-                if part[0:2] == "06":
-                    self.car.door_lock_indicator = int(part[2:], 16)
-                if part[0:2] == "07":
-                    self.car.speed_kph = int(part[2:], 16)
-
-    def parse_and_update_body_data(self, message: str):
-        if message[0:4] == "EXU ":
-            message = message.replace("EXU", "").strip()
-            parts = message.split(" ")
-            for part in parts:
-                if part[0:2] == "00":
-                    self.car.horn_operation = int(part[2:], 16)
-                if part[0:2] == "01":
-                    self.car.light_status = int(part[2:], 16)
-                if part[0:2] == "02":
-                    self.car.turn_signal_indicator = int(part[2:], 16)
-                if part[0:2] == "03":
-                    self.car.front_wiper_status = int(part[2:], 16)
-                if part[0:2] == "04":
-                    self.car.rear_wiper_status = int(part[2:], 16)
-                if part[0:2] == "05":
-                    self.car.door_lock_status = int(part[2:], 16)
-                if part[0:2] == "06":
-                    self.car.l_door_position = int(part[2:], 16)
-                if part[0:2] == "07":
-                    self.car.r_door_position = int(part[2:], 16)
-                if part[0:2] == "08":
-                    self.car.l_window_position = int(part[2:], 16)
-                if part[0:2] == "09":
-                    self.car.r_window_position = int(part[2:], 16)
-
-    def parse_and_update_observer_data(self, message: str):
-        if message[0:4] == "EXU ":
-            message = message.replace("EXU", "").strip()
-            parts = message.split(" ")
-            for part in parts:
-                if part[0:2] == "00":
-                    self.car.observer_id = int(part[2:], 16)
-                if part[0:2] == "01":
-                    self.car.observer_code = ObserverCode(int(part[2:], 16))
-
-    def parse_and_update_gateway_data(self, message: str):
-        if message[0:4] == "EXU ":
-            message = message.replace("EXU", "").strip()
-            parts = message.split(" ")
-            for part in parts:
-                if part[0:2] == "00":
-                    self.car.gateway_id = int(part[2:], 16)
-                if part[0:2] == "01":
-                    self.car.gateway_code = GatewayCode(int(part[2:], 16))
+        self.elements["gateway_ecu"].read_dropped = self.car.gateway_read_dropped
+        self.elements["gateway_ecu"].write_dropped = self.car.gateway_write_dropped
+
+    def parse_and_update_powertrain_data(self, message: EcuMessage):
+        if message.kind == "EXU":
+            for field_id, value in message.fields.items():
+                if field_id == 0x00:
+                    self.car.shift_position = value
+                if field_id == 0x01:
+                    self.car.engine_status = value
+                if field_id == 0x02:
+                    self.car.brake_output = value
+                if field_id == 0x03:
+                    self.car.parking_brake_status = value
+                if field_id == 0x04:
+                    self.car.gear = value
+                if field_id == 0x05:
+                    self.car.power_steering = value
+
+    def parse_and_update_chassis_data(self, message: EcuMessage):
+        if message.kind == "EXU":
+            for field_id, value in message.fields.items():
+                if field_id == 0x00:
+                    self.car.engine_rpm = value
+                if field_id == 0x01:
+                    self.car.shift_position = value
+                if field_id == 0x02:
+                    self.car.engine_status = value
+                if field_id == 0x03:
+                    self.car.parking_brake_status = value
+                if field_id == 0x04:
+                    self.car.turn_signal_indicator = value
+                if field_id == 0x05:
+                    self.car.door_open_indicator = value
+                if field_id == 0x06:
+                    self.car.door_lock_indicator = value
+                if field_id == 0x07:
+                    self.car.speed_kph = value
+
+    def parse_and_update_body_data(self, message: EcuMessage):
+        if message.kind == "EXU":
+            for field_id, value in message.fields.items():
+                if field_id == 0x00:
+                    self.car.horn_operation = value
+                if field_id == 0x01:
+                    self.car.light_status = value
+                if field_id == 0x02:
+                    self.car.turn_signal_indicator = value
+                if field_id == 0x03:
+                    self.car.front_wiper_status = value
+                if field_id == 0x04:
+                    self.car.rear_wiper_status = value
+                if field_id == 0x05:
+                    self.car.door_lock_status = value
+                if field_id == 0x06:
+                    self.car.l_door_position = value
+                if field_id == 0x07:
+                    self.car.r_door_position = value
+                if field_id == 0x08:
+                    self.car.l_window_position = value
+                if field_id == 0x09:
+                    self.car.r_window_position = value
+
+    def parse_and_update_observer_data(self, message: EcuMessage):
+        if message.kind == "EVT":
+            self.car.observer_events_dropped = message.dropped
+            for values in message.events:
+                event = ObserverEvent(values[0], values[1], values[2], ObserverCode(values[3]), values[4])
+                self.car.observer_events.append(event)
+                self.car.observer_event_count += 1
+                # The latest event is shown, even if the observer already reset its fields. A bad value is shown by
+                # its signal, like the observer_id field, a bad timing or CAN ID by the CAN ID
+                if event.code == ObserverCode.BAD_VALUE:
+                    self.car.observer_id = event.signal
+                else:
+                    self.car.observer_id = event.can_id
+                self.car.observer_code = event.code
+        if message.kind == "EXU":
+            for field_id, value in message.fields.items():
+                if field_id == 0x00:
+                    self.car.observer_id = value
+                if field_id == 0x01:
+                    self.car.observer_code = ObserverCode(value)
+
+    def parse_and_update_gateway_data(self, message: EcuMessage):
+        if message.kind == "EXU":
+            for field_id, value in message.fields.items():
+                if field_id == 0x00:
+                    self.car.gateway_id = value
+                if field_id == 0x01:
+                    self.car.gateway_code = GatewayCode(value)
+                if field_id == 0x02:
+                    self.car.gateway_read_dropped = value
+                if field_id == 0x03:
+                    self.car.gateway_write_dropped = value
 
 
 def main():
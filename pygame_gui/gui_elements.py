@@ -294,6 +294,8 @@ class Observer(Drawable):
         self.image_message = pygame.image.load(image_message)
         self.observer_id = 0
         self.observer_code = ObserverCode.OK
+        self.event_count = 0
+        self.events_dropped = 0
         self.font = pygame.font.SysFont('Franklin Gothic Heavy', 20)
         self.text_id = self.font.render(f"ALL", True, (0, 0, 0))
         self.text_code = self.font.render(f"OK", True, (0, 0, 0))
@@ -330,6 +332,12 @@ class Observer(Drawable):
 
         screen.blit(self.text_code, (self.pos_x + 30, self.pos_y + 44))
 
+        # Number of detections of the observer and how many of them did not reach the GUI
+        if timestamp - self.last_message_timestamp <= 1:
+            text_events = self.font.render(
+                f"EVT: {self.event_count}/{self.events_dropped}", True, (0, 0, 0))
+            screen.blit(text_events, (self.pos_x + 30, self.pos_y + 58))
+
 
 class Gateway(Drawable):
     def __init__(self, image_connected, image_disconnected, image_message, pos_x, pos_y):
@@ -340,6 +348,8 @@ class Gateway(Drawable):
         self.image_message = pygame.image.load(image_message)
         self.gateway_id = 0
         self.gateway_code = 0
+        self.read_dropped = 0
+        self.write_dropped = 0
         self.text = ""
         self.font = pygame.font.SysFont('Franklin Gothic Heavy', 20)
 
@@ -349,8 +359,12 @@ class Gateway(Drawable):
             self.text = ""
             text_id = self.font.render(f"", True, (0, 0, 0))
             text_code = self.font.render(f"", True, (0, 0, 0))
+            text_dropped = self.font.render(f"", True, (0, 0, 0))
 
         else:
+            # Frames that the rate limits dropped in both directions (read/write)
+            text_dropped = self.font.render(
+                f"DROP: {self.read_dropped}/{self.write_dropped}", True, (0, 0, 0))
             if self.gateway_code == GatewayCode.OK:
                 self.image = self.image_connected
                 text_id = self.font.render(f"ALL", True, (0, 0, 0))
@@ -370,6 +384,8 @@ class Gateway(Drawable):
 
         screen.blit(text_code, (self.pos_x + 30, self.pos_y + 44))
 
+        screen.blit(text_dropped, (self.pos_x + 30, self.pos_y + 58))
+
 
 class SteeringWheel(Drawable):
     def __init__(self, path, pos_x, pos_y):
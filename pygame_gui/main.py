@@ -19,6 +19,17 @@ def generate_256_bit_key() -> bytes:
     return bytes(key)
 
 
+def open_shared_states(selected_mitigations: [MitigationType, bool]):
+    shared_states = [SharedState("powertrain", POWERTRAIN),
+                     SharedState("chassis", CHASSIS, sends_commands=True),
+                     SharedState("body", BODY)]
+    if MitigationType.OBSERVER in selected_mitigations and selected_mitigations[MitigationType.OBSERVER]:
+        shared_states.append(SharedState("observer", OBSERVER))
+    if MitigationType.GATEWAY in selected_mitigations and selected_mitigations[MitigationType.GATEWAY]:
+        shared_states.append(SharedState("gateway", GATEWAY))
+    return shared_states
+
+
 def start_communication_threads(pts, selected_mitigations: [MitigationType, bool]):
     threads = []
     try:
@@ -127,6 +138,8 @@ def start_ecus(pts, selected_mitigations: [MitigationType, bool], encryption_key
         args = [BASE_PROJECT_PATH + '/penne_ecu/build/bin/penne_ecu', 'body', pts[0][1]]
         if selected_mitigations[MitigationType.ENCRYPTION]:
             args.append(encryption_key)
+        if not USE_BINARY_PROTOCOL:
+            args.append('text')
         process_body = subprocess.Popen(
             args, stdout=subprocess.DEVNULL,
             stderr=subprocess.STDOUT)
@@ -135,6 +148,8 @@ def start_ecus(pts, selected_mitigations: [MitigationType, bool], encryption_key
         args = [BASE_PROJECT_PATH + '/penne_ecu/build/bin/penne_ecu', 'chassis', pts[1][1]]
         if selected_mitigations[MitigationType.ENCRYPTION]:
             args.append(encryption_key)
+        if not USE_BINARY_PROTOCOL:
+            args.append('text')
         process_chassis = subprocess.Popen(
             args, stdout=subprocess.DEVNULL,
             stderr=subprocess.STDOUT)
@@ -143,6 +158,8 @@ def start_ecus(pts, selected_mitigations: [MitigationType, bool], encryption_key
         args = [BASE_PROJECT_PATH + '/penne_ecu/build/bin/penne_ecu', 'powertrain', pts[2][1]]
         if selected_mitigations[MitigationType.ENCRYPTION]:
             args.append(encryption_key)
+        if not USE_BINARY_PROTOCOL:
+            args.append('text')
         process_powertrain = subprocess.Popen(
             args, stdout=subprocess.DEVNULL,
             stderr=subprocess.STDOUT)
@@ -154,6 +171,8 @@ def start_ecus(pts, selected_mitigations: [MitigationType, bool], encryption_key
             args = [BASE_PROJECT_PATH + '/penne_ecu/build/bin/penne_ecu', 'observer', pts[3][1]]
             if selected_mitigations[MitigationType.ENCRYPTION]:
                 args.append(encryption_key)
+            if not USE_BINARY_PROTOCOL:
+                args.append('text')
             process_observer = subprocess.Popen(
                 args, stdout=subprocess.DEVNULL,
                 stderr=subprocess.STDOUT)
@@ -165,6 +184,8 @@ def start_ecus(pts, selected_mitigations: [MitigationType, bool], encryption_key
             args = [BASE_PROJECT_PATH + '/penne_ecu/build/bin/penne_ecu', 'gateway', pts[4][1]]
             if selected_mitigations[MitigationType.ENCRYPTION]:
                 args.append(encryption_key)
+            if not USE_BINARY_PROTOCOL:
+                args.append('text')
             process_gateway = subprocess.Popen(
                 args, stdout=subprocess.DEVNULL,
                 stderr=subprocess.STDOUT)
@@ -196,10 +217,14 @@ def main():
     subprocess.Popen(args)
 
     # TODO change check for len(4) and len(5) according which mitigation type
-    pts, relay_processes = start_socat_relays(selected_mitigations)
-    if len(pts) < 3 or len(relay_processes) < 3:
-        logging.warning("Failed to start socat relays")
-        exit(3)
+    if USE_SHARED_MEMORY:
+        # The ECUs publish their state in shared memory, no socat relays are needed
+        pts, relay_processes = [(SHM_PORT, SHM_PORT)] * 5, []
+    else:
+        pts, relay_processes = start_socat_relays(selected_mitigations)
+        if len(pts) < 3 or len(relay_processes) < 3:
+            logging.warning("Failed to start socat relays")
+            exit(3)
 
     # Generate a random 256-bit Encryption Key for the AES-GCM Encryption of ECUs CAN messages
     # All ECUs share the same key for now
@@ -213,7 +238,13 @@ def main():
     if ecu_processes is None:
         exit(4)
 
-    threads = start_communication_threads(pts, selected_mitigations)
+    shared_states = []
+    if USE_SHARED_MEMORY:
+        shared_states = open_shared_states(selected_mitigations)
+        threads = [CanLogger()]
+        threads[0].thread.start()
+    else:
+        threads = start_communication_threads(pts, selected_mitigations)
 
     logging.info("Initializing car")
     car = Car()
@@ -236,6 +267,9 @@ def main():
         thread.stopped.set()
         thread.thread.join()
 
+    for shared_state in shared_states:
+        shared_state.close()
+
     for process in ecu_processes:
         logging.info(f"Killing Process {process.args}")
         process.kill()